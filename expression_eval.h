@@ -7,6 +7,47 @@
 #include <cassert>
 #include <exception>
 #include <map>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <cctype>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#ifdef __linux__
+// NUMA topology and thread affinity, see `NumaTopology`
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef EXPRESSION_RESULT_CACHE
+// POSIX only, hence opt in, see `ResultCache`
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+
+#ifdef EXPRESSION_SHARDING
+// POSIX only, hence opt in, see `evaluateSharded`
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#endif
 
 // custom (basic) Either implementation
 
@@ -77,7 +118,8 @@ enum TokenKind {
     tkLess, tkGreater, tkLessEq, tkGreaterEq,
     tkEqual, tkUnequal,
     tkAnd, tkOr, tkNot,
-    tkSqrt
+    tkSqrt,
+    tkComma, tkSelect
 };
 
 static inline string toString(TokenKind tkKind){
@@ -100,6 +142,8 @@ static inline string toString(TokenKind tkKind){
         case tkEqual : return "==";
         case tkNot : return "!";
         case tkSqrt : return "sqrt";
+        case tkComma : return ",";
+        case tkSelect : return "select";
         case tkIdent: return "Ident";
         case tkFloat: return "Float";
         default: return "Invalid " + tkKind;
@@ -142,7 +186,8 @@ static inline Token toIdentAndClear(string &s){
 enum NodeKind {
     nkUnary, nkBinary, nkFloat, nkIdent,
     nkBracketExpr, // for map access
-    nkExpression // for root as well as parens
+    nkExpression, // for root as well as parens
+    nkSelect // `select(cond, a, b)`
     // , nkCall (for sqrt, pow etc), ?
 };
 
@@ -178,12 +223,244 @@ static inline string toString(NodeKind kind){
 	case nkBracketExpr:
 	    result = "nkBracketExpr";
 	    break;
+	case nkSelect:
+	    result = "nkSelect";
+	    break;
 
 	default: break;
     }
     return result;
 }
 
+// Span tracing
+//
+// Compiling with `EXPRESSION_TRACING` defined records a span for parsing, compiling,
+// binding, each evaluated chunk and loading / saving expressions. User code can add its
+// own stages (reading, writing) with `TRACE_SPAN("name")`. Every thread writes into its
+// own ring buffer of the last `EXPRESSION_TRACE_CAPACITY` spans without locking, buffers
+// of exited threads are reused by new ones.
+// `Tracer::Global().WriteJson(path)` dumps all of them in the Chrome trace event format
+// for chrome://tracing or Perfetto; call it while no thread is recording.
+// Without `EXPRESSION_TRACING` the macro expands to nothing.
+
+#ifdef EXPRESSION_TRACING
+
+#ifndef EXPRESSION_TRACE_CAPACITY
+#define EXPRESSION_TRACE_CAPACITY 4096
+#endif
+
+struct TraceEvent {
+    // `name` must be a string literal, it is not copied
+    const char* name;
+    // nanoseconds since the tracer was created
+    uint64_t start;
+    uint64_t duration;
+};
+
+class TraceBuffer {
+public:
+    static const size_t capacity = EXPRESSION_TRACE_CAPACITY;
+    static_assert((capacity & (capacity - 1)) == 0, "EXPRESSION_TRACE_CAPACITY must be a power of 2");
+    TraceBuffer(uint32_t tid): events(capacity), head(0), tid(tid), inUse(true) {};
+    void Push(const TraceEvent& ev){
+	// only the owning thread pushes, the oldest spans are overwritten
+	auto h = head.load(memory_order_relaxed);
+	events[h & (capacity - 1)] = ev;
+	head.store(h + 1, memory_order_release);
+    };
+    vector<TraceEvent> events;
+    atomic<uint64_t> head;
+    uint32_t tid;
+    // owned by a running thread, guarded by the tracer's mutex
+    bool inUse;
+};
+
+static inline void appendJsonString(string& json, const char* s){
+    for(; *s; s++){
+	char c = *s;
+	if(c == '"' || c == '\\'){
+	    json += '\\';
+	    json += c;
+	} else if((unsigned char)c < 0x20){
+	    char escaped[8];
+	    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)c);
+	    json += escaped;
+	} else {
+	    json += c;
+	}
+    }
+}
+
+class Tracer {
+public:
+    static Tracer& Global(){
+	static Tracer tracer;
+	return tracer;
+    };
+    TraceBuffer& Local(){
+	// the buffer of the calling thread, taken on its first span and handed back when the
+	// thread exits, so short lived threads reuse the buffers (and tids) of finished ones
+	thread_local LocalBuffer local;
+	if(local.buf == nullptr) local.buf = Acquire();
+	return *local.buf;
+    };
+    uint64_t Now() const {
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count();
+    };
+    string ToJson(){
+	lock_guard<mutex> lock(buffersMutex);
+	string json = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+	bool first = true;
+	char line[256];
+	for(auto& buf : buffers){
+	    uint64_t head = buf->head.load(memory_order_acquire);
+	    uint64_t begin = head > TraceBuffer::capacity ? head - TraceBuffer::capacity : 0;
+	    for(uint64_t i = begin; i < head; i++){
+		auto& ev = buf->events[i & (TraceBuffer::capacity - 1)];
+		json += first ? "\n{\"name\": \"" : ",\n{\"name\": \"";
+		appendJsonString(json, ev.name);
+		// timestamps are in microseconds
+		snprintf(line, sizeof(line), "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f}",
+			 buf->tid, ev.start / 1000.0, ev.duration / 1000.0);
+		json += line;
+		first = false;
+	    }
+	}
+	return json + "\n]}\n";
+    };
+    void WriteJson(const string& path){
+	ofstream out(path, ios::binary);
+	out << ToJson();
+	if(!out) throw runtime_error("Could not write trace to " + path);
+    };
+    size_t Count(){
+	// number of spans currently held by all buffers
+	lock_guard<mutex> lock(buffersMutex);
+	size_t n = 0;
+	for(auto& buf : buffers) n += min(buf->head.load(memory_order_acquire), (uint64_t)TraceBuffer::capacity);
+	return n;
+    };
+    void Clear(){
+	lock_guard<mutex> lock(buffersMutex);
+	for(auto& buf : buffers) buf->head.store(0);
+    };
+    size_t BufferCount(){
+	// at most the number of threads that recorded spans at the same time
+	lock_guard<mutex> lock(buffersMutex);
+	return buffers.size();
+    };
+private:
+    struct LocalBuffer {
+	TraceBuffer* buf = nullptr;
+	~LocalBuffer(){
+	    if(buf != nullptr) Tracer::Global().Release(buf);
+	};
+    };
+    TraceBuffer* Acquire(){
+	lock_guard<mutex> lock(buffersMutex);
+	for(auto& buf : buffers){
+	    if(!buf->inUse){
+		// the spans of the previous owner stay until they are overwritten
+		buf->inUse = true;
+		return buf.get();
+	    }
+	}
+	buffers.push_back(unique_ptr<TraceBuffer>(new TraceBuffer((uint32_t)buffers.size() + 1)));
+	return buffers.back().get();
+    };
+    void Release(TraceBuffer* buf){
+	lock_guard<mutex> lock(buffersMutex);
+	buf->inUse = false;
+    };
+    Tracer(): origin(chrono::steady_clock::now()) {};
+    chrono::steady_clock::time_point origin;
+    mutex buffersMutex;
+    vector<unique_ptr<TraceBuffer>> buffers;
+};
+
+class TraceSpan {
+public:
+    TraceSpan(const char* name): name(name), start(Tracer::Global().Now()) {};
+    ~TraceSpan(){
+	auto& tracer = Tracer::Global();
+	tracer.Local().Push(TraceEvent{name, start, tracer.Now() - start});
+    };
+    const char* name;
+    uint64_t start;
+};
+
+#define TRACE_SPAN_CONCAT_(a, b) a##b
+#define TRACE_SPAN_CONCAT(a, b) TRACE_SPAN_CONCAT_(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_SPAN_CONCAT(traceSpan, __LINE__)(name)
+
+#else
+
+#define TRACE_SPAN(name)
+
+#endif
+
+// Symbol table
+//
+// All identifiers are interned into a single process wide table when they are parsed.
+// Nodes only store the dense integer id, so tens of thousands of expressions over a few
+// hundred variables share one copy of each name, and comparisons are integer compares.
+// Interning and lookups are thread safe; ids are never reused or invalidated.
+
+static const uint32_t noSymbol = numeric_limits<uint32_t>::max();
+
+class SymbolTable {
+public:
+    static SymbolTable& Global(){
+	static SymbolTable table;
+	return table;
+    };
+    uint32_t Intern(const string& name){
+	{
+	    shared_lock<shared_timed_mutex> lock(mutex);
+	    auto it = ids.find(name);
+	    if(it != ids.end()) return it->second;
+	}
+	unique_lock<shared_timed_mutex> lock(mutex);
+	auto it = ids.find(name);
+	if(it != ids.end()) return it->second;
+	uint32_t id = names.size();
+	names.push_back(name);
+	ids[name] = id;
+	return id;
+    };
+    // returns `noSymbol` if `name` was never interned
+    uint32_t Find(const string& name) const {
+	shared_lock<shared_timed_mutex> lock(mutex);
+	auto it = ids.find(name);
+	return it != ids.end() ? it->second : noSymbol;
+    };
+    // the reference stays valid for the lifetime of the program
+    const string& Name(uint32_t id) const {
+	shared_lock<shared_timed_mutex> lock(mutex);
+	return names.at(id);
+    };
+    size_t Size() const {
+	shared_lock<shared_timed_mutex> lock(mutex);
+	return names.size();
+    };
+private:
+    SymbolTable() {};
+    mutable shared_timed_mutex mutex;
+    // a deque never moves its elements when growing
+    deque<string> names;
+    map<string, uint32_t> ids;
+};
+
+static inline uint32_t internSymbol(const string& name){
+    return SymbolTable::Global().Intern(name);
+}
+
+static inline const string& symbolName(uint32_t id){
+    return SymbolTable::Global().Name(id);
+}
+
+struct FusedPredicate;
+
 class Node {
 public:
     NodeKind kind;
@@ -218,9 +495,12 @@ public:
 	throw domain_error("Invalid call to `GetVal` for node of kind " + toString(kind));
 	return 0.0;
     };
-    virtual string GetIdent() {
+    virtual const string& GetIdent() {
 	throw domain_error("Invalid call to `GetIdent` for node of kind " + toString(kind));
-	return "";
+    };
+    virtual uint32_t GetIdentId() {
+	throw domain_error("Invalid call to `GetIdentId` for node of kind " + toString(kind));
+	return noSymbol;
     };
     virtual shared_ptr<Node> GetExprNode() {
 	throw domain_error("Invalid call to `GetExprNode` for node of kind " + toString(kind));
@@ -243,6 +523,21 @@ public:
     virtual void SetExprNode(shared_ptr<Node>) {
 	throw domain_error("Invalid call to `SetExprNode` for node of kind " + toString(kind));
     };
+    virtual shared_ptr<Node> GetCondition() {
+	throw domain_error("Invalid call to `GetCondition` for node of kind " + toString(kind));
+	return nullptr;
+    };
+    virtual shared_ptr<Node> GetTrueArm() {
+	throw domain_error("Invalid call to `GetTrueArm` for node of kind " + toString(kind));
+	return nullptr;
+    };
+    virtual shared_ptr<Node> GetFalseArm() {
+	throw domain_error("Invalid call to `GetFalseArm` for node of kind " + toString(kind));
+	return nullptr;
+    };
+    virtual atomic<const FusedPredicate*>& GetFused() {
+	throw domain_error("Invalid call to `GetFused` for node of kind " + toString(kind));
+    };
 };
 
 class UnaryNode: public Node {
@@ -263,14 +558,19 @@ public:
         op(op), left(left), right(right) {
         kind = nkBinary;
     };
+    ~BinaryNode();
     BinaryOpKind GetBinaryOp() override {return op;};
     shared_ptr<Node> GetLeft() override {return left;};
     shared_ptr<Node> GetRight() override {return right;};
-    void SetLeft(shared_ptr<Node> node) override {left = node;};
-    void SetRight(shared_ptr<Node> node) override {right = node;};
+    void SetLeft(shared_ptr<Node> node) override {left = node; ResetFused();};
+    void SetRight(shared_ptr<Node> node) override {right = node; ResetFused();};
+    atomic<const FusedPredicate*>& GetFused() override {return fused;};
+    void ResetFused();
     BinaryOpKind op;
     shared_ptr<Node> left;
     shared_ptr<Node> right;
+    // range / set check matched on the first batch evaluation, see `fusedPredicate`
+    atomic<const FusedPredicate*> fused{nullptr};
 };
 
 class FloatNode: public Node {
@@ -284,11 +584,14 @@ public:
 
 class IdentNode: public Node {
 public:
-    IdentNode(string ident): ident(ident) {
+    IdentNode(const string& ident): id(internSymbol(ident)), name(&symbolName(id)) {
         kind = nkIdent;
     };
-    string GetIdent() override {return ident;};
-    string ident;
+    // the interned name is stable, so reading it takes no lock of the symbol table
+    const string& GetIdent() override {return *name;};
+    uint32_t GetIdentId() override {return id;};
+    uint32_t id;
+    const string* name;
 };
 
 class ExpressionNode: public Node {
@@ -305,17 +608,39 @@ class BracketExprNode: public Node {
 public:
     // this node is bracket expressions, i.e. map access via
     // `foo[bar]`
-    BracketExprNode(shared_ptr<Node> node, shared_ptr<Node> arg): node(node), arg(arg) {
+    BracketExprNode(shared_ptr<Node> node, shared_ptr<Node> arg): node(node), arg(arg), id(noSymbol) {
 	kind = nkBracketExpr;
+	UpdateId();
     };
     shared_ptr<Node> GetNode() override { return node; };
-    void SetNode(shared_ptr<Node> n) override { node = n; };
+    void SetNode(shared_ptr<Node> n) override { node = n; UpdateId(); };
     shared_ptr<Node> GetArg() override { return arg; };
-    void SetArg(shared_ptr<Node> n) override { arg = n; };
+    void SetArg(shared_ptr<Node> n) override { arg = n; UpdateId(); };
+    // symbol of the accessed element, e.g. `foo[1]`
+    uint32_t GetIdentId() override { return id; };
+    void UpdateId(){
+	if(node != nullptr && arg != nullptr && node->kind == nkIdent && arg->kind == nkFloat){
+	    id = internSymbol(node->GetIdent() + "[" + to_string((int)arg->GetVal()) + "]");
+	}
+    };
     shared_ptr<Node> node;
     shared_ptr<Node> arg;
+    uint32_t id;
 };
 
+class SelectNode: public Node {
+public:
+    // `select(cond, a, b)` is `a` where `cond` holds and `b` elsewhere
+    SelectNode(shared_ptr<Node> cond, shared_ptr<Node> a, shared_ptr<Node> b): cond(cond), a(a), b(b) {
+	kind = nkSelect;
+    };
+    shared_ptr<Node> GetCondition() override { return cond; };
+    shared_ptr<Node> GetTrueArm() override { return a; };
+    shared_ptr<Node> GetFalseArm() override { return b; };
+    shared_ptr<Node> cond;
+    shared_ptr<Node> a;
+    shared_ptr<Node> b;
+};
 
 using Expression = shared_ptr<Node>;
 
@@ -399,6 +724,10 @@ inline string astToStr(shared_ptr<Node> n){
         case nkBracketExpr:
             res += "([] " + astToStr(n->GetNode()) + " " + astToStr(n->GetArg()) + ")";
             break;
+        case nkSelect:
+            res += "(select " + astToStr(n->GetCondition()) + " " + astToStr(n->GetTrueArm()) + " " +
+                astToStr(n->GetFalseArm()) + ")";
+            break;
     }
     return res;
 }
@@ -439,6 +768,10 @@ static inline shared_ptr<Node> bracketExprNode(){
     return shared_ptr<Node>(new BracketExprNode(nullptr, nullptr));
 }
 
+static inline shared_ptr<Node> selectNode(shared_ptr<Node> cond, shared_ptr<Node> a, shared_ptr<Node> b){
+    return shared_ptr<Node>(new SelectNode(cond, a, b));
+}
+
 static inline shared_ptr<Node> identOrFloatNode(Token tok){
     try{
         double val = stod(tok.name);
@@ -541,6 +874,12 @@ inline shared_ptr<Node> parseNode(Token tok, vector<Token>& tokens, int idx){
         }
         case tkSqrt: // do nothing
             break;
+        case tkSelect:
+	    // arguments are parsed eagerly by `tokensToAst`
+	    result = selectNode(nullptr, nullptr, nullptr);
+            break;
+        case tkComma:
+	    throw domain_error("`,` is only valid between the arguments of `select`!");
         case tkIdent:
             result = identOrFloatNode(tokens[idx]);
             break;
@@ -733,6 +1072,24 @@ static inline int findClosingBracket(vector<Token> tokens, int idx){
 }
 
 
+static inline Expression tokensToAst(vector<Token> tokens);
+
+static inline vector<vector<Token>> splitArguments(const vector<Token>& tokens){
+    // splits the tokens of an argument list at the commas outside of nested parens
+    vector<vector<Token>> args(1);
+    int parensCounter = 0;
+    for(auto& tok : tokens){
+	if(tok.kind == tkParensOpen) parensCounter++;
+	if(tok.kind == tkParensClose) parensCounter--;
+	if(tok.kind == tkComma && parensCounter == 0){
+	    args.push_back(vector<Token>());
+	    continue;
+	}
+	args.back().push_back(tok);
+    }
+    return args;
+}
+
 static inline Expression tokensToAst(vector<Token> tokens){
     // parses the given vector of tokens into an AST. Done by respecting operator precedence
     Expression result = nullptr;
@@ -758,7 +1115,20 @@ static inline Expression tokensToAst(vector<Token> tokens){
 	// TODO: can't we do the same for regular parens and then have simpler stuff without
 	// the whole set last node stuff? No, that won't help too much, because that's due to
 	// parsing from left to right
-	switch(nextOp.kind){
+	if(n->kind == nkSelect){
+	    // `select` is always followed by its parenthesized arguments
+	    int closingIdx = findClosingParens(tokens, idx+2);
+	    auto args = splitArguments(sliceCopy(tokens, idx+2, closingIdx-1));
+	    if(args.size() != 3){
+		throw domain_error("`select` takes 3 arguments, `select(cond, a, b)`, but got " + to_string(args.size()));
+	    }
+	    for(auto& arg : args){
+		if(arg.size() == 0) throw domain_error("Empty argument to `select`!");
+	    }
+	    n = selectNode(tokensToAst(args[0]), tokensToAst(args[1]), tokensToAst(args[2]));
+	    idx = closingIdx;
+	}
+	else switch(nextOp.kind){
 	    case tkBracketOpen: {
 		// parse bracket expression directly
 		// current node needs to be an ident, make that exception
@@ -827,6 +1197,9 @@ static inline Expression tokensToAst(vector<Token> tokens){
 		case nkBracketExpr:
 		    result = n;
 		    break;
+		case nkSelect:
+		    result = n;
+		    break;
 		default: break;
             }
             // append to last
@@ -957,183 +1330,308 @@ inline Either<double, bool> orCmp(Either<double, bool> x, Either<double, bool> y
     }
 }
 
-inline Either<double, bool> evaluate(map<string, float> m, map<string, map<int, float>> maps, shared_ptr<Node> n){
+// Variable sources
+//
+// `evaluate` reads variables through a source instead of requiring the data to be
+// copied into maps. A source resolves a variable name to an id once and then returns
+// values by id:
+//   size_t GetScalarId(const string& name) const;
+//   size_t GetArrayId(const string& name) const;
+//   double GetScalar(size_t id) const;
+//   double GetElement(size_t id, int idx) const;
+// Unknown variables resolve to `noVariable` and read as 0, like a missing map key.
+
+static const size_t noVariable = numeric_limits<size_t>::max();
+
+struct FloatSpan {
+    const float* data;
+    size_t size;
+};
+
+class MapSource {
+public:
+    // reads from the classic input maps without copying them. Ids point to the
+    // map entries and stay valid as long as the keys are not erased, i.e. values
+    // can be updated in place between events.
+    MapSource(const map<string, float>& m, const map<string, map<int, float>>& maps): m(m), maps(maps) {};
+    size_t GetScalarId(const string& name) const {
+	auto it = m.find(name);
+	return it != m.end() ? (size_t)&it->second : noVariable;
+    };
+    size_t GetArrayId(const string& name) const {
+	auto it = maps.find(name);
+	return it != maps.end() ? (size_t)&it->second : noVariable;
+    };
+    double GetScalar(size_t id) const {
+	return id != noVariable ? *(const float*)id : 0.0;
+    };
+    double GetElement(size_t id, int idx) const {
+	if(id == noVariable) return 0.0;
+	auto& arr = *(const map<int, float>*)id;
+	auto it = arr.find(idx);
+	return it != arr.end() ? it->second : 0.0;
+    };
+    const map<string, float>& m;
+    const map<string, map<int, float>>& maps;
+};
+
+class FlatLayout {
+public:
+    // names of the scalars and arrays of a flat event, shared by all `FlatSource`s
+    FlatLayout(vector<string> scalars, vector<string> arrays = {}): scalars(scalars), arrays(arrays) {};
+    static size_t Find(const vector<string>& names, const string& name){
+	auto it = find(names.begin(), names.end(), name);
+	return it != names.end() ? (size_t)(it - names.begin()) : noVariable;
+    };
+    vector<string> scalars;
+    vector<string> arrays;
+};
+
+class FlatSource {
+public:
+    // reads an event stored as a flat array of scalars (ordered as in `layout`)
+    // plus optional spans for the arrays
+    FlatSource(const FlatLayout& layout, const float* values, const FloatSpan* spans = nullptr):
+	layout(layout), values(values), spans(spans) {};
+    size_t GetScalarId(const string& name) const { return FlatLayout::Find(layout.scalars, name); };
+    size_t GetArrayId(const string& name) const { return FlatLayout::Find(layout.arrays, name); };
+    double GetScalar(size_t id) const { return id != noVariable ? values[id] : 0.0; };
+    FloatSpan GetArray(size_t id) const {
+	if(id == noVariable) return FloatSpan{nullptr, 0};
+	if(spans == nullptr) throw domain_error("FlatSource without spans cannot read array " + layout.arrays[id] + "!");
+	return spans[id];
+    };
+    double GetElement(size_t id, int idx) const {
+	auto arr = GetArray(id);
+	return idx >= 0 && (size_t)idx < arr.size ? arr.data[idx] : 0.0;
+    };
+    const FlatLayout& layout;
+    const float* values;
+    const FloatSpan* spans;
+};
+
+template <class T>
+class StructLayout {
+public:
+    // maps variable names to members of the event struct `T`
+    StructLayout& AddScalar(const string& name, float T::* member){
+	floats.push_back(member);
+	scalars.push_back(make_pair(name, 2 * (floats.size() - 1)));
+	return *this;
+    };
+    StructLayout& AddScalar(const string& name, double T::* member){
+	doubles.push_back(member);
+	scalars.push_back(make_pair(name, 2 * (doubles.size() - 1) + 1));
+	return *this;
+    };
+    StructLayout& AddArray(const string& name, vector<float> T::* member){
+	arrays.push_back(make_pair(name, member));
+	return *this;
+    };
+    // scalar ids store the index into `floats` or `doubles` and the type in the lowest bit
+    vector<pair<string, size_t>> scalars;
+    vector<float T::*> floats;
+    vector<double T::*> doubles;
+    vector<pair<string, vector<float> T::*>> arrays;
+};
+
+template <class T>
+class StructSource {
+public:
+    StructSource(const StructLayout<T>& layout, const T& event): layout(layout), event(event) {};
+    size_t GetScalarId(const string& name) const {
+	for(auto& s : layout.scalars){
+	    if(s.first == name) return s.second;
+	}
+	return noVariable;
+    };
+    size_t GetArrayId(const string& name) const {
+	for(size_t i = 0; i < layout.arrays.size(); i++){
+	    if(layout.arrays[i].first == name) return i;
+	}
+	return noVariable;
+    };
+    double GetScalar(size_t id) const {
+	if(id == noVariable) return 0.0;
+	if(id & 1) return event.*(layout.doubles[id >> 1]);
+	return event.*(layout.floats[id >> 1]);
+    };
+    FloatSpan GetArray(size_t id) const {
+	if(id == noVariable) return FloatSpan{nullptr, 0};
+	auto& v = event.*(layout.arrays[id].second);
+	return FloatSpan{v.data(), v.size()};
+    };
+    double GetElement(size_t id, int idx) const {
+	auto arr = GetArray(id);
+	return idx >= 0 && (size_t)idx < arr.size ? arr.data[idx] : 0.0;
+    };
+    const StructLayout<T>& layout;
+    const T& event;
+};
+
+template <class Source>
+inline Either<double, bool> evaluate(const Source& src, shared_ptr<Node> n){
+    // evaluates `n` reading the variables from `src`, see `MapSource` for the interface.
+    // Variables are looked up by name on each access, bind a `CompiledExpression` to
+    // resolve them only once.
     switch(n->kind){
 	case nkBinary:
 	    // recurse on both childern
 	    switch(n->GetBinaryOp()){
-		case boMul: return multiply(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boDiv: return divide(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boPlus: return plusCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boMinus: return minusCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boLess: return lessCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boGreater: return greaterCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boLessEq: return lessEq(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boGreaterEq: return greaterEq(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boEqual: return equal(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boUnequal: return unequal(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boAnd: return andCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
-		case boOr: return orCmp(evaluate(m, maps, n->GetLeft()), evaluate(m, maps, n->GetRight()));
+		case boMul: return multiply(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boDiv: return divide(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boPlus: return plusCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boMinus: return minusCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boLess: return lessCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boGreater: return greaterCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boLessEq: return lessEq(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boGreaterEq: return greaterEq(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boEqual: return equal(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boUnequal: return unequal(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boAnd: return andCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
+		case boOr: return orCmp(evaluate(src, n->GetLeft()), evaluate(src, n->GetRight()));
 		default:
 		    throw runtime_error("Invalid binary op kind for token " + astToStr(n));
 	    }
 	case nkUnary:
 	    // apply unary op
 	    switch(n->GetUnaryOp()){
-		case uoPlus: return evaluate(m, maps, n->GetUnaryNode());
-		case uoMinus: return negative(evaluate(m, maps, n->GetUnaryNode()));
-		case uoNot: return negateCmp(evaluate(m, maps, n->GetUnaryNode()));
+		case uoPlus: return evaluate(src, n->GetUnaryNode());
+		case uoMinus: return negative(evaluate(src, n->GetUnaryNode()));
+		case uoNot: return negateCmp(evaluate(src, n->GetUnaryNode()));
 	    }
 	case nkIdent:
 	    // return value stored for ident
-	    // TODO: check if element exists in map (/in REST)
-	    return Left<double, bool>(m[n->GetIdent()]);
+	    return Left<double, bool>(src.GetScalar(src.GetScalarId(n->GetIdent())));
 	case nkFloat:
 	    return Left<double, bool>(n->GetVal());
 	case nkExpression:
-	    return evaluate(m, maps, n->GetExprNode());
-	case nkBracketExpr:
+	    return evaluate(src, n->GetExprNode());
+	case nkBracketExpr: {
 	    // get identifier from maps
-	    auto obs = n->GetNode();
-	    auto mapObs = maps[obs->GetIdent()];
-	    auto arg = n->GetArg();
-	    return Left<double, bool>(mapObs[(int)arg->GetVal()]);
+	    auto id = src.GetArrayId(n->GetNode()->GetIdent());
+	    return Left<double, bool>(src.GetElement(id, (int)n->GetArg()->GetVal()));
+	}
+	case nkSelect: {
+	    // only the selected arm is evaluated
+	    auto cond = evaluate(src, n->GetCondition());
+	    if(!cond.isRight()) throw domain_error("The condition of `select` must be a bool in " + astToStr(n));
+	    return evaluate(src, cond.unsafeGetRight() ? n->GetTrueArm() : n->GetFalseArm());
+	}
     }
     throw logic_error("Invalid code branch in `evaluate`. Should never end up here!");
 }
 
-static inline void raiseIfLastOp(bool lastWasBinaryOp, bool lastWasUnaryOp, bool lastWasIdentOrFloat = false){
-    if(!lastWasIdentOrFloat && lastWasBinaryOp){
-	throw runtime_error("Parsing of expression failed. Binary operation followed by binary operation!");
-    }
-    else if(!lastWasIdentOrFloat && lastWasUnaryOp){
-	throw runtime_error("Parsing of expression failed. Unary operation followed by binary operation!");
+inline Either<double, bool> evaluate(const map<string, float>& m, const map<string, map<int, float>>& maps, shared_ptr<Node> n){
+    return evaluate(MapSource(m, maps), n);
+}
+
+inline Either<double, bool> evaluate(const map<string, float>& m, shared_ptr<Node> n){
+    map<string, map<int, float>> noMaps;
+    return evaluate(MapSource(m, noMaps), n);
+}
+
+static inline bool isBinaryToken(TokenKind kind){
+    switch(kind){
+	case tkMul: case tkDiv: case tkPlus: case tkMinus: case tkLess: case tkGreater: case tkLessEq:
+	case tkGreaterEq: case tkAnd: case tkOr: case tkUnequal: case tkEqual:
+	    return true;
+	default:
+	    return false;
     }
 }
 
 static inline void verifyTokens(vector<Token> tokens){
+    // checks that operands and operators alternate, so that malformed input is rejected
+    // here instead of reaching the parser. `expectOperand` is true wherever a variable,
+    // number, opening parenthesis or prefix operator has to follow.
+    bool expectOperand = true;
     bool lastWasBinaryOp = false;
     bool lastWasUnaryOp = false;
-    bool lastWasIdentOrFloat = false;
     int parensCounter = 0;
     bool inBracket = false;
-    //int idx = 0;
-    for(auto tok : tokens){
-	switch(tok.kind){
-	    case tkParensOpen :
+    for(size_t i = 0; i < tokens.size(); i++){
+	auto kind = tokens[i].kind;
+	bool binary = isBinaryToken(kind);
+	if(binary && expectOperand && kind != tkPlus && kind != tkMinus){
+	    // `+` and `-` may be prefix operators
+	    if(lastWasBinaryOp) throw runtime_error("Parsing of expression failed. Binary operation followed by binary operation!");
+	    if(lastWasUnaryOp) throw runtime_error("Parsing of expression failed. Unary operation followed by binary operation!");
+	    throw runtime_error("Parsing of expression failed. Binary operation " + toString(kind) + " without left operand!");
+	}
+	lastWasBinaryOp = binary && !expectOperand;
+	lastWasUnaryOp = (binary && expectOperand) || kind == tkNot;
+	if(binary){
+	    expectOperand = true;
+	    continue;
+	}
+	switch(kind){
+	    case tkParensOpen:
+		if(!expectOperand) throw runtime_error("Parsing of expression failed. Opening parenthesis after an operand!");
 		parensCounter++;
 		break;
-	    case tkParensClose :
+	    case tkParensClose:
 		parensCounter--;
 		if(parensCounter < 0){
 		    throw runtime_error("Parsing of expression faild. Closing parenthesis before opening!");
 		}
+		if(expectOperand) throw runtime_error("Parsing of expression failed. Missing operand before closing parenthesis!");
 		break;
-	    case tkBracketOpen :
+	    case tkBracketOpen:
 		if(inBracket){
 		    throw runtime_error("Nested bracket expressions not allowed.");
 		}
+		if(expectOperand) throw runtime_error("Parsing of expression failed. Bracket without a variable!");
 		inBracket = true;
+		expectOperand = true;
 		break;
-	    case tkBracketClose :
+	    case tkBracketClose:
 		if(!inBracket){
 		    throw runtime_error("Closing bracket without opening bracket not allowed.");
 		}
+		if(expectOperand) throw runtime_error("Parsing of expression failed. Empty or incomplete bracket expression!");
 		inBracket = false;
 		break;
-	    case tkMul :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkDiv :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkPlus :
-		// TODO: check for unary!
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkMinus :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkLess :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkGreater :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkLessEq :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
+	    case tkNot:
+		if(!expectOperand) throw runtime_error("Parsing of expression failed. Unary operation after an operand!");
 		break;
-	    case tkGreaterEq :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
+	    case tkComma:
+		if(expectOperand) throw runtime_error("Parsing of expression failed. Missing argument before `,`!");
+		expectOperand = true;
 		break;
-	    case tkAnd :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkOr :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkUnequal :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkEqual :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasBinaryOp = true;
-		lastWasUnaryOp = false;
-		break;
-	    case tkNot :
-		raiseIfLastOp(lastWasBinaryOp, lastWasUnaryOp, lastWasIdentOrFloat);
-		lastWasUnaryOp = true;
-		lastWasBinaryOp = false;
+	    case tkSelect:
+		if(!expectOperand || i + 1 >= tokens.size() || tokens[i + 1].kind != tkParensOpen){
+		    throw runtime_error("Parsing of expression failed. Misplaced `select`!");
+		}
 		break;
 	    case tkIdent:
-		lastWasIdentOrFloat = true;
-		lastWasBinaryOp = false;
-		lastWasUnaryOp = false;
-		break;
 	    case tkFloat:
-		lastWasIdentOrFloat = true;
-		lastWasBinaryOp = false;
-		lastWasUnaryOp = false;
+		if(!expectOperand) throw runtime_error("Parsing of expression failed. Two operands without an operation in between!");
+		expectOperand = false;
 		break;
 	    default:
-		throw runtime_error("Token of kind " + toString(tok.kind) + " is not supported yet!");
+		throw runtime_error("Token of kind " + toString(kind) + " is not supported yet!");
 	}
     }
     if(parensCounter != 0){
 	throw runtime_error("Parsing of expression faild. Closing parentheses missing!");
     }
+    if(inBracket){
+	throw runtime_error("Parsing of expression failed. Closing bracket missing!");
+    }
     if(lastWasBinaryOp){
 	throw runtime_error("Parsing of expression faild. Last token was a binary token!");
     }
     if(lastWasUnaryOp){
 	throw runtime_error("Parsing of expression faild. Last token was a unary token!");
     }
-    assert(lastWasIdentOrFloat);
+    if(expectOperand){
+	throw runtime_error("Parsing of expression failed. Empty expression!");
+    }
 }
 
 inline Expression parseExpression(string s){
+    TRACE_SPAN("parse");
     int idx = 0;
     vector<Token> tokens;
     string curBuf;
@@ -1141,9 +1639,17 @@ inline Expression parseExpression(string s){
         switch(s[idx]){
             // single char tokens
             case '(':
+		if(curBuf == "select"){
+		    addTokenIfValid(ref(tokens), Token(tkSelect));
+		    curBuf.clear();
+		}
                 addTokenIfValid(ref(tokens), toIdentAndClear(ref(curBuf)));
                 addTokenIfValid(ref(tokens), Token(tkParensOpen));
                 break;
+            case ',':
+                addTokenIfValid(ref(tokens), toIdentAndClear(ref(curBuf)));
+                addTokenIfValid(ref(tokens), Token(tkComma));
+                break;
             case ')':
                 addTokenIfValid(ref(tokens), toIdentAndClear(ref(curBuf)));
                 addTokenIfValid(ref(tokens), Token(tkParensClose));
@@ -1286,3 +1792,4950 @@ inline Expression parseExpression(string s){
 #endif
     return tokensToAst(tokens);
 }
+
+// Interval analysis of expressions
+//
+// Computes which values of the variables appearing in an expression can possibly
+// make it true. Used to decide whether e.g. a file or basket with known min / max
+// values of its columns can contain any event passing a cut. All results are
+// conservative: whenever we cannot say anything we fall back to the full real line.
+// NOTE: NaN values are not considered, i.e. variables are assumed to hold numbers.
+
+struct Interval {
+    double lo;
+    double hi;
+    bool loOpen;
+    bool hiOpen;
+};
+
+static inline Interval fullInterval(){
+    return Interval{-numeric_limits<double>::infinity(), numeric_limits<double>::infinity(), true, true};
+}
+
+static inline Interval pointInterval(double x){
+    return Interval{x, x, false, false};
+}
+
+static inline bool isEmpty(Interval x){
+    return x.lo > x.hi || (x.lo == x.hi && (x.loOpen || x.hiOpen));
+}
+
+static inline bool isPoint(Interval x){
+    return x.lo == x.hi && !x.loOpen && !x.hiOpen;
+}
+
+static inline Interval intersect(Interval x, Interval y){
+    Interval res = x;
+    if(y.lo > res.lo || (y.lo == res.lo && y.loOpen)){
+        res.lo = y.lo;
+        res.loOpen = y.loOpen;
+    }
+    if(y.hi < res.hi || (y.hi == res.hi && y.hiOpen)){
+        res.hi = y.hi;
+        res.hiOpen = y.hiOpen;
+    }
+    return res;
+}
+
+static inline string toString(Interval x){
+    return (x.loOpen ? "(" : "[") + to_string(x.lo) + ", " + to_string(x.hi) + (x.hiOpen ? ")" : "]");
+}
+
+// a union of intervals, kept sorted by lower bound and disjoint
+using IntervalSet = vector<Interval>;
+
+static inline IntervalSet normalize(IntervalSet xs){
+    // sorts the intervals and merges the ones touching each other
+    IntervalSet result;
+    xs.erase(remove_if(xs.begin(), xs.end(), [](Interval x){ return isEmpty(x); }), xs.end());
+    sort(xs.begin(), xs.end(), [](Interval a, Interval b){
+        return a.lo < b.lo || (a.lo == b.lo && !a.loOpen && b.loOpen);
+    });
+    for(auto x : xs){
+        if(result.size() > 0){
+            auto& last = result.back();
+            if(x.lo < last.hi || (x.lo == last.hi && !(x.loOpen && last.hiOpen))){
+                if(x.hi > last.hi || (x.hi == last.hi && !x.hiOpen)){
+                    last.hi = x.hi;
+                    last.hiOpen = x.hiOpen;
+                }
+                continue;
+            }
+        }
+        result.push_back(x);
+    }
+    return result;
+}
+
+static inline IntervalSet intersect(const IntervalSet& xs, const IntervalSet& ys){
+    IntervalSet result;
+    for(auto x : xs){
+        for(auto y : ys){
+            auto z = intersect(x, y);
+            if(!isEmpty(z)) result.push_back(z);
+        }
+    }
+    return normalize(result);
+}
+
+static inline IntervalSet unite(IntervalSet xs, const IntervalSet& ys){
+    xs.insert(xs.end(), ys.begin(), ys.end());
+    return normalize(xs);
+}
+
+static inline string toString(const IntervalSet& xs){
+    if(xs.size() == 0) return "{}";
+    string res;
+    for(size_t i = 0; i < xs.size(); i++){
+        if(i > 0) res += " u ";
+        res += toString(xs[i]);
+    }
+    return res;
+}
+
+// per variable set of values outside of which an expression is always false.
+// Variables not contained are unconstrained.
+using VariableBounds = map<string, IntervalSet>;
+
+static inline string variableName(shared_ptr<Node> n){
+    // returns the name under which bounds for `n` are stored, `foo` for identifiers and
+    // `foo[1]` for bracket expressions. Empty if `n` is not a variable.
+    switch(n->kind){
+	case nkIdent:
+	    return n->GetIdent();
+	case nkBracketExpr:
+	    if(n->GetArg()->kind == nkFloat){
+		return n->GetNode()->GetIdent() + "[" + to_string((int)n->GetArg()->GetVal()) + "]";
+	    }
+	    return "";
+	case nkExpression:
+	    return variableName(n->GetExprNode());
+	default:
+	    return "";
+    }
+}
+
+enum TriBool {
+    tbFalse, tbTrue, tbMaybe
+};
+
+static inline TriBool triAnd(TriBool x, TriBool y){
+    if(x == tbFalse || y == tbFalse) return tbFalse;
+    if(x == tbTrue && y == tbTrue) return tbTrue;
+    return tbMaybe;
+}
+
+static inline TriBool triOr(TriBool x, TriBool y){
+    if(x == tbTrue || y == tbTrue) return tbTrue;
+    if(x == tbFalse && y == tbFalse) return tbFalse;
+    return tbMaybe;
+}
+
+static inline TriBool triNot(TriBool x){
+    switch(x){
+	case tbFalse: return tbTrue;
+	case tbTrue: return tbFalse;
+	default: return tbMaybe;
+    }
+}
+
+// result of evaluating an expression on intervals. Either the range of a
+// numerical expression (left) or whether a boolean one is true (right)
+using RangeResult = Either<Interval, TriBool>;
+
+static inline RangeResult rangeOfVariable(const map<string, Interval>& ranges, const string& name){
+    auto it = ranges.find(name);
+    if(it != ranges.end()) return Left<Interval, TriBool>(it->second);
+    return Left<Interval, TriBool>(fullInterval());
+}
+
+static inline Interval rangeMul(Interval x, Interval y){
+    // bounds are treated as closed, which is conservative
+    double cands[4] = {x.lo * y.lo, x.lo * y.hi, x.hi * y.lo, x.hi * y.hi};
+    for(auto c : cands){
+        // 0 * inf
+        if(std::isnan(c)) return fullInterval();
+    }
+    return Interval{*min_element(cands, cands + 4), *max_element(cands, cands + 4), false, false};
+}
+
+static inline Interval rangeDiv(Interval x, Interval y){
+    if(y.lo <= 0.0 && y.hi >= 0.0) return fullInterval();
+    return rangeMul(x, Interval{1.0 / y.hi, 1.0 / y.lo, false, false});
+}
+
+static inline TriBool rangeLess(Interval x, Interval y, bool orEqual){
+    // is x < y (or x <= y) for all / no / some values?
+    bool allTrue = orEqual ? x.hi <= y.lo :
+                             (x.hi < y.lo || (x.hi == y.lo && (x.hiOpen || y.loOpen)));
+    bool allFalse = orEqual ? (x.lo > y.hi || (x.lo == y.hi && (x.loOpen || y.hiOpen))) :
+                              (x.lo >= y.hi);
+    if(allTrue) return tbTrue;
+    if(allFalse) return tbFalse;
+    return tbMaybe;
+}
+
+static inline TriBool rangeEqual(Interval x, Interval y){
+    if(isPoint(x) && isPoint(y)) return x.lo == y.lo ? tbTrue : tbFalse;
+    if(isEmpty(intersect(x, y))) return tbFalse;
+    return tbMaybe;
+}
+
+inline RangeResult evaluateRange(const map<string, Interval>& ranges, shared_ptr<Node> n){
+    // interval arithmetic version of `evaluate`
+    switch(n->kind){
+	case nkBinary: {
+	    auto x = evaluateRange(ranges, n->GetLeft());
+	    auto y = evaluateRange(ranges, n->GetRight());
+	    switch(n->GetBinaryOp()){
+		case boAnd: return Right<Interval, TriBool>(triAnd(x.getRight(), y.getRight()));
+		case boOr: return Right<Interval, TriBool>(triOr(x.getRight(), y.getRight()));
+		default: break;
+	    }
+	    if(x.isRight() || y.isRight()){
+		// only `==` and `!=` of two bools remain valid
+		TriBool eq = tbMaybe;
+		if(x.getRight() != tbMaybe && y.getRight() != tbMaybe){
+		    eq = x.getRight() == y.getRight() ? tbTrue : tbFalse;
+		}
+		switch(n->GetBinaryOp()){
+		    case boEqual: return Right<Interval, TriBool>(eq);
+		    case boUnequal: return Right<Interval, TriBool>(triNot(eq));
+		    default: throw domain_error("Invalid operation on boolean operands in " + astToStr(n));
+		}
+	    }
+	    auto a = x.unsafeGetLeft();
+	    auto b = y.unsafeGetLeft();
+	    switch(n->GetBinaryOp()){
+		case boMul: return Left<Interval, TriBool>(rangeMul(a, b));
+		case boDiv: return Left<Interval, TriBool>(rangeDiv(a, b));
+		case boPlus: return Left<Interval, TriBool>(Interval{a.lo + b.lo, a.hi + b.hi, a.loOpen || b.loOpen, a.hiOpen || b.hiOpen});
+		case boMinus: return Left<Interval, TriBool>(Interval{a.lo - b.hi, a.hi - b.lo, a.loOpen || b.hiOpen, a.hiOpen || b.loOpen});
+		case boLess: return Right<Interval, TriBool>(rangeLess(a, b, false));
+		case boGreater: return Right<Interval, TriBool>(rangeLess(b, a, false));
+		case boLessEq: return Right<Interval, TriBool>(rangeLess(a, b, true));
+		case boGreaterEq: return Right<Interval, TriBool>(rangeLess(b, a, true));
+		case boEqual: return Right<Interval, TriBool>(rangeEqual(a, b));
+		case boUnequal: return Right<Interval, TriBool>(triNot(rangeEqual(a, b)));
+		default:
+		    throw runtime_error("Invalid binary op kind for token " + astToStr(n));
+	    }
+	}
+	case nkUnary: {
+	    auto x = evaluateRange(ranges, n->GetUnaryNode());
+	    switch(n->GetUnaryOp()){
+		case uoPlus: return x;
+		case uoMinus: {
+		    auto a = x.getLeft();
+		    return Left<Interval, TriBool>(Interval{-a.hi, -a.lo, a.hiOpen, a.loOpen});
+		}
+		case uoNot: return Right<Interval, TriBool>(triNot(x.getRight()));
+	    }
+	    break;
+	}
+	case nkIdent:
+	    return rangeOfVariable(ranges, n->GetIdent());
+	case nkFloat:
+	    return Left<Interval, TriBool>(pointInterval(n->GetVal()));
+	case nkExpression:
+	    return evaluateRange(ranges, n->GetExprNode());
+	case nkBracketExpr: {
+	    // a range for the specific element wins over a range of the whole array
+	    auto name = variableName(n);
+	    if(name.length() > 0 && ranges.count(name) > 0) return rangeOfVariable(ranges, name);
+	    return rangeOfVariable(ranges, n->GetNode()->GetIdent());
+	}
+	case nkSelect: {
+	    auto cond = evaluateRange(ranges, n->GetCondition()).getRight();
+	    auto x = evaluateRange(ranges, n->GetTrueArm());
+	    auto y = evaluateRange(ranges, n->GetFalseArm());
+	    if(x.isLeft() != y.isLeft()) throw domain_error("The arms of `select` differ in type in " + astToStr(n));
+	    if(cond == tbTrue) return x;
+	    if(cond == tbFalse) return y;
+	    if(x.isRight()){
+		return Right<Interval, TriBool>(x.unsafeGetRight() == y.unsafeGetRight() ? x.unsafeGetRight() : tbMaybe);
+	    }
+	    // either arm may be taken, so the result lies in the hull of both
+	    auto a = x.unsafeGetLeft();
+	    auto b = y.unsafeGetLeft();
+	    Interval res = a;
+	    if(b.lo < res.lo || (b.lo == res.lo && !b.loOpen)){
+		res.lo = b.lo;
+		res.loOpen = b.loOpen;
+	    }
+	    if(b.hi > res.hi || (b.hi == res.hi && !b.hiOpen)){
+		res.hi = b.hi;
+		res.hiOpen = b.hiOpen;
+	    }
+	    return Left<Interval, TriBool>(isEmpty(a) ? b : isEmpty(b) ? a : res);
+	}
+    }
+    throw logic_error("Invalid code branch in `evaluateRange`. Should never end up here!");
+}
+
+static inline bool isConstant(shared_ptr<Node> n, double& val){
+    // checks if `n` folds to a single number and if so stores it in `val`
+    map<string, Interval> noRanges;
+    auto res = evaluateRange(noRanges, n);
+    if(res.isLeft() && isPoint(res.unsafeGetLeft())){
+	val = res.unsafeGetLeft().lo;
+	return true;
+    }
+    return false;
+}
+
+static inline BinaryOpKind mirrorOp(BinaryOpKind op){
+    // `a op b` <=> `b mirrorOp(op) a`
+    switch(op){
+	case boLess: return boGreater;
+	case boGreater: return boLess;
+	case boLessEq: return boGreaterEq;
+	case boGreaterEq: return boLessEq;
+	default: return op;
+    }
+}
+
+static inline BinaryOpKind negateOp(BinaryOpKind op){
+    // `!(a op b)` <=> `a negateOp(op) b`
+    switch(op){
+	case boLess: return boGreaterEq;
+	case boGreater: return boLessEq;
+	case boLessEq: return boGreater;
+	case boGreaterEq: return boLess;
+	case boEqual: return boUnequal;
+	case boUnequal: return boEqual;
+	default: return op;
+    }
+}
+
+static inline IntervalSet comparisonBounds(BinaryOpKind op, double c){
+    // values of `x` for which `x op c` holds
+    const double inf = numeric_limits<double>::infinity();
+    switch(op){
+	case boLess: return {Interval{-inf, c, true, true}};
+	case boLessEq: return {Interval{-inf, c, true, false}};
+	case boGreater: return {Interval{c, inf, true, true}};
+	case boGreaterEq: return {Interval{c, inf, false, true}};
+	case boEqual: return {pointInterval(c)};
+	case boUnequal: return {Interval{-inf, c, true, true}, Interval{c, inf, true, true}};
+	default: return {fullInterval()};
+    }
+}
+
+static inline VariableBounds intersectBounds(VariableBounds x, const VariableBounds& y){
+    for(auto& kv : y){
+	auto it = x.find(kv.first);
+	if(it == x.end()) x[kv.first] = kv.second;
+	else it->second = intersect(it->second, kv.second);
+    }
+    return x;
+}
+
+static inline VariableBounds uniteBounds(const VariableBounds& x, const VariableBounds& y){
+    // only variables constrained on both sides stay constrained
+    VariableBounds result;
+    for(auto& kv : x){
+	auto it = y.find(kv.first);
+	if(it != y.end()) result[kv.first] = unite(kv.second, it->second);
+    }
+    return result;
+}
+
+inline VariableBounds deriveBounds(shared_ptr<Node> n, bool negated = false){
+    // computes for each variable the set of values it must lie in for `n` to be
+    // true (or false if `negated`). Negations are pushed down using De Morgan.
+    switch(n->kind){
+	case nkExpression:
+	    return deriveBounds(n->GetExprNode(), negated);
+	case nkUnary:
+	    if(n->GetUnaryOp() == uoNot) return deriveBounds(n->GetUnaryNode(), !negated);
+	    return VariableBounds();
+	case nkBinary: {
+	    auto op = n->GetBinaryOp();
+	    if(op == boAnd || op == boOr){
+		auto x = deriveBounds(n->GetLeft(), negated);
+		auto y = deriveBounds(n->GetRight(), negated);
+		if((op == boAnd) != negated) return intersectBounds(x, y);
+		return uniteBounds(x, y);
+	    }
+	    // comparison of a variable and a constant
+	    double c;
+	    string name = variableName(n->GetLeft());
+	    if(name.length() > 0 && isConstant(n->GetRight(), c)){
+		// nothing to do
+	    }
+	    else{
+		name = variableName(n->GetRight());
+		if(name.length() == 0 || !isConstant(n->GetLeft(), c)) return VariableBounds();
+		op = mirrorOp(op);
+	    }
+	    if(negated) op = negateOp(op);
+	    switch(op){
+		case boLess: case boGreater: case boLessEq: case boGreaterEq:
+		case boEqual: case boUnequal:
+		    return VariableBounds{ {name, comparisonBounds(op, c)} };
+		default:
+		    return VariableBounds();
+	    }
+	}
+	default:
+	    return VariableBounds();
+    }
+}
+
+inline bool canBeTrue(shared_ptr<Node> n, const map<string, Interval>& ranges){
+    // returns false if `n` is false for all values of the variables within `ranges`.
+    // Variables without a given range are assumed to take any value.
+    auto bounds = deriveBounds(n);
+    for(auto& kv : bounds){
+	IntervalSet allowed = {fullInterval()};
+	auto it = ranges.find(kv.first);
+	if(it != ranges.end()) allowed = {it->second};
+	if(intersect(kv.second, allowed).size() == 0) return false;
+    }
+    return evaluateRange(ranges, n).getRight() != tbFalse;
+}
+
+inline bool mustBeTrue(shared_ptr<Node> n, const map<string, Interval>& ranges){
+    // returns true if `n` is true for all values of the variables within `ranges`
+    return evaluateRange(ranges, n).getRight() == tbTrue;
+}
+
+// Predicate fusion
+//
+// Range checks like `x > a && x <= b` (in any operand order) and chains of equalities
+// `id == 3 || id == 7 || ...` are recognized in the AST. Batch evaluation and compiled
+// programs then evaluate the tested operand once and apply a single fused check instead
+// of one comparison per constant joined by `and` / `or`. Batch evaluation matches every
+// node once, on its first evaluation, and keeps the result with the node; only replacing
+// a node's own children via `SetLeft` / `SetRight` makes it match again.
+
+struct RangeCheck {
+    double lo;
+    double hi;
+    bool loInclusive;
+    bool hiInclusive;
+
+    template <class T>
+    bool Contains(T x) const {
+	return (loInclusive ? x >= (T)lo : x > (T)lo) & (hiInclusive ? x <= (T)hi : x < (T)hi);
+    }
+};
+
+class MembershipSet {
+public:
+    // integral values spanning at most `maxBitsetRange` are looked up in a bitset,
+    // anything else by binary search in the sorted values
+    static const size_t maxBitsetRange = 1 << 16;
+
+    MembershipSet() {};
+    explicit MembershipSet(vector<double> vals): values(vals){
+	sort(values.begin(), values.end());
+	values.erase(unique(values.begin(), values.end()), values.end());
+	bool integral = values.size() > 0;
+	for(auto v : values) integral = integral && floor(v) == v;
+	if(!integral || values.back() - values.front() >= (double)maxBitsetRange) return;
+	base = values.front();
+	bits.assign((size_t)(values.back() - base) / 64 + 1, 0);
+	for(auto v : values){
+	    auto k = (uint64_t)(v - base);
+	    bits[k >> 6] |= uint64_t(1) << (k & 63);
+	}
+    }
+
+    bool Contains(double x) const {
+	if(bits.empty()) return binary_search(values.begin(), values.end(), x);
+	double d = x - base;
+	// fails for NaN as well
+	if(!(d >= 0.0 && d < (double)(bits.size() * 64))) return false;
+	auto k = (uint64_t)d;
+	return (double)k == d && ((bits[k >> 6] >> (k & 63)) & 1);
+    }
+
+    vector<double> values;
+    double base = 0.0;
+    vector<uint64_t> bits;
+};
+
+// equality chains with fewer constants stay separate comparisons
+const size_t minFusedSetSize = 4;
+
+static inline shared_ptr<Node> stripParens(shared_ptr<Node> n){
+    while(n->kind == nkExpression) n = n->GetExprNode();
+    return n;
+}
+
+static inline bool sameExpression(shared_ptr<Node> a, shared_ptr<Node> b){
+    // structural equality, ignoring parentheses
+    a = stripParens(a);
+    b = stripParens(b);
+    if(a->kind != b->kind) return false;
+    switch(a->kind){
+	case nkBinary:
+	    return a->GetBinaryOp() == b->GetBinaryOp() && sameExpression(a->GetLeft(), b->GetLeft()) &&
+		sameExpression(a->GetRight(), b->GetRight());
+	case nkUnary:
+	    return a->GetUnaryOp() == b->GetUnaryOp() && sameExpression(a->GetUnaryNode(), b->GetUnaryNode());
+	case nkIdent:
+	case nkBracketExpr:
+	    return a->GetIdentId() == b->GetIdentId();
+	case nkFloat:
+	    return a->GetVal() == b->GetVal();
+	case nkSelect:
+	    return sameExpression(a->GetCondition(), b->GetCondition()) && sameExpression(a->GetTrueArm(), b->GetTrueArm()) &&
+		sameExpression(a->GetFalseArm(), b->GetFalseArm());
+	default:
+	    return false;
+    }
+}
+
+static inline bool matchConstCmp(shared_ptr<Node> n, shared_ptr<Node>& operand, BinaryOpKind& op, double& c){
+    // matches `operand op c` or `c op operand`, normalized to the former
+    n = stripParens(n);
+    if(n->kind != nkBinary) return false;
+    op = n->GetBinaryOp();
+    if(op < boLess || op > boUnequal) return false;
+    double other;
+    operand = n->GetLeft();
+    if(isConstant(n->GetRight(), c)) return !isConstant(operand, other);
+    operand = n->GetRight();
+    op = mirrorOp(op);
+    return isConstant(n->GetLeft(), c) && !isConstant(operand, other);
+}
+
+inline bool matchRange(shared_ptr<Node> n, shared_ptr<Node>& operand, RangeCheck& range){
+    // matches `x > a && x < b` with one lower and one upper bound on the same `x`
+    n = stripParens(n);
+    if(n->kind != nkBinary || n->GetBinaryOp() != boAnd) return false;
+    shared_ptr<Node> x, y;
+    BinaryOpKind opX, opY;
+    double cX, cY;
+    if(!matchConstCmp(n->GetLeft(), x, opX, cX) || !matchConstCmp(n->GetRight(), y, opY, cY)) return false;
+    if(!sameExpression(x, y)) return false;
+    bool lowerX = opX == boGreater || opX == boGreaterEq;
+    bool lowerY = opY == boGreater || opY == boGreaterEq;
+    bool upperX = opX == boLess || opX == boLessEq;
+    bool upperY = opY == boLess || opY == boLessEq;
+    if(lowerY && upperX){
+	swap(opX, opY);
+	swap(cX, cY);
+    }
+    else if(!(lowerX && upperY)) return false;
+    operand = x;
+    range = RangeCheck{cX, cY, opX == boGreaterEq, opY == boLessEq};
+    return true;
+}
+
+static inline bool collectEqualities(shared_ptr<Node> n, shared_ptr<Node>& operand, vector<double>& values){
+    n = stripParens(n);
+    if(n->kind == nkBinary && n->GetBinaryOp() == boOr){
+	return collectEqualities(n->GetLeft(), operand, values) && collectEqualities(n->GetRight(), operand, values);
+    }
+    shared_ptr<Node> x;
+    BinaryOpKind op;
+    double c;
+    if(!matchConstCmp(n, x, op, c) || op != boEqual) return false;
+    if(operand == nullptr) operand = x;
+    else if(!sameExpression(operand, x)) return false;
+    values.push_back(c);
+    return true;
+}
+
+inline bool matchSet(shared_ptr<Node> n, shared_ptr<Node>& operand, vector<double>& values){
+    // matches `x == a || x == b || ...` with at least `minFusedSetSize` constants
+    operand = nullptr;
+    values.clear();
+    n = stripParens(n);
+    if(n->kind != nkBinary || n->GetBinaryOp() != boOr) return false;
+    return collectEqualities(n, operand, values) && values.size() >= minFusedSetSize;
+}
+
+struct FusedPredicate {
+    // `operand` is checked against `range`, or against `set` for an equality chain.
+    // `operand` is nullptr if the node does not fuse.
+    shared_ptr<Node> operand;
+    bool isSet = false;
+    RangeCheck range;
+    MembershipSet set;
+    // the constants rounded like the values of single precision batches
+    MembershipSet floatSet;
+};
+
+inline BinaryNode::~BinaryNode(){
+    delete fused.load();
+}
+
+inline void BinaryNode::ResetFused(){
+    delete fused.exchange(nullptr);
+}
+
+static inline const FusedPredicate& fusedPredicate(shared_ptr<Node> n){
+    // matches the binary node `n` once and keeps the result with the node, so evaluating
+    // it again, e.g. for every chunk, only costs an atomic load
+    auto& slot = n->GetFused();
+    auto f = slot.load(memory_order_acquire);
+    if(f != nullptr) return *f;
+    unique_ptr<FusedPredicate> p(new FusedPredicate());
+    vector<double> values;
+    if(matchSet(n, p->operand, values)){
+	p->isSet = true;
+	p->set = MembershipSet(values);
+	for(auto& v : values) v = (float)v;
+	p->floatSet = MembershipSet(values);
+    }
+    else if(!matchRange(n, p->operand, p->range)) p->operand = nullptr;
+    // a thread matching the same node meanwhile comes to the same result
+    const FusedPredicate* expected = nullptr;
+    if(slot.compare_exchange_strong(expected, p.get(), memory_order_acq_rel)) return *p.release();
+    return *expected;
+}
+
+// Batch evaluation over columns
+//
+// Instead of walking the AST once per event, `evaluateBatch` walks it once per chunk
+// of events and applies each node to whole columns. Bracket expressions read the column
+// named like `variableName`, i.e. `peakTimes[0]`.
+
+struct ColumnStats {
+    // min / max over the non null values of a column. NaN values count as null.
+    double min;
+    double max;
+    size_t nullCount;
+    size_t count;
+};
+
+static inline ColumnStats computeStats(const vector<float>& col){
+    ColumnStats st{numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), 0, col.size()};
+    for(auto x : col){
+	if(std::isnan(x)){
+	    st.nullCount++;
+	    continue;
+	}
+	st.min = x < st.min ? x : st.min;
+	st.max = x > st.max ? x : st.max;
+    }
+    return st;
+}
+
+// Encoded columns
+//
+// Low cardinality variables can be stored dictionary encoded (a small table of distinct
+// values plus one code per event) and small integers bit packed (value = base + code,
+// with as few bits per code as needed). Comparisons of such a column with a constant
+// are rewritten per chunk into predicates on the codes, so the column is never decoded.
+// Any other use decodes the needed values on the fly.
+
+class DictionaryColumn {
+public:
+    DictionaryColumn() {};
+    DictionaryColumn(vector<float> dictionary, vector<uint32_t> codes): dictionary(dictionary), codes(codes) {};
+    static DictionaryColumn Encode(const vector<float>& values){
+	DictionaryColumn col;
+	// keyed on the bit pattern: NaN does not order with `<`, all NaNs share one entry
+	map<uint32_t, uint32_t> index;
+	for(auto x : values){
+	    uint32_t key;
+	    memcpy(&key, &x, sizeof(key));
+	    if(x != x) key = 0x7fc00000;
+	    auto it = index.find(key);
+	    if(it == index.end()){
+		it = index.insert(make_pair(key, (uint32_t)col.dictionary.size())).first;
+		col.dictionary.push_back(x);
+	    }
+	    col.codes.push_back(it->second);
+	}
+	return col;
+    };
+    float Get(size_t i) const { return dictionary[codes[i]]; };
+    size_t Size() const { return codes.size(); };
+    vector<float> dictionary;
+    vector<uint32_t> codes;
+};
+
+class BitPackedColumn {
+public:
+    static BitPackedColumn Pack(const vector<int64_t>& values){
+	BitPackedColumn col;
+	col.size = values.size();
+	col.base = values.size() > 0 ? *min_element(values.begin(), values.end()) : 0;
+	uint64_t maxCode = 0;
+	for(auto x : values) maxCode = max(maxCode, (uint64_t)(x - col.base));
+	col.bits = 1;
+	while(col.bits < 64 && (maxCode >> col.bits) != 0) col.bits++;
+	col.maxCode = maxCode;
+	// one spare word so that `Code` may always read two words
+	col.words.assign((col.size * col.bits + 63) / 64 + 1, 0ULL);
+	for(size_t i = 0; i < values.size(); i++){
+	    uint64_t code = values[i] - col.base;
+	    size_t bit = i * col.bits;
+	    col.words[bit >> 6] |= code << (bit & 63);
+	    if((bit & 63) + col.bits > 64) col.words[(bit >> 6) + 1] |= code >> (64 - (bit & 63));
+	}
+	return col;
+    };
+    uint64_t Code(size_t i) const {
+	size_t bit = i * bits;
+	uint64_t lo = words[bit >> 6] >> (bit & 63);
+	uint64_t hi = (bit & 63) + bits > 64 ? words[(bit >> 6) + 1] << (64 - (bit & 63)) : 0;
+	uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+	return (lo | hi) & mask;
+    };
+    int64_t Get(size_t i) const { return base + (int64_t)Code(i); };
+    size_t Size() const { return size; };
+    size_t size = 0;
+    int64_t base = 0;
+    int bits = 1;
+    uint64_t maxCode = 0;
+    vector<uint64_t> words;
+};
+
+// native column types, see `evaluateTyped`
+enum ColumnType {
+    ctBool, ctInt32, ctInt64, ctFloat32, ctFloat64
+};
+
+static inline string toString(ColumnType t){
+    switch(t){
+	case ctBool: return "bool";
+	case ctInt32: return "int32";
+	case ctInt64: return "int64";
+	case ctFloat32: return "float32";
+	case ctFloat64: return "float64";
+	default: return "invalid";
+    }
+}
+
+template <class T> struct ColumnTypeOf;
+template <> struct ColumnTypeOf<uint8_t> { static const ColumnType value = ctBool; };
+template <> struct ColumnTypeOf<int32_t> { static const ColumnType value = ctInt32; };
+template <> struct ColumnTypeOf<int64_t> { static const ColumnType value = ctInt64; };
+template <> struct ColumnTypeOf<float> { static const ColumnType value = ctFloat32; };
+template <> struct ColumnTypeOf<double> { static const ColumnType value = ctFloat64; };
+
+static inline bool isInteger(ColumnType t){ return t == ctInt32 || t == ctInt64; }
+static inline bool isFloat(ColumnType t){ return t == ctFloat32 || t == ctFloat64; }
+
+class TypedColumn {
+public:
+    TypedColumn(): type(ctFloat64), size(0) {};
+    template <class T>
+    static TypedColumn From(const vector<T>& data){
+	TypedColumn col;
+	col.type = ColumnTypeOf<T>::value;
+	col.size = data.size();
+	col.bytes.resize(data.size() * sizeof(T));
+	if(data.size() > 0) memcpy(col.bytes.data(), data.data(), col.bytes.size());
+	return col;
+    };
+    template <class T> const T* Data() const { return (const T*)bytes.data(); };
+    ColumnType type;
+    size_t size;
+    // raw storage, allocated by `new` and thus aligned for any of the types
+    vector<uint8_t> bytes;
+};
+
+template <class F>
+static inline void visitColumn(const TypedColumn& col, F f){
+    // calls `f` with a pointer of the column's native type
+    switch(col.type){
+	case ctBool: f(col.Data<uint8_t>()); break;
+	case ctInt32: f(col.Data<int32_t>()); break;
+	case ctInt64: f(col.Data<int64_t>()); break;
+	case ctFloat32: f(col.Data<float>()); break;
+	case ctFloat64: f(col.Data<double>()); break;
+    }
+}
+
+static inline ColumnStats computeStats(const TypedColumn& col){
+    ColumnStats st{numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), 0, col.size};
+    visitColumn(col, [&](auto data){
+	for(size_t i = 0; i < col.size; i++){
+	    double x = (double)data[i];
+	    if(std::isnan(x)){
+		st.nullCount++;
+		continue;
+	    }
+	    st.min = x < st.min ? x : st.min;
+	    st.max = x > st.max ? x : st.max;
+	}
+    });
+    return st;
+}
+
+class ColumnChunk {
+public:
+    ColumnChunk(): size(0) {};
+    // adds a column and computes its statistics
+    void AddColumn(const string& name, vector<float> data){
+	auto st = computeStats(data);
+	AddColumn(name, move(data), st);
+    };
+    // adds a column with known statistics, e.g. read from file metadata
+    void AddColumn(const string& name, vector<float> data, ColumnStats st){
+	auto id = Register(name, data.size(), st);
+	auto it = lower_bound(columnIds.begin(), columnIds.end(), id);
+	size_t slot = it - columnIds.begin();
+	if(it == columnIds.end() || *it != id){
+	    columnIds.insert(it, id);
+	    columns.insert(columns.begin() + slot, vector<float>());
+	}
+	columns[slot] = move(data);
+    };
+    void AddDictionaryColumn(const string& name, DictionaryColumn col){
+	// statistics over the dictionary are a (cheap) superset of the actual ones
+	auto id = Register(name, col.Size(), computeStats(col.dictionary));
+	stats[name].count = col.Size();
+	dictionaries[id] = move(col);
+    };
+    void AddBitPackedColumn(const string& name, BitPackedColumn col){
+	ColumnStats st{(double)col.base, (double)(col.base + (int64_t)col.maxCode), 0, col.Size()};
+	auto id = Register(name, col.Size(), st);
+	packed[id] = move(col);
+    };
+    void AddTypedColumn(const string& name, TypedColumn col){
+	auto id = Register(name, col.size, computeStats(col));
+	typed[id] = move(col);
+    };
+    uint32_t Register(const string& name, size_t n, ColumnStats st){
+	if(stats.size() > 0 && n != size){
+	    throw domain_error("Column " + name + " has " + to_string(n) + " entries, but chunk has " +
+			       to_string(size) + "!");
+	}
+	size = n;
+	stats[name] = st;
+	return internSymbol(name);
+    };
+    const vector<float>& GetColumn(uint32_t id) const {
+	return columns[Slot(id)];
+    };
+    const vector<float>& GetColumn(const string& name) const {
+	auto id = SymbolTable::Global().Find(name);
+	if(id == noSymbol) throw domain_error("Column " + name + " does not exist in chunk!");
+	return GetColumn(id);
+    };
+    vector<float>& GetColumn(const string& name){
+	// for refilling a column in place, its length must stay `size`
+	return const_cast<vector<float>&>(static_cast<const ColumnChunk*>(this)->GetColumn(name));
+    };
+    size_t size;
+    // symbol ids of the plain columns in ascending order and their data in the same
+    // order, so a chunk only pays for the columns it holds
+    vector<uint32_t> columnIds;
+    vector<vector<float>> columns;
+    map<uint32_t, DictionaryColumn> dictionaries;
+    map<uint32_t, BitPackedColumn> packed;
+    map<uint32_t, TypedColumn> typed;
+    map<string, ColumnStats> stats;
+private:
+    size_t Slot(uint32_t id) const {
+	auto it = lower_bound(columnIds.begin(), columnIds.end(), id);
+	if(it == columnIds.end() || *it != id){
+	    throw domain_error("Column " + (id != noSymbol ? symbolName(id) : string("")) + " does not exist in chunk!");
+	}
+	return it - columnIds.begin();
+    };
+};
+
+template <class T>
+struct BasicBatchResult {
+    // equivalent of `Either<T, bool>` for a whole chunk. Only one of
+    // `values` and `mask` is filled, depending on `isBool`.
+    bool isBool;
+    vector<T> values;
+    vector<uint8_t> mask;
+};
+
+// the batch kernels are templated on the scalar type. `double` is the default,
+// `float` keeps the input precision and packs twice as many lanes per SIMD register.
+using BatchResult = BasicBatchResult<double>;
+
+template <class T = double>
+static inline BasicBatchResult<T> numericBatch(size_t n){
+    BasicBatchResult<T> res;
+    res.isBool = false;
+    res.values.resize(n);
+    return res;
+}
+
+template <class T = double>
+static inline BasicBatchResult<T> boolBatch(size_t n, uint8_t val = 0){
+    BasicBatchResult<T> res;
+    res.isBool = true;
+    res.mask.assign(n, val);
+    return res;
+}
+
+template <class T, class F>
+static inline BasicBatchResult<T> batchArith(const BasicBatchResult<T>& x, const BasicBatchResult<T>& y, F f){
+    if(x.isBool || y.isBool) throw domain_error("Cannot apply arithmetic to boolean values!");
+    size_t n = x.values.size();
+    auto res = numericBatch<T>(n);
+    const T* a = x.values.data();
+    const T* b = y.values.data();
+    T* r = res.values.data();
+    for(size_t i = 0; i < n; i++) r[i] = f(a[i], b[i]);
+    return res;
+}
+
+template <class T, class F>
+static inline BasicBatchResult<T> batchCmp(const BasicBatchResult<T>& x, const BasicBatchResult<T>& y, F f){
+    if(x.isBool || y.isBool) throw domain_error("Cannot compare boolean values by order!");
+    size_t n = x.values.size();
+    auto res = boolBatch<T>(n);
+    const T* a = x.values.data();
+    const T* b = y.values.data();
+    uint8_t* r = res.mask.data();
+    for(size_t i = 0; i < n; i++) r[i] = f(a[i], b[i]);
+    return res;
+}
+
+template <class T, class F>
+static inline BasicBatchResult<T> batchLogic(const BasicBatchResult<T>& x, const BasicBatchResult<T>& y, F f){
+    if(!x.isBool || !y.isBool) throw domain_error("Cannot apply logical operator to float values!");
+    size_t n = x.mask.size();
+    auto res = boolBatch<T>(n);
+    const uint8_t* a = x.mask.data();
+    const uint8_t* b = y.mask.data();
+    uint8_t* r = res.mask.data();
+    for(size_t i = 0; i < n; i++) r[i] = f(a[i], b[i]);
+    return res;
+}
+
+template <class T>
+static inline BasicBatchResult<T> batchEqual(const BasicBatchResult<T>& x, const BasicBatchResult<T>& y, bool equal){
+    if(x.isBool != y.isBool) throw domain_error("Cannot compare a float and a bool for equality!");
+    if(x.isBool){
+	return batchLogic(x, y, [equal](uint8_t a, uint8_t b) -> uint8_t { return (a == b) == equal; });
+    }
+    return batchCmp(x, y, [equal](T a, T b) -> uint8_t { return (a == b) == equal; });
+}
+
+template <bool loInclusive, bool hiInclusive, class T>
+static inline void rangeKernel(const T* a, size_t n, T lo, T hi, uint8_t* r){
+    // the bound kinds are template parameters, so the loop body has no branches
+    for(size_t i = 0; i < n; i++){
+	r[i] = (loInclusive ? a[i] >= lo : a[i] > lo) & (hiInclusive ? a[i] <= hi : a[i] < hi);
+    }
+}
+
+template <class T>
+static inline BasicBatchResult<T> batchRange(const BasicBatchResult<T>& x, const RangeCheck& range){
+    if(x.isBool) throw domain_error("Cannot compare boolean values by order!");
+    size_t n = x.values.size();
+    auto res = boolBatch<T>(n);
+    const T* a = x.values.data();
+    uint8_t* r = res.mask.data();
+    T lo = (T)range.lo;
+    T hi = (T)range.hi;
+    if(range.loInclusive && range.hiInclusive) rangeKernel<true, true>(a, n, lo, hi, r);
+    else if(range.loInclusive) rangeKernel<true, false>(a, n, lo, hi, r);
+    else if(range.hiInclusive) rangeKernel<false, true>(a, n, lo, hi, r);
+    else rangeKernel<false, false>(a, n, lo, hi, r);
+    return res;
+}
+
+template <class T>
+static inline BasicBatchResult<T> batchMembership(const BasicBatchResult<T>& x, const MembershipSet& set){
+    if(x.isBool) throw domain_error("Cannot compare a float and a bool for equality!");
+    size_t n = x.values.size();
+    auto res = boolBatch<T>(n);
+    const T* a = x.values.data();
+    uint8_t* r = res.mask.data();
+    for(size_t i = 0; i < n; i++) r[i] = set.Contains((double)a[i]);
+    return res;
+}
+
+template <class T = double>
+static inline BasicBatchResult<T> gatherColumn(const vector<float>& col, const uint32_t* idx, size_t count){
+    auto res = numericBatch<T>(count);
+    if(idx == nullptr) copy(col.begin(), col.end(), res.values.begin());
+    else for(size_t i = 0; i < count; i++) res.values[i] = col[idx[i]];
+    return res;
+}
+
+template <class T = double>
+static inline BasicBatchResult<T> gatherVariable(const ColumnChunk& chunk, uint32_t id, const uint32_t* idx, size_t count){
+    // values of the column `id`, decoding encoded columns
+    auto dict = chunk.dictionaries.find(id);
+    if(dict != chunk.dictionaries.end()){
+	auto res = numericBatch<T>(count);
+	for(size_t i = 0; i < count; i++) res.values[i] = dict->second.Get(idx != nullptr ? idx[i] : i);
+	return res;
+    }
+    auto pk = chunk.packed.find(id);
+    if(pk != chunk.packed.end()){
+	auto res = numericBatch<T>(count);
+	for(size_t i = 0; i < count; i++) res.values[i] = pk->second.Get(idx != nullptr ? idx[i] : i);
+	return res;
+    }
+    auto typed = chunk.typed.find(id);
+    if(typed != chunk.typed.end()){
+	// the float engine sees every typed column as a number
+	auto res = numericBatch<T>(count);
+	visitColumn(typed->second, [&](auto data){
+	    for(size_t i = 0; i < count; i++) res.values[i] = (T)data[idx != nullptr ? idx[i] : i];
+	});
+	return res;
+    }
+    return gatherColumn<T>(chunk.GetColumn(id), idx, count);
+}
+
+template <class T>
+static inline bool compareConst(BinaryOpKind op, T x, double c){
+    switch(op){
+	case boLess: return x < c;
+	case boGreater: return x > c;
+	case boLessEq: return x <= c;
+	case boGreaterEq: return x >= c;
+	case boEqual: return x == c;
+	case boUnequal: return x != c;
+	default: throw logic_error("Not a comparison: " + toStr(op));
+    }
+}
+
+template <class T>
+static inline bool evaluateEncodedCmp(const ColumnChunk& chunk, shared_ptr<Node> n, const uint32_t* idx,
+				      size_t count, BasicBatchResult<T>& res){
+    // evaluates `n` directly on the codes if it compares an encoded column with a
+    // constant. Returns false if `n` is not of that form.
+    auto op = n->GetBinaryOp();
+    if(op < boLess || op > boUnequal) return false;
+    auto var = n->GetLeft();
+    auto other = n->GetRight();
+    if(other->kind != nkFloat){
+	swap(var, other);
+	op = mirrorOp(op);
+    }
+    if(other->kind != nkFloat || (var->kind != nkIdent && var->kind != nkBracketExpr)) return false;
+    double c = other->GetVal();
+    auto id = var->GetIdentId();
+    auto dict = chunk.dictionaries.find(id);
+    if(dict != chunk.dictionaries.end()){
+	// the predicate is evaluated once per dictionary entry
+	auto& col = dict->second;
+	vector<uint8_t> table(col.dictionary.size());
+	for(size_t k = 0; k < table.size(); k++) table[k] = compareConst(op, col.dictionary[k], c);
+	res = boolBatch<T>(count);
+	for(size_t i = 0; i < count; i++) res.mask[i] = table[col.codes[idx != nullptr ? idx[i] : i]];
+	return true;
+    }
+    auto pk = chunk.packed.find(id);
+    if(pk != chunk.packed.end()){
+	// `base + code op c` becomes `lo <= code <= hi` on the integer codes, checked with a
+	// single unsigned comparison. `!=` is the negation of `==`.
+	auto& col = pk->second;
+	double shifted = c - (double)col.base;
+	double lo = 0.0;
+	double hi = (double)col.maxCode;
+	switch(op){
+	    case boLess: hi = min(hi, ceil(shifted) - 1.0); break;
+	    case boLessEq: hi = min(hi, floor(shifted)); break;
+	    case boGreater: lo = max(lo, floor(shifted) + 1.0); break;
+	    case boGreaterEq: lo = max(lo, ceil(shifted)); break;
+	    default:
+		// equality only holds for integral constants
+		if(floor(shifted) != shifted) hi = -1.0;
+		else{
+		    lo = max(lo, shifted);
+		    hi = min(hi, shifted);
+		}
+		break;
+	}
+	uint8_t negate = op == boUnequal;
+	res = boolBatch<T>(count, negate);
+	if(lo > hi) return true;
+	uint64_t first = (uint64_t)lo;
+	uint64_t width = (uint64_t)hi - first;
+	for(size_t i = 0; i < count; i++){
+	    res.mask[i] = (col.Code(idx != nullptr ? idx[i] : i) - first <= width) != negate;
+	}
+	return true;
+    }
+    return false;
+}
+
+template <class T>
+inline BasicBatchResult<T> evaluateSelectAt(const ColumnChunk& chunk, shared_ptr<Node> n, const uint32_t* idx, size_t count);
+
+static inline bool isEncodedColumn(const ColumnChunk& chunk, shared_ptr<Node> n){
+    n = stripParens(n);
+    if(n->kind != nkIdent && n->kind != nkBracketExpr) return false;
+    return chunk.dictionaries.count(n->GetIdentId()) > 0 || chunk.packed.count(n->GetIdentId()) > 0;
+}
+
+template <class T = double>
+inline BasicBatchResult<T> evaluateBatchAt(const ColumnChunk& chunk, shared_ptr<Node> n, const uint32_t* idx, size_t count){
+    // evaluates `n` for the `count` events of `chunk` at indices `idx`, or all if `idx` is nullptr
+    switch(n->kind){
+	case nkBinary: {
+	    // fused range checks and set membership, matched once per node, unless the
+	    // comparisons can run on the codes of an encoded column
+	    auto& fused = fusedPredicate(n);
+	    if(fused.operand != nullptr && !isEncodedColumn(chunk, fused.operand)){
+		auto x = evaluateBatchAt<T>(chunk, fused.operand, idx, count);
+		if(!fused.isSet) return batchRange(x, fused.range);
+		return batchMembership(x, is_same<T, float>::value ? fused.floatSet : fused.set);
+	    }
+	    BasicBatchResult<T> encoded;
+	    if(evaluateEncodedCmp(chunk, n, idx, count, encoded)) return encoded;
+	    auto x = evaluateBatchAt<T>(chunk, n->GetLeft(), idx, count);
+	    auto y = evaluateBatchAt<T>(chunk, n->GetRight(), idx, count);
+	    switch(n->GetBinaryOp()){
+		case boMul: return batchArith(x, y, [](T a, T b){ return a * b; });
+		case boDiv: return batchArith(x, y, [](T a, T b){ return a / b; });
+		case boPlus: return batchArith(x, y, [](T a, T b){ return a + b; });
+		case boMinus: return batchArith(x, y, [](T a, T b){ return a - b; });
+		case boLess: return batchCmp(x, y, [](T a, T b) -> uint8_t { return a < b; });
+		case boGreater: return batchCmp(x, y, [](T a, T b) -> uint8_t { return a > b; });
+		case boLessEq: return batchCmp(x, y, [](T a, T b) -> uint8_t { return a <= b; });
+		case boGreaterEq: return batchCmp(x, y, [](T a, T b) -> uint8_t { return a >= b; });
+		case boEqual: return batchEqual(x, y, true);
+		case boUnequal: return batchEqual(x, y, false);
+		case boAnd: return batchLogic(x, y, [](uint8_t a, uint8_t b) -> uint8_t { return a & b; });
+		case boOr: return batchLogic(x, y, [](uint8_t a, uint8_t b) -> uint8_t { return a | b; });
+		default:
+		    throw runtime_error("Invalid binary op kind for token " + astToStr(n));
+	    }
+	}
+	case nkUnary: {
+	    auto x = evaluateBatchAt<T>(chunk, n->GetUnaryNode(), idx, count);
+	    switch(n->GetUnaryOp()){
+		case uoPlus: return x;
+		case uoMinus:
+		    if(x.isBool) throw domain_error("Cannot negate a boolean value!");
+		    for(auto& v : x.values) v = -v;
+		    return x;
+		case uoNot:
+		    if(!x.isBool) throw domain_error("Cannot apply `not` to a float value!");
+		    for(auto& v : x.mask) v = !v;
+		    return x;
+	    }
+	    break;
+	}
+	case nkIdent:
+	    return gatherVariable<T>(chunk, n->GetIdentId(), idx, count);
+	case nkFloat: {
+	    auto res = numericBatch<T>(count);
+	    fill(res.values.begin(), res.values.end(), (T)n->GetVal());
+	    return res;
+	}
+	case nkExpression:
+	    return evaluateBatchAt<T>(chunk, n->GetExprNode(), idx, count);
+	case nkBracketExpr:
+	    return gatherVariable<T>(chunk, n->GetIdentId(), idx, count);
+	case nkSelect:
+	    return evaluateSelectAt<T>(chunk, n, idx, count);
+    }
+    throw logic_error("Invalid code branch in `evaluateBatch`. Should never end up here!");
+}
+
+// an arm of `select` taken by fewer than this fraction of the events is evaluated only
+// for those events, unless it is a plain variable or constant
+const double lazySelectFraction = 0.125;
+
+template <class T>
+static inline BasicBatchResult<T> evaluateArmAt(const ColumnChunk& chunk, shared_ptr<Node> arm, const uint32_t* idx,
+						size_t count, const vector<uint8_t>& mask, uint8_t taken, size_t nTaken){
+    // evaluates `arm` at least for the events where `mask` equals `taken`
+    auto leaf = stripParens(arm);
+    if(leaf->kind == nkIdent || leaf->kind == nkFloat || leaf->kind == nkBracketExpr ||
+       (double)nTaken >= lazySelectFraction * (double)count){
+	return evaluateBatchAt<T>(chunk, arm, idx, count);
+    }
+    vector<uint32_t> sub;
+    sub.reserve(nTaken);
+    for(size_t i = 0; i < count; i++){
+	if(mask[i] == taken) sub.push_back(idx != nullptr ? idx[i] : (uint32_t)i);
+    }
+    auto part = evaluateBatchAt<T>(chunk, arm, sub.data(), sub.size());
+    // scatter back, events not taking this arm keep a zero
+    BasicBatchResult<T> res = part.isBool ? boolBatch<T>(count) : numericBatch<T>(count);
+    size_t k = 0;
+    for(size_t i = 0; i < count; i++){
+	if(mask[i] != taken) continue;
+	if(part.isBool) res.mask[i] = part.mask[k++];
+	else res.values[i] = part.values[k++];
+    }
+    return res;
+}
+
+template <class T>
+inline BasicBatchResult<T> evaluateSelectAt(const ColumnChunk& chunk, shared_ptr<Node> n, const uint32_t* idx, size_t count){
+    // both arms are evaluated over the events and blended by the condition without
+    // branching per event. Arms no event takes are skipped, rare ones evaluated lazily.
+    auto cond = evaluateBatchAt<T>(chunk, n->GetCondition(), idx, count);
+    if(!cond.isBool) throw domain_error("The condition of `select` must be a bool in " + astToStr(n));
+    size_t nTrue = 0;
+    for(auto m : cond.mask) nTrue += m;
+    if(nTrue == count) return evaluateBatchAt<T>(chunk, n->GetTrueArm(), idx, count);
+    if(nTrue == 0) return evaluateBatchAt<T>(chunk, n->GetFalseArm(), idx, count);
+    auto x = evaluateArmAt<T>(chunk, n->GetTrueArm(), idx, count, cond.mask, 1, nTrue);
+    auto y = evaluateArmAt<T>(chunk, n->GetFalseArm(), idx, count, cond.mask, 0, count - nTrue);
+    if(x.isBool != y.isBool) throw domain_error("The arms of `select` differ in type in " + astToStr(n));
+    const uint8_t* m = cond.mask.data();
+    if(x.isBool){
+	uint8_t* r = x.mask.data();
+	const uint8_t* b = y.mask.data();
+	for(size_t i = 0; i < count; i++) r[i] = (m[i] & r[i]) | ((m[i] ^ 1) & b[i]);
+	return x;
+    }
+    T* r = x.values.data();
+    const T* b = y.values.data();
+    for(size_t i = 0; i < count; i++) r[i] = m[i] ? r[i] : b[i];
+    return x;
+}
+
+template <class T = double>
+inline BasicBatchResult<T> evaluateBatch(const ColumnChunk& chunk, shared_ptr<Node> n){
+    TRACE_SPAN("evaluate chunk");
+    return evaluateBatchAt<T>(chunk, n, nullptr, chunk.size);
+}
+
+template <class T = double>
+inline BasicBatchResult<T> evaluateBatch(const ColumnChunk& chunk, shared_ptr<Node> n, const vector<uint32_t>& indices){
+    // evaluates `n` only for the events at `indices`
+    TRACE_SPAN("evaluate chunk");
+    return evaluateBatchAt<T>(chunk, n, indices.data(), indices.size());
+}
+
+// Precision validation
+//
+// Before switching an expression to `float` evaluation, `validatePrecision` evaluates it
+// both ways over a sample of chunks and reports how far the single precision result
+// strays from the double one.
+
+struct PrecisionReport {
+    size_t events = 0;
+    double maxAbsDeviation = 0.0;
+    double maxRelDeviation = 0.0;
+    // boolean results that differ, e.g. for events sitting right at a cut value
+    size_t boolMismatches = 0;
+
+    bool Acceptable(double relTolerance) const {
+	return boolMismatches == 0 && maxRelDeviation <= relTolerance;
+    }
+};
+
+inline PrecisionReport validatePrecision(const vector<ColumnChunk>& chunks, shared_ptr<Node> n){
+    PrecisionReport rep;
+    for(auto& chunk : chunks){
+	auto ref = evaluateBatch<double>(chunk, n);
+	auto single = evaluateBatch<float>(chunk, n);
+	rep.events += chunk.size;
+	if(ref.isBool){
+	    for(size_t i = 0; i < chunk.size; i++) rep.boolMismatches += ref.mask[i] != single.mask[i];
+	    continue;
+	}
+	for(size_t i = 0; i < chunk.size; i++){
+	    double x = ref.values[i];
+	    double y = single.values[i];
+	    if(isnan(x) && isnan(y)) continue;
+	    // a NaN or overflow on only one side is an unbounded deviation
+	    double dev = isnan(x) || isnan(y) ? numeric_limits<double>::infinity() : fabs(x - y);
+	    if(isinf(x) && x == y) dev = 0.0;
+	    rep.maxAbsDeviation = max(rep.maxAbsDeviation, dev);
+	    if(dev > 0.0) rep.maxRelDeviation = max(rep.maxRelDeviation, dev / max(fabs(x), (double)numeric_limits<float>::min()));
+	}
+    }
+    return rep;
+}
+
+// Zone maps
+//
+// Before evaluating a chunk, the expression is checked against the min / max statistics
+// of the chunk's columns. If it can never be true the chunk is skipped, if it is always
+// true it is accepted wholesale. Neither touches the column data.
+
+static inline void collectVariables(shared_ptr<Node> n, vector<string>& vars){
+    // appends the names of all variables (as in `variableName`) used in `n`
+    switch(n->kind){
+	case nkBinary:
+	    collectVariables(n->GetLeft(), vars);
+	    collectVariables(n->GetRight(), vars);
+	    break;
+	case nkUnary:
+	    collectVariables(n->GetUnaryNode(), vars);
+	    break;
+	case nkExpression:
+	    collectVariables(n->GetExprNode(), vars);
+	    break;
+	case nkSelect:
+	    collectVariables(n->GetCondition(), vars);
+	    collectVariables(n->GetTrueArm(), vars);
+	    collectVariables(n->GetFalseArm(), vars);
+	    break;
+	case nkIdent:
+	case nkBracketExpr:
+	    if(find(vars.begin(), vars.end(), variableName(n)) == vars.end()){
+		vars.push_back(variableName(n));
+	    }
+	    break;
+	default: break;
+    }
+}
+
+enum ChunkDecision {
+    cdSkip, cdAccept, cdEvaluate
+};
+
+inline ChunkDecision checkChunk(shared_ptr<Node> n, const ColumnChunk& chunk){
+    // decides based on the column statistics of `chunk` alone whether `n` has to be
+    // evaluated on it. Columns containing nulls are never used to skip or accept.
+    map<string, Interval> ranges;
+    vector<string> vars;
+    collectVariables(n, vars);
+    for(auto& v : vars){
+	auto it = chunk.stats.find(v);
+	if(it == chunk.stats.end()) continue;
+	auto st = it->second;
+	if(st.nullCount > 0) return cdEvaluate;
+	if(st.count == 0) return cdSkip;
+	ranges[v] = Interval{st.min, st.max, false, false};
+    }
+    if(evaluateRange(ranges, n).isLeft()) return cdEvaluate;
+    if(!canBeTrue(n, ranges)) return cdSkip;
+    if(mustBeTrue(n, ranges)) return cdAccept;
+    return cdEvaluate;
+}
+
+struct ZoneMapStats {
+    size_t skipped;
+    size_t accepted;
+    size_t evaluated;
+};
+
+static inline BatchResult evaluateZoned(const ColumnChunk& chunk, shared_ptr<Node> n, ChunkDecision& decision){
+    // evaluates `n` on a chunk unless its zone maps decide the result
+    decision = checkChunk(n, chunk);
+    switch(decision){
+	case cdSkip:
+	    return boolBatch(chunk.size, 0);
+	case cdAccept:
+	    return boolBatch(chunk.size, 1);
+	default:
+	    return evaluateBatch(chunk, n);
+    }
+}
+
+inline vector<BatchResult> evaluateChunks(const vector<ColumnChunk>& chunks, shared_ptr<Node> n,
+					  ZoneMapStats* zoneStats = nullptr){
+    // evaluates `n` on all chunks, skipping or accepting chunks based on their zone maps
+    vector<BatchResult> results;
+    results.reserve(chunks.size());
+    ZoneMapStats st{0, 0, 0};
+    for(auto& chunk : chunks){
+	ChunkDecision decision;
+	results.push_back(evaluateZoned(chunk, n, decision));
+	switch(decision){
+	    case cdSkip: st.skipped++; break;
+	    case cdAccept: st.accepted++; break;
+	    case cdEvaluate: st.evaluated++; break;
+	}
+    }
+    if(zoneStats != nullptr) *zoneStats = st;
+    return results;
+}
+
+// Binary serialization of expressions
+//
+// Layout (all integers little endian):
+//   magic "EXPR" | u32 version | u32 number of expressions | u64 payload size |
+//   u64 FNV-1a checksum of the payload | payload
+// The payload holds for each expression its name followed by its nodes in pre order.
+// Loading rebuilds the AST directly, without tokenizing or verifying tokens again.
+// Files with a different version or a wrong checksum are rejected.
+
+static const uint32_t expressionFormatVersion = 1;
+static const char expressionFormatMagic[4] = {'E', 'X', 'P', 'R'};
+
+static inline uint64_t fnv1a(const uint8_t* data, size_t len){
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++){
+	hash ^= data[i];
+	hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline void writeUInt(vector<uint8_t>& buf, uint64_t x, int bytes){
+    for(int i = 0; i < bytes; i++){
+	buf.push_back((uint8_t)(x >> (8 * i)));
+    }
+}
+
+static inline void writeString(vector<uint8_t>& buf, const string& s){
+    writeUInt(buf, s.length(), 4);
+    buf.insert(buf.end(), s.begin(), s.end());
+}
+
+static inline void writeDouble(vector<uint8_t>& buf, double x){
+    uint64_t bits;
+    static_assert(sizeof(bits) == sizeof(x), "double must be 64 bit");
+    memcpy(&bits, &x, sizeof(x));
+    writeUInt(buf, bits, 8);
+}
+
+inline void serializeNode(vector<uint8_t>& buf, shared_ptr<Node> n){
+    writeUInt(buf, n->kind, 1);
+    switch(n->kind){
+	case nkUnary:
+	    writeUInt(buf, n->GetUnaryOp(), 1);
+	    serializeNode(buf, n->GetUnaryNode());
+	    break;
+	case nkBinary:
+	    writeUInt(buf, n->GetBinaryOp(), 1);
+	    serializeNode(buf, n->GetLeft());
+	    serializeNode(buf, n->GetRight());
+	    break;
+	case nkFloat:
+	    writeDouble(buf, n->GetVal());
+	    break;
+	case nkIdent:
+	    writeString(buf, n->GetIdent());
+	    break;
+	case nkExpression:
+	    serializeNode(buf, n->GetExprNode());
+	    break;
+	case nkBracketExpr:
+	    serializeNode(buf, n->GetNode());
+	    serializeNode(buf, n->GetArg());
+	    break;
+	case nkSelect:
+	    serializeNode(buf, n->GetCondition());
+	    serializeNode(buf, n->GetTrueArm());
+	    serializeNode(buf, n->GetFalseArm());
+	    break;
+    }
+}
+
+inline vector<uint8_t> serializeExpressions(const map<string, Expression>& exprs){
+    vector<uint8_t> payload;
+    for(auto& kv : exprs){
+	writeString(payload, kv.first);
+	serializeNode(payload, kv.second);
+    }
+    vector<uint8_t> buf(expressionFormatMagic, expressionFormatMagic + 4);
+    writeUInt(buf, expressionFormatVersion, 4);
+    writeUInt(buf, exprs.size(), 4);
+    writeUInt(buf, payload.size(), 8);
+    writeUInt(buf, fnv1a(payload.data(), payload.size()), 8);
+    buf.insert(buf.end(), payload.begin(), payload.end());
+    return buf;
+}
+
+class ExpressionReader {
+public:
+    // reads back what `serializeExpressions` wrote. Every read is bounds checked
+    ExpressionReader(const uint8_t* data, size_t len): data(data), len(len), pos(0) {};
+    uint64_t ReadUInt(int bytes){
+	Require(bytes);
+	uint64_t x = 0;
+	for(int i = 0; i < bytes; i++){
+	    x |= (uint64_t)data[pos + i] << (8 * i);
+	}
+	pos += bytes;
+	return x;
+    };
+    double ReadDouble(){
+	uint64_t bits = ReadUInt(8);
+	double x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+    };
+    string ReadString(){
+	size_t n = ReadUInt(4);
+	Require(n);
+	string s((const char*)data + pos, n);
+	pos += n;
+	return s;
+    };
+    shared_ptr<Node> ReadNode(){
+	auto kind = ReadUInt(1);
+	switch(kind){
+	    case nkUnary: {
+		auto op = ReadUInt(1);
+		if(op > uoNot) throw runtime_error("Invalid unary op in serialized expression!");
+		return unaryNode((UnaryOpKind)op, ReadNode());
+	    }
+	    case nkBinary: {
+		auto op = ReadUInt(1);
+		if(op > boOr) throw runtime_error("Invalid binary op in serialized expression!");
+		auto left = ReadNode();
+		return binaryNode((BinaryOpKind)op, left, ReadNode());
+	    }
+	    case nkFloat:
+		return shared_ptr<Node>(new FloatNode(ReadDouble()));
+	    case nkIdent:
+		return shared_ptr<Node>(new IdentNode(ReadString()));
+	    case nkExpression:
+		return shared_ptr<Node>(new ExpressionNode(ReadNode()));
+	    case nkBracketExpr: {
+		auto node = ReadNode();
+		return shared_ptr<Node>(new BracketExprNode(node, ReadNode()));
+	    }
+	    case nkSelect: {
+		auto cond = ReadNode();
+		auto a = ReadNode();
+		return selectNode(cond, a, ReadNode());
+	    }
+	    default:
+		throw runtime_error("Invalid node kind " + to_string(kind) + " in serialized expression!");
+	}
+    };
+    void Require(size_t n){
+	if(n > len - pos){
+	    throw runtime_error("Serialized expression is truncated!");
+	}
+    };
+    const uint8_t* data;
+    size_t len;
+    size_t pos;
+};
+
+inline map<string, Expression> deserializeExpressions(const uint8_t* data, size_t len){
+    ExpressionReader r(data, len);
+    r.Require(4);
+    if(memcmp(data, expressionFormatMagic, 4) != 0){
+	throw runtime_error("Not a serialized expression file!");
+    }
+    r.pos = 4;
+    auto version = r.ReadUInt(4);
+    if(version != expressionFormatVersion){
+	throw runtime_error("Serialized expressions have version " + to_string(version) + ", but only version " +
+			    to_string(expressionFormatVersion) + " is supported!");
+    }
+    auto count = r.ReadUInt(4);
+    auto payloadSize = r.ReadUInt(8);
+    auto checksum = r.ReadUInt(8);
+    r.Require(payloadSize);
+    if(r.pos + payloadSize != len || fnv1a(data + r.pos, payloadSize) != checksum){
+	throw runtime_error("Checksum mismatch, serialized expressions are corrupt!");
+    }
+    map<string, Expression> result;
+    for(uint64_t i = 0; i < count; i++){
+	auto name = r.ReadString();
+	result[name] = r.ReadNode();
+    }
+    if(r.pos != len){
+	throw runtime_error("Trailing data after serialized expressions!");
+    }
+    return result;
+}
+
+inline void saveExpressions(const string& path, const map<string, Expression>& exprs){
+    TRACE_SPAN("save expressions");
+    auto buf = serializeExpressions(exprs);
+    ofstream f(path, ios::binary);
+    f.write((const char*)buf.data(), buf.size());
+    if(!f){
+	throw runtime_error("Could not write expressions to " + path);
+    }
+}
+
+inline map<string, Expression> loadExpressions(const string& path){
+    TRACE_SPAN("load expressions");
+    ifstream f(path, ios::binary | ios::ate);
+    if(!f){
+	throw runtime_error("Could not open expression file " + path);
+    }
+    vector<uint8_t> buf((size_t)f.tellg());
+    f.seekg(0);
+    f.read((char*)buf.data(), buf.size());
+    return deserializeExpressions(buf.data(), buf.size());
+}
+
+// Compile time expressions
+//
+// `STATIC_EXPRESSION("a > 5 && b[1] < 3")` parses the string literal at compile time
+// (relaxed C++14 constexpr) into an expression template. The result is a functor
+// evaluated over any accessor `acc` where `acc[id]` returns the value of the variable
+// with index `id` in `variables()` (e.g. a `const float*`, `std::array` or `vector`).
+// Bracket expressions are variables of their own, named as by `variableName`.
+// Syntax and type errors (e.g. `5 && 3`) fail to compile via `static_assert`.
+// Operator precedence follows `parseExpression`, i.e. `&&` and `||` bind equally.
+
+enum StaticNodeKind {
+    snFloat, snVar, snUnary, snBinary
+};
+
+enum StaticError {
+    seNone, seSyntax, seType
+};
+
+struct StaticNodeData {
+    int kind = snFloat;
+    int op = 0;
+    int left = 0;
+    int right = 0;
+    double val = 0.0;
+    int var = 0;
+    bool isBool = false;
+};
+
+template <size_t N>
+struct StaticParse {
+    // there can never be more nodes or variables than characters
+    StaticNodeData nodes[N + 1] = {};
+    int count = 0;
+    int root = 0;
+    // start, length and bracket index (-1 if none) of each distinct variable
+    int varStart[N + 1] = {};
+    int varLen[N + 1] = {};
+    int varIndex[N + 1] = {};
+    int varCount = 0;
+    int error = seNone;
+    int errorPos = -1;
+};
+
+template <size_t N>
+class StaticParser {
+public:
+    constexpr StaticParser(const char* s): s(s), pos(0), res() {};
+    constexpr StaticParse<N> Parse(){
+	int root = ParseOr();
+	SkipSpaces();
+	if(pos != (int)N) Fail(seSyntax);
+	res.root = res.error == seNone ? root : 0;
+	return res;
+    };
+private:
+    constexpr void Fail(int err){
+	if(res.error == seNone){
+	    res.error = err;
+	    res.errorPos = pos;
+	}
+	// stop parsing
+	pos = N;
+    };
+    constexpr void SkipSpaces(){
+	while(pos < (int)N && s[pos] == ' ') pos++;
+    };
+    constexpr bool IsIdentChar(char c) const {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.';
+    };
+    constexpr bool Accept(const char* tok){
+	// consumes `tok` if it comes next. Words have to end at a non identifier character
+	SkipSpaces();
+	int i = 0;
+	while(tok[i] != '\0'){
+	    if(pos + i >= (int)N || s[pos + i] != tok[i]) return false;
+	    i++;
+	}
+	if(IsIdentChar(tok[0]) && pos + i < (int)N && IsIdentChar(s[pos + i])) return false;
+	// don't confuse `!=` with `!` and `<=` with `<` etc
+	if(i == 1 && (tok[0] == '!' || tok[0] == '<' || tok[0] == '>') && pos + 1 < (int)N && s[pos + 1] == '=') return false;
+	pos += i;
+	return true;
+    };
+    constexpr int AddNode(StaticNodeData n){
+	res.nodes[res.count] = n;
+	return res.count++;
+    };
+    constexpr int Binary(int op, int left, int right){
+	StaticNodeData n;
+	n.kind = snBinary;
+	n.op = op;
+	n.left = left;
+	n.right = right;
+	bool l = res.nodes[left].isBool;
+	bool r = res.nodes[right].isBool;
+	switch(op){
+	    case boAnd: case boOr:
+		if(!l || !r) Fail(seType);
+		n.isBool = true;
+		break;
+	    case boEqual: case boUnequal:
+		if(l != r) Fail(seType);
+		n.isBool = true;
+		break;
+	    case boLess: case boGreater: case boLessEq: case boGreaterEq:
+		if(l || r) Fail(seType);
+		n.isBool = true;
+		break;
+	    default:
+		if(l || r) Fail(seType);
+		break;
+	}
+	return AddNode(n);
+    };
+    constexpr int Unary(int op, int child){
+	StaticNodeData n;
+	n.kind = snUnary;
+	n.op = op;
+	n.left = child;
+	n.isBool = op == uoNot;
+	if(res.nodes[child].isBool != n.isBool) Fail(seType);
+	return AddNode(n);
+    };
+    constexpr int ParseOr(){
+	int left = ParseNot();
+	while(res.error == seNone){
+	    if(Accept("&&") || Accept("and")) left = Binary(boAnd, left, ParseNot());
+	    else if(Accept("||") || Accept("or")) left = Binary(boOr, left, ParseNot());
+	    else break;
+	}
+	return left;
+    };
+    constexpr int ParseNot(){
+	if(Accept("!") || Accept("not")) return Unary(uoNot, ParseNot());
+	return ParseCmp();
+    };
+    constexpr int ParseCmp(){
+	int left = ParseAdd();
+	while(res.error == seNone){
+	    if(Accept("<=")) left = Binary(boLessEq, left, ParseAdd());
+	    else if(Accept(">=")) left = Binary(boGreaterEq, left, ParseAdd());
+	    else if(Accept("<")) left = Binary(boLess, left, ParseAdd());
+	    else if(Accept(">")) left = Binary(boGreater, left, ParseAdd());
+	    else if(Accept("==")) left = Binary(boEqual, left, ParseAdd());
+	    else if(Accept("!=")) left = Binary(boUnequal, left, ParseAdd());
+	    else break;
+	}
+	return left;
+    };
+    constexpr int ParseAdd(){
+	int left = ParseMul();
+	while(res.error == seNone){
+	    if(Accept("+")) left = Binary(boPlus, left, ParseMul());
+	    else if(Accept("-")) left = Binary(boMinus, left, ParseMul());
+	    else break;
+	}
+	return left;
+    };
+    constexpr int ParseMul(){
+	int left = ParseUnary();
+	while(res.error == seNone){
+	    if(Accept("*")) left = Binary(boMul, left, ParseUnary());
+	    else if(Accept("/")) left = Binary(boDiv, left, ParseUnary());
+	    else break;
+	}
+	return left;
+    };
+    constexpr int ParseUnary(){
+	if(Accept("-")) return Unary(uoMinus, ParseUnary());
+	if(Accept("+")) return Unary(uoPlus, ParseUnary());
+	return ParsePrimary();
+    };
+    constexpr int ParsePrimary(){
+	SkipSpaces();
+	if(pos >= (int)N){
+	    Fail(seSyntax);
+	    return 0;
+	}
+	if(Accept("(")){
+	    int n = ParseOr();
+	    if(!Accept(")")) Fail(seSyntax);
+	    return n;
+	}
+	if((s[pos] >= '0' && s[pos] <= '9') || s[pos] == '.'){
+	    StaticNodeData n;
+	    n.val = ParseNumber();
+	    return AddNode(n);
+	}
+	if(!IsIdentChar(s[pos])){
+	    Fail(seSyntax);
+	    return 0;
+	}
+	int start = pos;
+	while(pos < (int)N && IsIdentChar(s[pos])) pos++;
+	int len = pos - start;
+	int index = -1;
+	if(Accept("[")){
+	    SkipSpaces();
+	    if(pos >= (int)N || s[pos] < '0' || s[pos] > '9') Fail(seSyntax);
+	    index = (int)ParseNumber();
+	    if(!Accept("]")) Fail(seSyntax);
+	}
+	StaticNodeData n;
+	n.kind = snVar;
+	n.var = AddVariable(start, len, index);
+	return AddNode(n);
+    };
+    constexpr int AddVariable(int start, int len, int index){
+	for(int v = 0; v < res.varCount; v++){
+	    if(res.varLen[v] != len || res.varIndex[v] != index) continue;
+	    bool same = true;
+	    for(int i = 0; i < len; i++){
+		if(s[res.varStart[v] + i] != s[start + i]) same = false;
+	    }
+	    if(same) return v;
+	}
+	res.varStart[res.varCount] = start;
+	res.varLen[res.varCount] = len;
+	res.varIndex[res.varCount] = index;
+	return res.varCount++;
+    };
+    constexpr double ParseNumber(){
+	// mantissa and power of ten are combined by a single multiplication or
+	// division, which is exact (i.e. same as `stod`) for up to 15 digits
+	// and exponents up to 22
+	uint64_t mantissa = 0;
+	int exp10 = 0;
+	bool seenDot = false;
+	while(pos < (int)N && ((s[pos] >= '0' && s[pos] <= '9') || (s[pos] == '.' && !seenDot))){
+	    if(s[pos] == '.') seenDot = true;
+	    else{
+		if(mantissa < 100000000000000000ULL) mantissa = mantissa * 10 + (s[pos] - '0');
+		else exp10++;
+		if(seenDot) exp10--;
+	    }
+	    pos++;
+	}
+	if(pos < (int)N && (s[pos] == 'e' || s[pos] == 'E')){
+	    pos++;
+	    bool neg = false;
+	    if(pos < (int)N && (s[pos] == '-' || s[pos] == '+')){
+		neg = s[pos] == '-';
+		pos++;
+	    }
+	    int e = 0;
+	    while(pos < (int)N && s[pos] >= '0' && s[pos] <= '9'){
+		e = e * 10 + (s[pos] - '0');
+		pos++;
+	    }
+	    exp10 += neg ? -e : e;
+	}
+	if(pos < (int)N && IsIdentChar(s[pos])) Fail(seSyntax);
+	double p = 1.0;
+	for(int i = 0; i < (exp10 < 0 ? -exp10 : exp10); i++) p *= 10.0;
+	return exp10 < 0 ? (double)mantissa / p : (double)mantissa * p;
+    };
+    const char* s;
+    int pos;
+    StaticParse<N> res;
+};
+
+static constexpr size_t staticLength(const char* s){
+    size_t n = 0;
+    while(s[n] != '\0') n++;
+    return n;
+}
+
+template <class Src>
+struct StaticSource {
+    static constexpr size_t length = staticLength(Src::str());
+#if __cplusplus >= 201703L
+    static inline constexpr StaticParse<length> value = StaticParser<length>(Src::str()).Parse();
+#else
+    static constexpr StaticParse<length> value = StaticParser<length>(Src::str()).Parse();
+#endif
+};
+
+#if __cplusplus < 201703L
+// C++14 needs an out of class definition of the static members
+template <class Src> constexpr size_t StaticSource<Src>::length;
+template <class Src> constexpr StaticParse<StaticSource<Src>::length> StaticSource<Src>::value;
+#endif
+
+template <class Src, int I,
+	  int Kind = StaticSource<Src>::value.nodes[I].kind,
+	  int Op = StaticSource<Src>::value.nodes[I].op>
+struct StaticNode;
+
+template <class Src, int I, int Op>
+struct StaticNode<Src, I, snFloat, Op> {
+    template <class Acc> static double eval(const Acc&){ return StaticSource<Src>::value.nodes[I].val; }
+};
+
+template <class Src, int I, int Op>
+struct StaticNode<Src, I, snVar, Op> {
+    template <class Acc> static double eval(const Acc& acc){ return acc[StaticSource<Src>::value.nodes[I].var]; }
+};
+
+template <class Src, int I>
+struct StaticNode<Src, I, snUnary, uoPlus> {
+    using N = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    template <class Acc> static double eval(const Acc& acc){ return N::eval(acc); }
+};
+
+template <class Src, int I>
+struct StaticNode<Src, I, snUnary, uoMinus> {
+    using N = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    template <class Acc> static double eval(const Acc& acc){ return -N::eval(acc); }
+};
+
+template <class Src, int I>
+struct StaticNode<Src, I, snUnary, uoNot> {
+    using N = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    template <class Acc> static bool eval(const Acc& acc){ return !N::eval(acc); }
+};
+
+template <int Op> struct StaticBinaryOp;
+template <> struct StaticBinaryOp<boMul> { static double apply(double a, double b){ return a * b; } };
+template <> struct StaticBinaryOp<boDiv> { static double apply(double a, double b){ return a / b; } };
+template <> struct StaticBinaryOp<boPlus> { static double apply(double a, double b){ return a + b; } };
+template <> struct StaticBinaryOp<boMinus> { static double apply(double a, double b){ return a - b; } };
+template <> struct StaticBinaryOp<boLess> { static bool apply(double a, double b){ return a < b; } };
+template <> struct StaticBinaryOp<boGreater> { static bool apply(double a, double b){ return a > b; } };
+template <> struct StaticBinaryOp<boLessEq> { static bool apply(double a, double b){ return a <= b; } };
+template <> struct StaticBinaryOp<boGreaterEq> { static bool apply(double a, double b){ return a >= b; } };
+template <> struct StaticBinaryOp<boEqual> { template <class T> static bool apply(T a, T b){ return a == b; } };
+template <> struct StaticBinaryOp<boUnequal> { template <class T> static bool apply(T a, T b){ return a != b; } };
+
+template <class Src, int I, int Op>
+struct StaticNode<Src, I, snBinary, Op> {
+    using L = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    using R = StaticNode<Src, StaticSource<Src>::value.nodes[I].right>;
+    template <class Acc> static auto eval(const Acc& acc) -> decltype(StaticBinaryOp<Op>::apply(L::eval(acc), R::eval(acc))) {
+	return StaticBinaryOp<Op>::apply(L::eval(acc), R::eval(acc));
+    }
+};
+
+// `&&` and `||` short circuit, hence no `StaticBinaryOp`
+template <class Src, int I>
+struct StaticNode<Src, I, snBinary, boAnd> {
+    using L = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    using R = StaticNode<Src, StaticSource<Src>::value.nodes[I].right>;
+    template <class Acc> static bool eval(const Acc& acc){ return L::eval(acc) && R::eval(acc); }
+};
+
+template <class Src, int I>
+struct StaticNode<Src, I, snBinary, boOr> {
+    using L = StaticNode<Src, StaticSource<Src>::value.nodes[I].left>;
+    using R = StaticNode<Src, StaticSource<Src>::value.nodes[I].right>;
+    template <class Acc> static bool eval(const Acc& acc){ return L::eval(acc) || R::eval(acc); }
+};
+
+template <class Src>
+class StaticExpression {
+    using S = StaticSource<Src>;
+    static_assert(S::value.error != seSyntax, "Syntax error in static expression!");
+    static_assert(S::value.error != seType, "Type error in static expression, e.g. mixing floats and bools!");
+public:
+    using Root = StaticNode<Src, S::value.root>;
+    static constexpr bool isBool = S::value.nodes[S::value.root].isBool;
+    static constexpr int numVariables = S::value.varCount;
+    template <class Acc>
+    auto operator()(const Acc& acc) const -> decltype(Root::eval(acc)) {
+	return Root::eval(acc);
+    }
+    template <class Acc>
+    Either<double, bool> evaluate(const Acc& acc) const {
+	return toEither(Root::eval(acc));
+    }
+    static vector<string> variables(){
+	// names of the variables in order of their ids
+	vector<string> names;
+	for(int v = 0; v < S::value.varCount; v++){
+	    string name(Src::str() + S::value.varStart[v], S::value.varLen[v]);
+	    if(S::value.varIndex[v] >= 0) name += "[" + to_string(S::value.varIndex[v]) + "]";
+	    names.push_back(name);
+	}
+	return names;
+    }
+    static string source(){ return Src::str(); }
+private:
+    static Either<double, bool> toEither(double x){ return Left<double, bool>(x); }
+    static Either<double, bool> toEither(bool x){ return Right<double, bool>(x); }
+};
+
+#define STATIC_EXPRESSION(s) ([]{ struct Src { static constexpr const char* str(){ return s; } }; \
+                                  return StaticExpression<Src>(); }())
+
+inline vector<double> gatherVariables(const vector<string>& names, const map<string, float>& m,
+				      const map<string, map<int, float>>& maps){
+    // builds an accessor for a `StaticExpression` from the runtime input maps
+    vector<double> vals;
+    for(auto& name : names){
+	auto bracket = name.find('[');
+	if(bracket == string::npos){
+	    auto it = m.find(name);
+	    vals.push_back(it != m.end() ? it->second : 0.0);
+	    continue;
+	}
+	auto it = maps.find(name.substr(0, bracket));
+	int idx = stoi(name.substr(bracket + 1));
+	if(it != maps.end() && it->second.count(idx) > 0) vals.push_back(it->second.at(idx));
+	else vals.push_back(0.0);
+    }
+    return vals;
+}
+
+// Compiled expressions
+//
+// `compileExpression` flattens an AST into a postfix program for a small stack machine.
+// Its variables are listed once in `scalars` / `arrays`, and `bindVariables` resolves
+// them against a source a single time. Evaluating the bound program then reads the
+// variables by id without any lookup by name.
+
+enum OpCode {
+    ocConst, ocScalar, ocElement,
+    ocNeg, ocNot,
+    ocMul, ocDiv, ocPlus, ocMinus,
+    ocLess, ocGreater, ocLessEq, ocGreaterEq,
+    ocEqual, ocUnequal,
+    ocAnd, ocOr,
+    // fused predicates on the top of the stack, `arg` indexes `ranges` / `sets`
+    ocRange, ocInSet,
+    // pops `cond a b`, pushes `cond ? a : b`
+    ocSelect
+};
+
+struct Instruction {
+    OpCode op;
+    // index into `scalars` / `arrays` of the compiled expression
+    int arg;
+    // element index for `ocElement`
+    int idx;
+    double val;
+};
+
+class CompiledExpression {
+public:
+    vector<Instruction> code;
+    vector<string> scalars;
+    vector<string> arrays;
+    // symbol ids of `scalars` and `arrays`
+    vector<uint32_t> scalarIds;
+    vector<uint32_t> arrayIds;
+    vector<RangeCheck> ranges;
+    vector<MembershipSet> sets;
+    bool isBool = false;
+    size_t stackSize = 0;
+};
+
+struct VariableBinding {
+    // ids as returned by the source for each of `scalars` and `arrays`
+    vector<size_t> scalars;
+    vector<size_t> arrays;
+};
+
+static inline int addSymbol(vector<uint32_t>& ids, vector<string>& names, uint32_t id){
+    // deduplicates variables by their symbol id
+    auto it = find(ids.begin(), ids.end(), id);
+    if(it != ids.end()) return (int)(it - ids.begin());
+    ids.push_back(id);
+    names.push_back(symbolName(id));
+    return (int)ids.size() - 1;
+}
+
+static inline OpCode toOpCode(BinaryOpKind op){
+    switch(op){
+	case boMul: return ocMul;
+	case boDiv: return ocDiv;
+	case boPlus: return ocPlus;
+	case boMinus: return ocMinus;
+	case boLess: return ocLess;
+	case boGreater: return ocGreater;
+	case boLessEq: return ocLessEq;
+	case boGreaterEq: return ocGreaterEq;
+	case boEqual: return ocEqual;
+	case boUnequal: return ocUnequal;
+	case boAnd: return ocAnd;
+	case boOr: return ocOr;
+	default:
+	    throw runtime_error("Invalid binary op kind " + toStr(op));
+    }
+}
+
+static inline bool compileNode(CompiledExpression& ce, shared_ptr<Node> n, size_t depth){
+    // appends the code for `n` and returns whether it yields a bool. `depth` is the
+    // number of values on the stack before `n` is evaluated.
+    ce.stackSize = max(ce.stackSize, depth + 1);
+    switch(n->kind){
+	case nkBinary: {
+	    shared_ptr<Node> operand;
+	    RangeCheck range;
+	    vector<double> values;
+	    if(matchRange(n, operand, range) || matchSet(n, operand, values)){
+		bool isSet = values.size() > 0;
+		if(compileNode(ce, operand, depth)){
+		    throw domain_error(string(isSet ? "Cannot compare a float and a bool for equality in " :
+					      "Cannot compare bools by order in ") + astToStr(n));
+		}
+		if(isSet){
+		    ce.sets.push_back(MembershipSet(values));
+		    ce.code.push_back(Instruction{ocInSet, (int)ce.sets.size() - 1, 0, 0.0});
+		}
+		else{
+		    ce.ranges.push_back(range);
+		    ce.code.push_back(Instruction{ocRange, (int)ce.ranges.size() - 1, 0, 0.0});
+		}
+		return true;
+	    }
+	    bool l = compileNode(ce, n->GetLeft(), depth);
+	    bool r = compileNode(ce, n->GetRight(), depth + 1);
+	    auto op = n->GetBinaryOp();
+	    ce.code.push_back(Instruction{toOpCode(op), 0, 0, 0.0});
+	    switch(op){
+		case boAnd: case boOr:
+		    if(!l || !r) throw domain_error("Cannot compute `and` / `or` of float and bool or two floats in " + astToStr(n));
+		    return true;
+		case boEqual: case boUnequal:
+		    if(l != r) throw domain_error("Cannot compare a float and a bool for equality in " + astToStr(n));
+		    return true;
+		case boLess: case boGreater: case boLessEq: case boGreaterEq:
+		    if(l || r) throw domain_error("Cannot compare bools by order in " + astToStr(n));
+		    return true;
+		default:
+		    if(l || r) throw domain_error("Cannot apply arithmetic to bools in " + astToStr(n));
+		    return false;
+	    }
+	}
+	case nkUnary: {
+	    bool b = compileNode(ce, n->GetUnaryNode(), depth);
+	    switch(n->GetUnaryOp()){
+		case uoPlus: break;
+		case uoMinus:
+		    if(b) throw domain_error("Cannot negate a bool in " + astToStr(n));
+		    ce.code.push_back(Instruction{ocNeg, 0, 0, 0.0});
+		    break;
+		case uoNot:
+		    if(!b) throw domain_error("Cannot apply `not` to a float in " + astToStr(n));
+		    ce.code.push_back(Instruction{ocNot, 0, 0, 0.0});
+		    break;
+	    }
+	    return b;
+	}
+	case nkIdent:
+	    ce.code.push_back(Instruction{ocScalar, addSymbol(ce.scalarIds, ce.scalars, n->GetIdentId()), 0, 0.0});
+	    return false;
+	case nkFloat:
+	    ce.code.push_back(Instruction{ocConst, 0, 0, n->GetVal()});
+	    return false;
+	case nkExpression:
+	    return compileNode(ce, n->GetExprNode(), depth);
+	case nkBracketExpr:
+	    ce.code.push_back(Instruction{ocElement, addSymbol(ce.arrayIds, ce.arrays, n->GetNode()->GetIdentId()),
+					  (int)n->GetArg()->GetVal(), 0.0});
+	    return false;
+	case nkSelect: {
+	    // both arms are computed, the program stays free of jumps
+	    bool c = compileNode(ce, n->GetCondition(), depth);
+	    bool a = compileNode(ce, n->GetTrueArm(), depth + 1);
+	    bool b = compileNode(ce, n->GetFalseArm(), depth + 2);
+	    if(!c) throw domain_error("The condition of `select` must be a bool in " + astToStr(n));
+	    if(a != b) throw domain_error("The arms of `select` differ in type in " + astToStr(n));
+	    ce.code.push_back(Instruction{ocSelect, 0, 0, 0.0});
+	    return a;
+	}
+    }
+    throw logic_error("Invalid code branch in `compileNode`. Should never end up here!");
+}
+
+inline CompiledExpression compileExpression(shared_ptr<Node> n){
+    TRACE_SPAN("compile");
+    CompiledExpression ce;
+    ce.isBool = compileNode(ce, n, 0);
+    return ce;
+}
+
+template <class Source>
+inline VariableBinding bindVariables(const Source& src, const CompiledExpression& ce){
+    TRACE_SPAN("bind");
+    VariableBinding b;
+    for(auto& name : ce.scalars) b.scalars.push_back(src.GetScalarId(name));
+    for(auto& name : ce.arrays) b.arrays.push_back(src.GetArrayId(name));
+    return b;
+}
+
+template <class T, class Source>
+inline T runProgram(const Source& src, const CompiledExpression& ce, const VariableBinding& b, T* st){
+    // executes the program on the stack `st` of at least `ce.stackSize` elements.
+    // Bools are represented as 0 and 1. The arithmetic is done in `T`.
+    int sp = -1;
+    for(auto& ins : ce.code){
+	switch(ins.op){
+	    case ocConst: st[++sp] = (T)ins.val; break;
+	    case ocScalar: st[++sp] = src.GetScalar(b.scalars[ins.arg]); break;
+	    case ocElement: st[++sp] = src.GetElement(b.arrays[ins.arg], ins.idx); break;
+	    case ocNeg: st[sp] = -st[sp]; break;
+	    case ocNot: st[sp] = st[sp] == 0; break;
+	    case ocMul: sp--; st[sp] = st[sp] * st[sp + 1]; break;
+	    case ocDiv: sp--; st[sp] = st[sp] / st[sp + 1]; break;
+	    case ocPlus: sp--; st[sp] = st[sp] + st[sp + 1]; break;
+	    case ocMinus: sp--; st[sp] = st[sp] - st[sp + 1]; break;
+	    case ocLess: sp--; st[sp] = st[sp] < st[sp + 1]; break;
+	    case ocGreater: sp--; st[sp] = st[sp] > st[sp + 1]; break;
+	    case ocLessEq: sp--; st[sp] = st[sp] <= st[sp + 1]; break;
+	    case ocGreaterEq: sp--; st[sp] = st[sp] >= st[sp + 1]; break;
+	    case ocEqual: sp--; st[sp] = st[sp] == st[sp + 1]; break;
+	    case ocUnequal: sp--; st[sp] = st[sp] != st[sp + 1]; break;
+	    case ocAnd: sp--; st[sp] = st[sp] != 0 && st[sp + 1] != 0; break;
+	    case ocOr: sp--; st[sp] = st[sp] != 0 || st[sp + 1] != 0; break;
+	    case ocRange: st[sp] = ce.ranges[ins.arg].Contains(st[sp]); break;
+	    case ocInSet: st[sp] = ce.sets[ins.arg].Contains((double)st[sp]); break;
+	    case ocSelect: sp -= 2; st[sp] = st[sp] != 0 ? st[sp + 1] : st[sp + 2]; break;
+	}
+    }
+    return st[0];
+}
+
+template <class T = double, class Source>
+inline Either<double, bool> evaluate(const Source& src, const CompiledExpression& ce, const VariableBinding& b){
+    // `evaluate<float>` runs the program in single precision, the result is widened again
+    T local[32];
+    vector<T> heap;
+    T* st = local;
+    if(ce.stackSize > 32){
+	heap.resize(ce.stackSize);
+	st = heap.data();
+    }
+    double res = runProgram(src, ce, b, st);
+    if(ce.isBool) return Right<double, bool>(res != 0.0);
+    return Left<double, bool>(res);
+}
+
+// Allocation free evaluation
+//
+// Once constructed, `BoundExpression::Evaluate` (per event) and `BatchProgram::Run` (per
+// chunk) never allocate: bindings, evaluation stacks and column ids are set up front.
+// `evaluate(src, ce, b)` is allocation free as well for programs of at most 32 stack
+// slots. Only error paths, which build the message of the exception, allocate.
+
+template <class Source>
+class BoundExpression {
+public:
+    // a compiled program bound to `src` together with its stack. Not thread safe,
+    // use one per thread.
+    BoundExpression(const Source& src, const CompiledExpression& ce):
+	src(src), ce(ce), binding(bindVariables(src, ce)), stack(max(ce.stackSize, (size_t)1)) {};
+    Either<double, bool> Evaluate(){
+	double res = runProgram(src, ce, binding, stack.data());
+	if(ce.isBool) return Right<double, bool>(res != 0.0);
+	return Left<double, bool>(res);
+    };
+    const Source& src;
+    CompiledExpression ce;
+    VariableBinding binding;
+    vector<double> stack;
+};
+
+class BatchProgram {
+public:
+    // runs a compiled program over whole chunks of up to `capacity` events, with one
+    // preallocated column per stack slot
+    BatchProgram(const CompiledExpression& ce, size_t capacity):
+	ce(ce), capacity(capacity), columnIds(ce.code.size(), noSymbol),
+	stack(max(ce.stackSize, (size_t)1) * capacity) {
+	for(size_t k = 0; k < ce.code.size(); k++){
+	    auto& ins = ce.code[k];
+	    if(ins.op == ocScalar) columnIds[k] = ce.scalarIds[ins.arg];
+	    if(ins.op == ocElement) columnIds[k] = internSymbol(ce.arrays[ins.arg] + "[" + to_string(ins.idx) + "]");
+	}
+    };
+    const double* Run(const ColumnChunk& chunk){
+	// returns the values (bools as 0 and 1) of the `chunk.size` events, valid until
+	// the next call
+	if(chunk.size > capacity){
+	    throw length_error("Chunk of " + to_string(chunk.size) + " events exceeds the capacity of " + to_string(capacity));
+	}
+	size_t n = chunk.size;
+	int sp = -1;
+	for(size_t k = 0; k < ce.code.size(); k++){
+	    auto& ins = ce.code[k];
+	    switch(ins.op){
+		case ocConst: sp++; fill(Slot(sp), Slot(sp) + n, ins.val); break;
+		case ocScalar: case ocElement: sp++; Load(chunk, columnIds[k], Slot(sp), n); break;
+		case ocNeg: Apply(Slot(sp), n, [](double a){ return -a; }); break;
+		case ocNot: Apply(Slot(sp), n, [](double a){ return (double)(a == 0.0); }); break;
+		case ocMul: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return a * b; }); break;
+		case ocDiv: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return a / b; }); break;
+		case ocPlus: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return a + b; }); break;
+		case ocMinus: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return a - b; }); break;
+		case ocLess: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a < b); }); break;
+		case ocGreater: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a > b); }); break;
+		case ocLessEq: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a <= b); }); break;
+		case ocGreaterEq: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a >= b); }); break;
+		case ocEqual: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a == b); }); break;
+		case ocUnequal: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a != b); }); break;
+		case ocAnd: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a != 0.0 && b != 0.0); }); break;
+		case ocOr: sp--; Apply(Slot(sp), Slot(sp + 1), n, [](double a, double b){ return (double)(a != 0.0 || b != 0.0); }); break;
+		case ocRange: {
+		    auto& range = ce.ranges[ins.arg];
+		    Apply(Slot(sp), n, [&range](double a){ return (double)range.Contains(a); });
+		    break;
+		}
+		case ocInSet: {
+		    auto& set = ce.sets[ins.arg];
+		    Apply(Slot(sp), n, [&set](double a){ return (double)set.Contains(a); });
+		    break;
+		}
+		case ocSelect: {
+		    sp -= 2;
+		    double* r = Slot(sp);
+		    const double* a = Slot(sp + 1);
+		    const double* b = Slot(sp + 2);
+		    for(size_t i = 0; i < n; i++) r[i] = r[i] != 0.0 ? a[i] : b[i];
+		    break;
+		}
+	    }
+	}
+	return Slot(0);
+    };
+    void Run(const ColumnChunk& chunk, uint8_t* mask){
+	// writes the result of a boolean program into `mask`
+	auto res = Run(chunk);
+	for(size_t i = 0; i < chunk.size; i++) mask[i] = res[i] != 0.0;
+    };
+    CompiledExpression ce;
+    size_t capacity;
+private:
+    double* Slot(int i){
+	return stack.data() + (size_t)i * capacity;
+    };
+    template <class F>
+    static void Apply(double* a, size_t n, F f){
+	for(size_t i = 0; i < n; i++) a[i] = f(a[i]);
+    };
+    template <class F>
+    static void Apply(double* a, const double* b, size_t n, F f){
+	for(size_t i = 0; i < n; i++) a[i] = f(a[i], b[i]);
+    };
+    static void Load(const ColumnChunk& chunk, uint32_t id, double* r, size_t n){
+	// decodes column `id` into `r`, like `gatherVariable` but into the given buffer
+	auto dict = chunk.dictionaries.find(id);
+	if(dict != chunk.dictionaries.end()){
+	    for(size_t i = 0; i < n; i++) r[i] = dict->second.Get(i);
+	    return;
+	}
+	auto pk = chunk.packed.find(id);
+	if(pk != chunk.packed.end()){
+	    for(size_t i = 0; i < n; i++) r[i] = pk->second.Get(i);
+	    return;
+	}
+	auto typed = chunk.typed.find(id);
+	if(typed != chunk.typed.end()){
+	    visitColumn(typed->second, [&](auto data){
+		for(size_t i = 0; i < n; i++) r[i] = (double)data[i];
+	    });
+	    return;
+	}
+	auto& col = chunk.GetColumn(id);
+	copy(col.begin(), col.begin() + n, r);
+    };
+    // column of each `ocScalar` / `ocElement` instruction
+    vector<uint32_t> columnIds;
+    vector<double> stack;
+};
+
+// Histograms
+//
+// `fillHistogram` evaluates an observable (and optionally a cut) chunk by chunk and
+// fills the histogram in the same pass: first all bin indices of a chunk are computed,
+// then they are scatter-added. Events failing the cut or being NaN go to an extra
+// discard bin, so neither loop branches on the data. With several threads each thread
+// fills a private histogram over its share of the chunks and they are merged at the end.
+
+struct Binning {
+    size_t nBins;
+    double lo;
+    double hi;
+};
+
+static inline void computeBins(const Binning& b, const double* x, const uint8_t* mask, size_t n, uint32_t* bins){
+    // bin 0 is the underflow, nBins + 1 the overflow and nBins + 2 the discard bin
+    const double scale = b.nBins / (b.hi - b.lo);
+    const uint32_t discard = b.nBins + 2;
+    for(size_t i = 0; i < n; i++){
+	double pos = (x[i] - b.lo) * scale;
+	// written so that NaN is clamped as well and the cast below stays defined
+	pos = !(pos >= -1.0) ? -1.0 : pos;
+	pos = pos > (double)b.nBins ? (double)b.nBins : pos;
+	uint32_t bin = (uint32_t)(int64_t)(pos + 1.0);
+	bool keep = (mask == nullptr || mask[i]) && x[i] == x[i];
+	bins[i] = keep ? bin : discard;
+    }
+}
+
+class Histogram1D {
+public:
+    Histogram1D(Binning binning): binning(binning), counts(binning.nBins + 3, 0.0) {};
+    // content of bin `i` in [0, nBins), excluding under- and overflow
+    double GetBinContent(size_t i) const { return counts[i + 1]; };
+    double GetUnderflow() const { return counts[0]; };
+    double GetOverflow() const { return counts[binning.nBins + 1]; };
+    double GetEntries() const {
+	double sum = 0.0;
+	for(size_t i = 0; i < binning.nBins + 2; i++) sum += counts[i];
+	return sum;
+    };
+    void Fill(const double* x, const uint8_t* mask, size_t n){
+	vector<uint32_t> bins(n);
+	computeBins(binning, x, mask, n, bins.data());
+	for(size_t i = 0; i < n; i++) counts[bins[i]] += 1.0;
+    };
+    void Merge(const Histogram1D& h){
+	for(size_t i = 0; i < counts.size(); i++) counts[i] += h.counts[i];
+    };
+    Binning binning;
+    vector<double> counts;
+};
+
+class Histogram2D {
+public:
+    Histogram2D(Binning x, Binning y): binningX(x), binningY(y), counts((x.nBins + 3) * (y.nBins + 3), 0.0) {};
+    // content of bin (i, j), both excluding under- and overflow
+    double GetBinContent(size_t i, size_t j) const { return counts[(j + 1) * (binningX.nBins + 3) + i + 1]; };
+    void Fill(const double* x, const double* y, const uint8_t* mask, size_t n){
+	vector<uint32_t> binsX(n);
+	vector<uint32_t> binsY(n);
+	computeBins(binningX, x, mask, n, binsX.data());
+	computeBins(binningY, y, mask, n, binsY.data());
+	const size_t stride = binningX.nBins + 3;
+	for(size_t i = 0; i < n; i++) counts[binsY[i] * stride + binsX[i]] += 1.0;
+    };
+    void Merge(const Histogram2D& h){
+	for(size_t i = 0; i < counts.size(); i++) counts[i] += h.counts[i];
+    };
+    Binning binningX;
+    Binning binningY;
+    vector<double> counts;
+};
+
+static inline const uint8_t* cutMask(const ColumnChunk& chunk, shared_ptr<Node> cut, BatchResult& res, bool& skip){
+    // evaluates the cut on a chunk, using the zone maps. Returns nullptr if all events pass
+    skip = false;
+    if(cut == nullptr) return nullptr;
+    switch(checkChunk(cut, chunk)){
+	case cdSkip:
+	    skip = true;
+	    return nullptr;
+	case cdAccept:
+	    return nullptr;
+	default: break;
+    }
+    res = evaluateBatch(chunk, cut);
+    if(!res.isBool) throw domain_error("Cut " + astToStr(cut) + " is not a boolean expression!");
+    return res.mask.data();
+}
+
+template <class F>
+static inline void parallelFor(size_t n, int nThreads, F f){
+    // calls `f(i)` for all i in [0, n) using up to `nThreads` threads. Indices are
+    // claimed one by one, so uneven work balances out. The first exception thrown by
+    // `f` is rethrown after all threads are done.
+    nThreads = max(1, min(nThreads, (int)n));
+    if(nThreads == 1){
+	for(size_t i = 0; i < n; i++) f(i);
+	return;
+    }
+    atomic<size_t> next(0);
+    exception_ptr error;
+    mutex errorMutex;
+    vector<thread> threads;
+    for(int t = 0; t < nThreads; t++){
+	threads.push_back(thread([&](){
+	    try{
+		for(size_t i = next++; i < n; i = next++) f(i);
+	    }
+	    catch (...) {
+		lock_guard<mutex> lock(errorMutex);
+		if(!error) error = current_exception();
+		// stop the other threads early
+		next = n;
+	    }
+	}));
+    }
+    for(auto& th : threads) th.join();
+    if(error) rethrow_exception(error);
+}
+
+template <class Hist, class F>
+static inline Hist fillParallel(const Hist& empty, size_t nChunks, int nThreads, F fillChunk){
+    // private copy `t` of `empty` is filled from chunks t, t + nThreads, ... and the
+    // copies are merged in order. Errors of `fillChunk` are rethrown by `parallelFor`.
+    nThreads = max(1, min(nThreads, (int)nChunks));
+    vector<Hist> hists(nThreads, empty);
+    parallelFor(nThreads, nThreads, [&](size_t t){
+	for(size_t c = t; c < nChunks; c += nThreads){
+	    TRACE_SPAN("fill chunk");
+	    fillChunk(hists[t], c);
+	}
+    });
+    Hist result = empty;
+    for(auto& h : hists) result.Merge(h);
+    return result;
+}
+
+static inline void fillHistogramChunk(Histogram1D& h, const ColumnChunk& chunk, shared_ptr<Node> obs, const uint8_t* mask){
+    // fills the events of one chunk passing `mask` (from `cutMask`), also used per shard
+    auto x = evaluateBatch(chunk, obs);
+    if(x.isBool) throw domain_error("Observable " + astToStr(obs) + " is not a numerical expression!");
+    h.Fill(x.values.data(), mask, chunk.size);
+}
+
+inline void fillHistogram(Histogram1D& h, const vector<ColumnChunk>& chunks, shared_ptr<Node> obs,
+			  shared_ptr<Node> cut = nullptr, int nThreads = 1){
+    auto filled = fillParallel(Histogram1D(h.binning), chunks.size(), nThreads, [&](Histogram1D& priv, size_t c){
+	BatchResult cutRes;
+	bool skip;
+	auto mask = cutMask(chunks[c], cut, cutRes, skip);
+	if(skip) return;
+	fillHistogramChunk(priv, chunks[c], obs, mask);
+    });
+    h.Merge(filled);
+}
+
+inline void fillHistogram(Histogram2D& h, const vector<ColumnChunk>& chunks, shared_ptr<Node> obsX,
+			  shared_ptr<Node> obsY, shared_ptr<Node> cut = nullptr, int nThreads = 1){
+    auto filled = fillParallel(Histogram2D(h.binningX, h.binningY), chunks.size(), nThreads, [&](Histogram2D& priv, size_t c){
+	BatchResult cutRes;
+	bool skip;
+	auto mask = cutMask(chunks[c], cut, cutRes, skip);
+	if(skip) return;
+	auto x = evaluateBatch(chunks[c], obsX);
+	auto y = evaluateBatch(chunks[c], obsY);
+	if(x.isBool || y.isBool) throw domain_error("Observables of a 2D histogram must be numerical expressions!");
+	priv.Fill(x.values.data(), y.values.data(), mask, chunks[c].size);
+    });
+    h.Merge(filled);
+}
+
+// Aggregation
+//
+// `aggregate` computes count, sum, mean, min, max and (population) variance of numerical
+// expressions, optionally only over events passing a cut. NaN values are skipped, like
+// histograms drop them, and do not count. Each chunk is reduced on its
+// own with compensated (Neumaier) summation and a two pass variance, then the per chunk
+// partials are merged pairwise in a fixed tree over the chunk order. Threads only decide
+// who computes which chunk, so the result is bit identical for any number of threads.
+
+struct AggregateResult {
+    size_t count;
+    double sum;
+    double mean;
+    double min;
+    double max;
+    double variance;
+};
+
+struct PartialAggregate {
+    size_t count;
+    // compensated sum, the true sum is `sum + comp`
+    double sum;
+    double comp;
+    double min;
+    double max;
+    double mean;
+    // sum of squared deviations from `mean`
+    double m2;
+};
+
+static inline void neumaierAdd(double& sum, double& comp, double x){
+    double t = sum + x;
+    if(fabs(sum) >= fabs(x)) comp += (sum - t) + x;
+    else comp += (x - t) + sum;
+    sum = t;
+}
+
+static inline PartialAggregate emptyAggregate(){
+    return PartialAggregate{0, 0.0, 0.0, numeric_limits<double>::infinity(), -numeric_limits<double>::infinity(), 0.0, 0.0};
+}
+
+static inline PartialAggregate aggregateValues(const double* x, const uint8_t* mask, size_t n){
+    auto p = emptyAggregate();
+    for(size_t i = 0; i < n; i++){
+	if((mask != nullptr && !mask[i]) || std::isnan(x[i])) continue;
+	p.count++;
+	neumaierAdd(p.sum, p.comp, x[i]);
+	p.min = x[i] < p.min ? x[i] : p.min;
+	p.max = x[i] > p.max ? x[i] : p.max;
+    }
+    if(p.count == 0) return p;
+    p.mean = (p.sum + p.comp) / p.count;
+    double comp = 0.0;
+    for(size_t i = 0; i < n; i++){
+	if((mask != nullptr && !mask[i]) || std::isnan(x[i])) continue;
+	double d = x[i] - p.mean;
+	neumaierAdd(p.m2, comp, d * d);
+    }
+    p.m2 += comp;
+    return p;
+}
+
+static inline PartialAggregate mergeAggregates(const PartialAggregate& a, const PartialAggregate& b){
+    // Chan et al. parallel update of mean and squared deviations
+    if(a.count == 0) return b;
+    if(b.count == 0) return a;
+    PartialAggregate r;
+    r.count = a.count + b.count;
+    r.sum = a.sum;
+    r.comp = a.comp + b.comp;
+    neumaierAdd(r.sum, r.comp, b.sum);
+    r.min = min(a.min, b.min);
+    r.max = max(a.max, b.max);
+    double delta = b.mean - a.mean;
+    r.mean = a.mean + delta * b.count / r.count;
+    r.m2 = a.m2 + b.m2 + delta * delta * ((double)a.count * b.count / r.count);
+    return r;
+}
+
+static inline PartialAggregate reduceAggregates(const vector<PartialAggregate>& parts, size_t begin, size_t end){
+    // pairwise reduction, the tree only depends on the number of parts
+    if(end - begin == 0) return emptyAggregate();
+    if(end - begin == 1) return parts[begin];
+    size_t mid = begin + (end - begin) / 2;
+    return mergeAggregates(reduceAggregates(parts, begin, mid), reduceAggregates(parts, mid, end));
+}
+
+static inline AggregateResult toAggregateResult(const PartialAggregate& p){
+    if(p.count == 0){
+	const double nan = numeric_limits<double>::quiet_NaN();
+	return AggregateResult{0, 0.0, nan, nan, nan, nan};
+    }
+    return AggregateResult{p.count, p.sum + p.comp, p.mean, p.min, p.max, p.m2 / p.count};
+}
+
+static inline void aggregateChunk(const ColumnChunk& chunk, size_t c, const vector<Expression>& exprs, const uint8_t* mask,
+				  vector<vector<PartialAggregate>>& parts){
+    // partials `parts[e][c]` of the events of chunk `c` passing `mask` (from `cutMask`),
+    // also used per shard
+    for(size_t e = 0; e < exprs.size(); e++){
+	auto x = evaluateBatch(chunk, exprs[e]);
+	if(x.isBool) throw domain_error("Cannot aggregate boolean expression " + astToStr(exprs[e]));
+	parts[e][c] = aggregateValues(x.values.data(), mask, chunk.size);
+    }
+}
+
+inline vector<AggregateResult> aggregate(const vector<ColumnChunk>& chunks, const vector<Expression>& exprs,
+					 shared_ptr<Node> cut = nullptr, int nThreads = 1){
+    // aggregates of all `exprs` in a single pass over the chunks
+    vector<vector<PartialAggregate>> parts(exprs.size(), vector<PartialAggregate>(chunks.size(), emptyAggregate()));
+    parallelFor(chunks.size(), nThreads, [&](size_t c){
+	BatchResult cutRes;
+	bool skip;
+	auto mask = cutMask(chunks[c], cut, cutRes, skip);
+	if(skip) return;
+	aggregateChunk(chunks[c], c, exprs, mask, parts);
+    });
+    vector<AggregateResult> results;
+    for(auto& p : parts) results.push_back(toAggregateResult(reduceAggregates(p, 0, p.size())));
+    return results;
+}
+
+inline AggregateResult aggregate(const vector<ColumnChunk>& chunks, shared_ptr<Node> expr,
+				 shared_ptr<Node> cut = nullptr, int nThreads = 1){
+    return aggregate(chunks, vector<Expression>{expr}, cut, nThreads)[0];
+}
+
+// Selection bitmaps
+//
+// Results of boolean expressions packed as one bit per event into 64 bit words. Bitmaps
+// of different cuts are combined with bitwise operations and counted via popcount, so
+// cut-flow tables can be built from cached bitmaps without evaluating the cuts again.
+// Sparse selections can be stored run-length encoded as `CompressedBitmap`.
+
+static inline int popcount64(uint64_t x){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+static inline int countTrailingZeros64(uint64_t x){
+    // `x` must not be zero
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while(!(x & 1)){ x >>= 1; n++; }
+    return n;
+#endif
+}
+
+class SelectionBitmap {
+public:
+    SelectionBitmap(): size(0) {};
+    SelectionBitmap(size_t n, bool val = false): size(n), words((n + 63) / 64, val ? ~0ULL : 0ULL) {
+	ClearTail();
+    };
+    bool Get(size_t i) const { return (words[i >> 6] >> (i & 63)) & 1; };
+    void Set(size_t i, bool val){
+	if(val) words[i >> 6] |= 1ULL << (i & 63);
+	else words[i >> 6] &= ~(1ULL << (i & 63));
+    };
+    void Append(const uint8_t* mask, size_t n){
+	// appends a byte mask as produced by `evaluateBatch`
+	words.resize((size + n + 63) / 64, 0ULL);
+	for(size_t i = 0; i < n; i++){
+	    words[(size + i) >> 6] |= (uint64_t)(mask[i] != 0) << ((size + i) & 63);
+	}
+	size += n;
+    };
+    void Append(bool val, size_t n){
+	// appends `n` times the same value, filling whole words at once
+	words.resize((size + n + 63) / 64, 0ULL);
+	if(val){
+	    size_t i = size;
+	    size_t end = size + n;
+	    for(; i < end && (i & 63) != 0; i++) words[i >> 6] |= 1ULL << (i & 63);
+	    for(; i + 64 <= end; i += 64) words[i >> 6] = ~0ULL;
+	    for(; i < end; i++) words[i >> 6] |= 1ULL << (i & 63);
+	}
+	size += n;
+    };
+    void Append(const SelectionBitmap& b){
+	// appends another bitmap word by word, shifted to the current end
+	const size_t shift = size & 63;
+	const size_t base = size >> 6;
+	words.resize((size + b.size + 63) / 64, 0ULL);
+	for(size_t i = 0; i < b.words.size(); i++){
+	    words[base + i] |= b.words[i] << shift;
+	    if(shift != 0 && base + i + 1 < words.size()) words[base + i + 1] |= b.words[i] >> (64 - shift);
+	}
+	size += b.size;
+    };
+    size_t Count() const {
+	size_t count = 0;
+	for(auto w : words) count += popcount64(w);
+	return count;
+    };
+    SelectionBitmap& operator&=(const SelectionBitmap& b){
+	CheckSize(b);
+	for(size_t i = 0; i < words.size(); i++) words[i] &= b.words[i];
+	return *this;
+    };
+    SelectionBitmap& operator|=(const SelectionBitmap& b){
+	CheckSize(b);
+	for(size_t i = 0; i < words.size(); i++) words[i] |= b.words[i];
+	return *this;
+    };
+    SelectionBitmap& AndNot(const SelectionBitmap& b){
+	CheckSize(b);
+	for(size_t i = 0; i < words.size(); i++) words[i] &= ~b.words[i];
+	return *this;
+    };
+    void CheckSize(const SelectionBitmap& b) const {
+	if(size != b.size){
+	    throw domain_error("Cannot combine bitmaps of size " + to_string(size) + " and " + to_string(b.size));
+	}
+    };
+    void ClearTail(){
+	// bits past `size` are always zero so that `Count` stays correct
+	if(size & 63) words.back() &= (1ULL << (size & 63)) - 1;
+    };
+    size_t size;
+    vector<uint64_t> words;
+};
+
+inline SelectionBitmap operator&(SelectionBitmap a, const SelectionBitmap& b){ return a &= b; }
+inline SelectionBitmap operator|(SelectionBitmap a, const SelectionBitmap& b){ return a |= b; }
+inline SelectionBitmap andNot(SelectionBitmap a, const SelectionBitmap& b){ return a.AndNot(b); }
+
+class CompressedBitmap {
+public:
+    // run-length encoding of the set bits as (start, length) runs
+    static CompressedBitmap Compress(const SelectionBitmap& b){
+	CompressedBitmap c;
+	c.size = b.size;
+	size_t i = 0;
+	while(i < b.size){
+	    uint64_t w = b.words[i >> 6] >> (i & 63);
+	    if(w == 0){
+		// skip the rest of the word
+		i = (i | 63) + 1;
+		continue;
+	    }
+	    i += countTrailingZeros64(w);
+	    size_t start = i;
+	    while(i < b.size && b.Get(i)) i++;
+	    c.runs.push_back(make_pair((uint64_t)start, (uint64_t)(i - start)));
+	}
+	return c;
+    };
+    SelectionBitmap Decompress() const {
+	SelectionBitmap b;
+	size_t pos = 0;
+	for(auto& r : runs){
+	    b.Append(false, r.first - pos);
+	    b.Append(true, r.second);
+	    pos = r.first + r.second;
+	}
+	b.Append(false, size - pos);
+	return b;
+    };
+    size_t Count() const {
+	size_t count = 0;
+	for(auto& r : runs) count += r.second;
+	return count;
+    };
+    size_t size = 0;
+    vector<pair<uint64_t, uint64_t>> runs;
+};
+
+inline CompressedBitmap operator&(const CompressedBitmap& a, const CompressedBitmap& b){
+    // intersection of two sorted run lists
+    if(a.size != b.size) throw domain_error("Cannot combine bitmaps of different size!");
+    CompressedBitmap c;
+    c.size = a.size;
+    size_t i = 0, j = 0;
+    while(i < a.runs.size() && j < b.runs.size()){
+	auto lo = max(a.runs[i].first, b.runs[j].first);
+	auto endA = a.runs[i].first + a.runs[i].second;
+	auto endB = b.runs[j].first + b.runs[j].second;
+	auto hi = min(endA, endB);
+	if(lo < hi) c.runs.push_back(make_pair(lo, hi - lo));
+	if(endA < endB) i++;
+	else j++;
+    }
+    return c;
+}
+
+inline CompressedBitmap operator|(const CompressedBitmap& a, const CompressedBitmap& b){
+    if(a.size != b.size) throw domain_error("Cannot combine bitmaps of different size!");
+    vector<pair<uint64_t, uint64_t>> all;
+    merge(a.runs.begin(), a.runs.end(), b.runs.begin(), b.runs.end(), back_inserter(all));
+    CompressedBitmap c;
+    c.size = a.size;
+    for(auto& r : all){
+	if(c.runs.size() > 0 && r.first <= c.runs.back().first + c.runs.back().second){
+	    auto end = max(c.runs.back().first + c.runs.back().second, r.first + r.second);
+	    c.runs.back().second = end - c.runs.back().first;
+	}
+	else{
+	    c.runs.push_back(r);
+	}
+    }
+    return c;
+}
+
+inline SelectionBitmap evaluateBitmap(const vector<ColumnChunk>& chunks, shared_ptr<Node> cut){
+    // selection of `cut` over all chunks in order, using the zone maps
+    SelectionBitmap b;
+    for(auto& chunk : chunks){
+	switch(checkChunk(cut, chunk)){
+	    case cdSkip:
+		b.Append(false, chunk.size);
+		break;
+	    case cdAccept:
+		b.Append(true, chunk.size);
+		break;
+	    case cdEvaluate: {
+		auto res = evaluateBatch(chunk, cut);
+		if(!res.isBool) throw domain_error("Cut " + astToStr(cut) + " is not a boolean expression!");
+		b.Append(res.mask.data(), chunk.size);
+		break;
+	    }
+	}
+    }
+    return b;
+}
+
+inline vector<size_t> cutFlowCounts(const vector<SelectionBitmap>& cuts){
+    // number of events surviving each cut after all previous ones
+    vector<size_t> counts;
+    if(cuts.size() == 0) return counts;
+    SelectionBitmap selected = cuts[0];
+    counts.push_back(selected.Count());
+    for(size_t i = 1; i < cuts.size(); i++){
+	selected &= cuts[i];
+	counts.push_back(selected.Count());
+    }
+    return counts;
+}
+
+// Progressive cut-flows
+//
+// A `CutFlow` applies an ordered list of cuts. Per chunk it keeps a compacted list of
+// the indices of events still selected and evaluates each stage only on those, so
+// later (often more expensive) cuts only see the survivors of the earlier ones.
+// Chunks are processed in parallel, counts and timings are summed over chunks.
+
+struct CutFlowStage {
+    string cut;
+    size_t passed;
+    // evaluation time of this stage summed over all chunks (i.e. CPU time)
+    double seconds;
+};
+
+class CutFlow {
+public:
+    CutFlow(const vector<string>& cuts): names(cuts) {
+	for(auto& c : cuts) exprs.push_back(parseExpression(c));
+    };
+    vector<CutFlowStage> Run(const vector<ColumnChunk>& chunks, int nThreads = 1) const {
+	// per chunk and stage number of surviving events and time spent
+	vector<vector<size_t>> passed(chunks.size(), vector<size_t>(exprs.size(), 0));
+	vector<vector<double>> seconds(chunks.size(), vector<double>(exprs.size(), 0.0));
+	parallelFor(chunks.size(), nThreads, [&](size_t c){
+	    RunChunk(chunks[c], passed[c], seconds[c]);
+	});
+	vector<CutFlowStage> stages;
+	for(size_t s = 0; s < exprs.size(); s++){
+	    CutFlowStage st{names[s], 0, 0.0};
+	    for(size_t c = 0; c < chunks.size(); c++){
+		st.passed += passed[c][s];
+		st.seconds += seconds[c][s];
+	    }
+	    stages.push_back(st);
+	}
+	return stages;
+    };
+    void RunChunk(const ColumnChunk& chunk, vector<size_t>& passed, vector<double>& seconds) const {
+	TRACE_SPAN("cut flow chunk");
+	vector<uint32_t> selected(chunk.size);
+	for(size_t i = 0; i < chunk.size; i++) selected[i] = i;
+	bool all = true;
+	for(size_t s = 0; s < exprs.size() && selected.size() > 0; s++){
+	    auto start = chrono::steady_clock::now();
+	    // the zone map of the chunk is still valid for a subset of its events
+	    auto decision = checkChunk(exprs[s], chunk);
+	    if(decision == cdSkip){
+		selected.clear();
+	    }
+	    else if(decision == cdEvaluate){
+		auto res = all ? evaluateBatch(chunk, exprs[s]) : evaluateBatch(chunk, exprs[s], selected);
+		if(!res.isBool) throw domain_error("Cut " + names[s] + " is not a boolean expression!");
+		size_t n = 0;
+		for(size_t i = 0; i < selected.size(); i++){
+		    selected[n] = selected[i];
+		    n += res.mask[i];
+		}
+		selected.resize(n);
+		all = n == chunk.size;
+	    }
+	    passed[s] = selected.size();
+	    seconds[s] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+    };
+    vector<string> names;
+    vector<Expression> exprs;
+};
+
+// Constant folding
+
+inline shared_ptr<Node> foldConstants(shared_ptr<Node> n){
+    // returns a copy of `n` where all numerical subexpressions without variables are
+    // replaced by their value. Folding uses `evaluate`, so results are unchanged.
+    map<string, float> noVars;
+    switch(n->kind){
+	case nkBinary: {
+	    auto res = binaryNode(n->GetBinaryOp(), foldConstants(n->GetLeft()), foldConstants(n->GetRight()));
+	    if(res->GetLeft()->kind == nkFloat && res->GetRight()->kind == nkFloat){
+		auto val = evaluate(noVars, res);
+		if(val.isLeft()) return shared_ptr<Node>(new FloatNode(val.unsafeGetLeft()));
+	    }
+	    return res;
+	}
+	case nkUnary: {
+	    auto res = unaryNode(n->GetUnaryOp(), foldConstants(n->GetUnaryNode()));
+	    if(res->GetUnaryNode()->kind == nkFloat && n->GetUnaryOp() != uoNot){
+		return shared_ptr<Node>(new FloatNode(evaluate(noVars, res).getLeft()));
+	    }
+	    return res;
+	}
+	case nkExpression: {
+	    auto inner = foldConstants(n->GetExprNode());
+	    if(inner->kind == nkFloat) return inner;
+	    return shared_ptr<Node>(new ExpressionNode(inner));
+	}
+	case nkSelect:
+	    return selectNode(foldConstants(n->GetCondition()), foldConstants(n->GetTrueArm()),
+			      foldConstants(n->GetFalseArm()));
+	default:
+	    return n;
+    }
+}
+
+// Canonical forms and structural hashing
+//
+// `canonicalize` rewrites an expression so that different spellings of the same cut
+// become the same tree: parentheses and unary `+` are dropped, `>` / `>=` are turned
+// into `<` / `<=` by swapping the operands, operands of `+`, `*`, `==` and `!=` are
+// ordered by their hash, and chains of `&&` / `||` are flattened and sorted.
+// `structuralHash` is a 64 bit hash of the tree that only depends on its structure,
+// variable names and constants, so it is stable across processes and can key caches.
+// Canonicalizing through a `HashConsTable` makes structurally equal subtrees, also of
+// different expressions, share a single node. Such shared nodes must not be modified.
+
+static inline uint64_t mixHash(uint64_t h, uint64_t x){
+    // order dependent combination, finished with the splitmix64 finalizer
+    h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static inline uint64_t hashDouble(double x){
+    // +0 and -0 compare equal, so they hash equal
+    if(x == 0.0) x = 0.0;
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(x));
+    return bits;
+}
+
+static inline uint64_t hashString(const string& s){
+    return fnv1a((const uint8_t*)s.data(), s.size());
+}
+
+inline uint64_t structuralHash(shared_ptr<Node> n){
+    // parentheses do not change the hash
+    uint64_t h = mixHash(0, n->kind);
+    switch(n->kind){
+	case nkExpression:
+	    return structuralHash(n->GetExprNode());
+	case nkUnary:
+	    return mixHash(mixHash(h, n->GetUnaryOp()), structuralHash(n->GetUnaryNode()));
+	case nkBinary:
+	    h = mixHash(h, n->GetBinaryOp());
+	    return mixHash(mixHash(h, structuralHash(n->GetLeft())), structuralHash(n->GetRight()));
+	case nkFloat:
+	    return mixHash(h, hashDouble(n->GetVal()));
+	case nkIdent:
+	    return mixHash(h, hashString(n->GetIdent()));
+	case nkBracketExpr:
+	    return mixHash(mixHash(h, structuralHash(n->GetNode())), structuralHash(n->GetArg()));
+	case nkSelect:
+	    h = mixHash(h, structuralHash(n->GetCondition()));
+	    return mixHash(mixHash(h, structuralHash(n->GetTrueArm())), structuralHash(n->GetFalseArm()));
+    }
+    throw logic_error("Invalid code branch in `structuralHash`. Should never end up here!");
+}
+
+static inline bool sameShallow(shared_ptr<Node> a, shared_ptr<Node> b){
+    // equality of two nodes whose children are already shared, i.e. compared by pointer
+    if(a->kind != b->kind) return false;
+    switch(a->kind){
+	case nkUnary:
+	    return a->GetUnaryOp() == b->GetUnaryOp() && a->GetUnaryNode() == b->GetUnaryNode();
+	case nkBinary:
+	    return a->GetBinaryOp() == b->GetBinaryOp() && a->GetLeft() == b->GetLeft() && a->GetRight() == b->GetRight();
+	case nkFloat:
+	    return hashDouble(a->GetVal()) == hashDouble(b->GetVal());
+	case nkIdent:
+	case nkBracketExpr:
+	    return a->GetIdentId() == b->GetIdentId();
+	case nkExpression:
+	    return a->GetExprNode() == b->GetExprNode();
+	case nkSelect:
+	    return a->GetCondition() == b->GetCondition() && a->GetTrueArm() == b->GetTrueArm() &&
+		a->GetFalseArm() == b->GetFalseArm();
+    }
+    return false;
+}
+
+class HashConsTable {
+public:
+    shared_ptr<Node> Intern(shared_ptr<Node> n, uint64_t hash){
+	// returns the node equal to `n` if there is one already, else adds `n`.
+	// The children of `n` must have been interned before.
+	lock_guard<mutex> lock(tableMutex);
+	auto& bucket = nodes[hash];
+	for(auto& other : bucket){
+	    if(sameShallow(other, n)) return other;
+	}
+	bucket.push_back(n);
+	count++;
+	return n;
+    };
+    size_t Size() const { return count; };
+private:
+    mutex tableMutex;
+    unordered_map<uint64_t, vector<shared_ptr<Node>>> nodes;
+    size_t count = 0;
+};
+
+static inline shared_ptr<Node> canonicalNode(shared_ptr<Node> n, HashConsTable* table, uint64_t& hash);
+
+static inline shared_ptr<Node> internNode(shared_ptr<Node> n, HashConsTable* table, uint64_t hash){
+    return table != nullptr ? table->Intern(n, hash) : n;
+}
+
+static inline void collectChain(shared_ptr<Node> n, BinaryOpKind op, vector<shared_ptr<Node>>& operands){
+    // operands of a chain of `op`, looking through parentheses
+    n = stripParens(n);
+    if(n->kind == nkBinary && n->GetBinaryOp() == op){
+	collectChain(n->GetLeft(), op, operands);
+	collectChain(n->GetRight(), op, operands);
+    }
+    else operands.push_back(n);
+}
+
+static inline shared_ptr<Node> canonicalNode(shared_ptr<Node> n, HashConsTable* table, uint64_t& hash){
+    // canonical form of `n` and its structural hash
+    switch(n->kind){
+	case nkExpression:
+	    return canonicalNode(n->GetExprNode(), table, hash);
+	case nkUnary: {
+	    if(n->GetUnaryOp() == uoPlus) return canonicalNode(n->GetUnaryNode(), table, hash);
+	    uint64_t h;
+	    auto x = canonicalNode(n->GetUnaryNode(), table, h);
+	    // same as `structuralHash`, from the hashes of the children
+	    hash = mixHash(mixHash(mixHash(0, nkUnary), n->GetUnaryOp()), h);
+	    return internNode(unaryNode(n->GetUnaryOp(), x), table, hash);
+	}
+	case nkBinary: {
+	    auto op = n->GetBinaryOp();
+	    if(op == boAnd || op == boOr){
+		vector<shared_ptr<Node>> operands;
+		collectChain(n, op, operands);
+		vector<pair<uint64_t, shared_ptr<Node>>> sorted;
+		for(auto& x : operands){
+		    uint64_t h;
+		    auto c = canonicalNode(x, table, h);
+		    sorted.push_back(make_pair(h, c));
+		}
+		stable_sort(sorted.begin(), sorted.end(), [](const pair<uint64_t, shared_ptr<Node>>& a,
+							      const pair<uint64_t, shared_ptr<Node>>& b){
+		    return a.first < b.first;
+		});
+		auto res = sorted[0].second;
+		hash = sorted[0].first;
+		for(size_t i = 1; i < sorted.size(); i++){
+		    hash = mixHash(mixHash(mixHash(mixHash(0, nkBinary), op), hash), sorted[i].first);
+		    res = internNode(binaryNode(op, res, sorted[i].second), table, hash);
+		}
+		return res;
+	    }
+	    uint64_t hl, hr;
+	    auto l = canonicalNode(n->GetLeft(), table, hl);
+	    auto r = canonicalNode(n->GetRight(), table, hr);
+	    bool swapped = false;
+	    if(op == boGreater || op == boGreaterEq){
+		op = mirrorOp(op);
+		swapped = true;
+	    }
+	    else if((op == boPlus || op == boMul || op == boEqual || op == boUnequal) && hr < hl){
+		swapped = true;
+	    }
+	    if(swapped){
+		swap(l, r);
+		swap(hl, hr);
+	    }
+	    hash = mixHash(mixHash(mixHash(mixHash(0, nkBinary), op), hl), hr);
+	    return internNode(binaryNode(op, l, r), table, hash);
+	}
+	case nkSelect: {
+	    uint64_t hc, ha, hb;
+	    auto cond = canonicalNode(n->GetCondition(), table, hc);
+	    auto a = canonicalNode(n->GetTrueArm(), table, ha);
+	    auto b = canonicalNode(n->GetFalseArm(), table, hb);
+	    hash = mixHash(mixHash(mixHash(mixHash(0, nkSelect), hc), ha), hb);
+	    return internNode(selectNode(cond, a, b), table, hash);
+	}
+	default:
+	    // leaves are shared as they are
+	    hash = structuralHash(n);
+	    return internNode(n, table, hash);
+    }
+}
+
+inline shared_ptr<Node> canonicalize(shared_ptr<Node> n, HashConsTable* table = nullptr){
+    uint64_t hash;
+    return canonicalNode(n, table, hash);
+}
+
+// Bulk compilation of expression catalogues
+//
+// `compileCatalogue` tokenizes, verifies, parses, folds and compiles a whole list of
+// expressions on a pool of threads. Results keep the input order. An entry that fails
+// gets its error message and `ok == false`, without affecting the others.
+
+struct CatalogueEntry {
+    string source;
+    Expression ast;
+    CompiledExpression compiled;
+    bool ok;
+    string error;
+};
+
+inline CatalogueEntry compileEntry(const string& source){
+    CatalogueEntry e;
+    e.source = source;
+    e.ok = false;
+    try{
+	e.ast = foldConstants(parseExpression(source));
+	e.compiled = compileExpression(e.ast);
+	e.ok = true;
+    }
+    catch (exception& ex) {
+	e.ast = nullptr;
+	e.error = ex.what();
+    }
+    return e;
+}
+
+inline vector<CatalogueEntry> compileCatalogue(const vector<string>& sources,
+					       int nThreads = max(1u, thread::hardware_concurrency())){
+    vector<CatalogueEntry> entries(sources.size());
+    parallelFor(sources.size(), nThreads, [&](size_t i){
+	entries[i] = compileEntry(sources[i]);
+    });
+    return entries;
+}
+
+// Typed columns
+//
+// Columns can keep their native type (bool, int32, int64, float32, float64) instead of
+// being converted to float. `inferType` assigns a type to every node:
+//   - integral literals are int64, other literals float64
+//   - `+`, `-`, `*` of two integers are int64, anything involving floats is float64
+//   - `/` is always float64, like in `evaluate`
+//   - comparisons, `&&`, `||` and `!` are bool. Bools can only be compared for equality.
+// `evaluateTyped` then computes integer expressions in int64, so large ids keep their
+// precision. If an int64 operation overflows for any event of a batch, that operation
+// is computed in float64 for the whole batch instead. Comparisons of a column with a
+// constant run on the column's native type.
+
+static inline bool isIntegralLiteral(double x){
+    return floor(x) == x && fabs(x) < 9.2e18;
+}
+
+static inline ColumnType columnType(const ColumnChunk& chunk, uint32_t id){
+    auto it = chunk.typed.find(id);
+    if(it != chunk.typed.end()) return it->second.type;
+    if(chunk.packed.count(id) > 0) return ctInt64;
+    return ctFloat32;
+}
+
+inline ColumnType inferType(const ColumnChunk& chunk, shared_ptr<Node> n){
+    switch(n->kind){
+	case nkFloat:
+	    return isIntegralLiteral(n->GetVal()) ? ctInt64 : ctFloat64;
+	case nkIdent:
+	case nkBracketExpr:
+	    return columnType(chunk, n->GetIdentId());
+	case nkExpression:
+	    return inferType(chunk, n->GetExprNode());
+	case nkSelect: {
+	    if(inferType(chunk, n->GetCondition()) != ctBool){
+		throw domain_error("The condition of `select` must be a bool in " + astToStr(n));
+	    }
+	    auto a = inferType(chunk, n->GetTrueArm());
+	    auto b = inferType(chunk, n->GetFalseArm());
+	    if((a == ctBool) != (b == ctBool)) throw domain_error("The arms of `select` differ in type in " + astToStr(n));
+	    if(a == b) return a;
+	    return isInteger(a) && isInteger(b) ? ctInt64 : ctFloat64;
+	}
+	case nkUnary: {
+	    auto t = inferType(chunk, n->GetUnaryNode());
+	    if((n->GetUnaryOp() == uoNot) != (t == ctBool)){
+		throw domain_error("Invalid operand of type " + toString(t) + " for unary " + toStr(n->GetUnaryOp()));
+	    }
+	    return t == ctInt32 ? ctInt64 : t == ctFloat32 ? ctFloat64 : t;
+	}
+	case nkBinary: {
+	    auto l = inferType(chunk, n->GetLeft());
+	    auto r = inferType(chunk, n->GetRight());
+	    auto op = n->GetBinaryOp();
+	    switch(op){
+		case boAnd: case boOr:
+		    if(l != ctBool || r != ctBool) throw domain_error("Cannot compute `and` / `or` of non bools in " + astToStr(n));
+		    return ctBool;
+		case boEqual: case boUnequal:
+		    if((l == ctBool) != (r == ctBool)) throw domain_error("Cannot compare a number and a bool in " + astToStr(n));
+		    return ctBool;
+		default: break;
+	    }
+	    if(l == ctBool || r == ctBool) throw domain_error("Invalid bool operand of " + toStr(op) + " in " + astToStr(n));
+	    switch(op){
+		case boLess: case boGreater: case boLessEq: case boGreaterEq:
+		    return ctBool;
+		case boDiv:
+		    return ctFloat64;
+		default:
+		    return isInteger(l) && isInteger(r) ? ctInt64 : ctFloat64;
+	    }
+	}
+    }
+    throw logic_error("Invalid code branch in `inferType`. Should never end up here!");
+}
+
+struct TypedBatch {
+    // bools in `mask`, integers (widened to int64) in `ints`, floats in `floats`
+    ColumnType type;
+    vector<uint8_t> mask;
+    vector<int64_t> ints;
+    vector<double> floats;
+};
+
+template <class T>
+static inline void compareKernel(BinaryOpKind op, const T* x, T c, size_t n, uint8_t* r){
+    // specialized per element type and operator, so every loop can be vectorized
+    switch(op){
+	case boLess: for(size_t i = 0; i < n; i++) r[i] = x[i] < c; break;
+	case boGreater: for(size_t i = 0; i < n; i++) r[i] = x[i] > c; break;
+	case boLessEq: for(size_t i = 0; i < n; i++) r[i] = x[i] <= c; break;
+	case boGreaterEq: for(size_t i = 0; i < n; i++) r[i] = x[i] >= c; break;
+	case boEqual: for(size_t i = 0; i < n; i++) r[i] = x[i] == c; break;
+	case boUnequal: for(size_t i = 0; i < n; i++) r[i] = x[i] != c; break;
+	default: throw logic_error("Not a comparison: " + toStr(op));
+    }
+}
+
+template <class T>
+static inline bool nativeConstant(double c, T& res){
+    // converts the constant of a comparison to the column type if that is exact
+    if(is_integral<T>::value && (!isIntegralLiteral(c) ||
+				 c < (double)numeric_limits<T>::lowest() || c > (double)numeric_limits<T>::max())){
+	return false;
+    }
+    res = (T)c;
+    return (double)res == c;
+}
+
+static inline bool evaluateNativeCmp(const ColumnChunk& chunk, shared_ptr<Node> n, TypedBatch& res){
+    // `column op constant` on the native column type
+    auto op = n->GetBinaryOp();
+    if(op < boLess || op > boUnequal) return false;
+    auto var = n->GetLeft();
+    auto other = n->GetRight();
+    if(other->kind != nkFloat){
+	swap(var, other);
+	op = mirrorOp(op);
+    }
+    if(other->kind != nkFloat || (var->kind != nkIdent && var->kind != nkBracketExpr)) return false;
+    auto it = chunk.typed.find(var->GetIdentId());
+    if(it == chunk.typed.end() || it->second.type == ctBool) return false;
+    bool ok = false;
+    res.type = ctBool;
+    res.mask.resize(chunk.size);
+    visitColumn(it->second, [&](auto data){
+	using T = typename remove_const<typename remove_pointer<decltype(data)>::type>::type;
+	T c;
+	if(nativeConstant(other->GetVal(), c)){
+	    compareKernel(op, data, c, chunk.size, res.mask.data());
+	    ok = true;
+	}
+    });
+    return ok;
+}
+
+static inline TypedBatch typedLeaf(const ColumnChunk& chunk, uint32_t id){
+    TypedBatch res;
+    auto it = chunk.typed.find(id);
+    if(it == chunk.typed.end()){
+	auto pk = chunk.packed.find(id);
+	if(pk != chunk.packed.end()){
+	    res.type = ctInt64;
+	    res.ints.resize(chunk.size);
+	    for(size_t i = 0; i < chunk.size; i++) res.ints[i] = pk->second.Get(i);
+	    return res;
+	}
+	res.type = ctFloat64;
+	res.floats = gatherVariable(chunk, id, nullptr, chunk.size).values;
+	return res;
+    }
+    auto& col = it->second;
+    res.type = col.type;
+    visitColumn(col, [&](auto data){
+	switch(col.type){
+	    case ctBool: res.mask.assign(data, data + col.size); break;
+	    case ctInt32: case ctInt64: res.ints.assign(data, data + col.size); break;
+	    default: res.floats.assign(data, data + col.size); break;
+	}
+    });
+    return res;
+}
+
+static inline vector<double> asFloats(TypedBatch& x){
+    if(isFloat(x.type)) return move(x.floats);
+    return vector<double>(x.ints.begin(), x.ints.end());
+}
+
+template <class T, class F>
+static inline void typedArith(const vector<T>& a, const vector<T>& b, vector<T>& r, F f){
+    r.resize(a.size());
+    for(size_t i = 0; i < a.size(); i++) r[i] = f(a[i], b[i]);
+}
+
+template <class F>
+static inline bool checkedArith(const vector<int64_t>& a, const vector<int64_t>& b, vector<int64_t>& r, F f){
+    // `f` returns true on overflow like the `__builtin_*_overflow` functions, false if
+    // any element overflowed
+    r.resize(a.size());
+    bool overflow = false;
+    for(size_t i = 0; i < a.size(); i++) overflow |= f(a[i], b[i], &r[i]);
+    return !overflow;
+}
+
+template <class T>
+static inline void typedCompare(BinaryOpKind op, const vector<T>& a, const vector<T>& b, vector<uint8_t>& r){
+    r.resize(a.size());
+    switch(op){
+	case boLess: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] < b[i]; break;
+	case boGreater: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] > b[i]; break;
+	case boLessEq: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] <= b[i]; break;
+	case boGreaterEq: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] >= b[i]; break;
+	case boEqual: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] == b[i]; break;
+	case boUnequal: for(size_t i = 0; i < a.size(); i++) r[i] = a[i] != b[i]; break;
+	default: throw logic_error("Not a comparison: " + toStr(op));
+    }
+}
+
+inline TypedBatch evaluateTypedNode(const ColumnChunk& chunk, shared_ptr<Node> n){
+    TypedBatch res;
+    switch(n->kind){
+	case nkFloat:
+	    if(isIntegralLiteral(n->GetVal())){
+		res.type = ctInt64;
+		res.ints.assign(chunk.size, (int64_t)n->GetVal());
+	    }
+	    else{
+		res.type = ctFloat64;
+		res.floats.assign(chunk.size, n->GetVal());
+	    }
+	    return res;
+	case nkIdent:
+	case nkBracketExpr:
+	    return typedLeaf(chunk, n->GetIdentId());
+	case nkExpression:
+	    return evaluateTypedNode(chunk, n->GetExprNode());
+	case nkSelect: {
+	    auto c = evaluateTypedNode(chunk, n->GetCondition());
+	    auto x = evaluateTypedNode(chunk, n->GetTrueArm());
+	    auto y = evaluateTypedNode(chunk, n->GetFalseArm());
+	    const uint8_t* m = c.mask.data();
+	    if(x.type == ctBool){
+		res.type = ctBool;
+		res.mask.resize(chunk.size);
+		for(size_t i = 0; i < chunk.size; i++) res.mask[i] = (m[i] & x.mask[i]) | ((m[i] ^ 1) & y.mask[i]);
+	    }
+	    else if(isInteger(x.type) && isInteger(y.type)){
+		res.type = x.type == y.type ? x.type : ctInt64;
+		res.ints.resize(chunk.size);
+		for(size_t i = 0; i < chunk.size; i++) res.ints[i] = m[i] ? x.ints[i] : y.ints[i];
+	    }
+	    else{
+		res.type = x.type == y.type ? x.type : ctFloat64;
+		auto a = asFloats(x);
+		auto b = asFloats(y);
+		res.floats.resize(chunk.size);
+		for(size_t i = 0; i < chunk.size; i++) res.floats[i] = m[i] ? a[i] : b[i];
+	    }
+	    return res;
+	}
+	case nkUnary: {
+	    auto x = evaluateTypedNode(chunk, n->GetUnaryNode());
+	    switch(n->GetUnaryOp()){
+		case uoNot: for(auto& v : x.mask) v = !v; break;
+		case uoMinus:
+		    if(count(x.ints.begin(), x.ints.end(), numeric_limits<int64_t>::min()) > 0){
+			// the negation of the smallest int64 overflows
+			x.floats = asFloats(x);
+			x.ints.clear();
+			x.type = ctFloat64;
+		    }
+		    for(auto& v : x.ints) v = -v;
+		    for(auto& v : x.floats) v = -v;
+		    break;
+		default: break;
+	    }
+	    return x;
+	}
+	case nkBinary: {
+	    if(evaluateNativeCmp(chunk, n, res)) return res;
+	    auto x = evaluateTypedNode(chunk, n->GetLeft());
+	    auto y = evaluateTypedNode(chunk, n->GetRight());
+	    auto op = n->GetBinaryOp();
+	    if(op == boAnd || op == boOr || x.type == ctBool){
+		res.type = ctBool;
+		res.mask.resize(chunk.size);
+		for(size_t i = 0; i < chunk.size; i++){
+		    switch(op){
+			case boAnd: res.mask[i] = x.mask[i] & y.mask[i]; break;
+			case boOr: res.mask[i] = x.mask[i] | y.mask[i]; break;
+			case boEqual: res.mask[i] = x.mask[i] == y.mask[i]; break;
+			default: res.mask[i] = x.mask[i] != y.mask[i]; break;
+		    }
+		}
+		return res;
+	    }
+	    bool ints = isInteger(x.type) && isInteger(y.type) && op != boDiv;
+	    if(op >= boLess){
+		res.type = ctBool;
+		if(ints) typedCompare(op, x.ints, y.ints, res.mask);
+		else typedCompare(op, asFloats(x), asFloats(y), res.mask);
+		return res;
+	    }
+	    if(ints){
+		bool exact;
+		switch(op){
+		    case boMul: exact = checkedArith(x.ints, y.ints, res.ints, [](int64_t a, int64_t b, int64_t* r){ return __builtin_mul_overflow(a, b, r); }); break;
+		    case boPlus: exact = checkedArith(x.ints, y.ints, res.ints, [](int64_t a, int64_t b, int64_t* r){ return __builtin_add_overflow(a, b, r); }); break;
+		    default: exact = checkedArith(x.ints, y.ints, res.ints, [](int64_t a, int64_t b, int64_t* r){ return __builtin_sub_overflow(a, b, r); }); break;
+		}
+		if(exact){
+		    res.type = ctInt64;
+		    return res;
+		}
+		// overflowed, the batch falls back to float64
+		res.ints.clear();
+	    }
+	    res.type = ctFloat64;
+	    auto a = asFloats(x);
+	    auto b = asFloats(y);
+	    switch(op){
+		case boMul: typedArith(a, b, res.floats, [](double u, double v){ return u * v; }); break;
+		case boDiv: typedArith(a, b, res.floats, [](double u, double v){ return u / v; }); break;
+		case boPlus: typedArith(a, b, res.floats, [](double u, double v){ return u + v; }); break;
+		default: typedArith(a, b, res.floats, [](double u, double v){ return u - v; }); break;
+	    }
+	    return res;
+	}
+    }
+    throw logic_error("Invalid code branch in `evaluateTyped`. Should never end up here!");
+}
+
+inline TypedBatch evaluateTyped(const ColumnChunk& chunk, shared_ptr<Node> n){
+    // type checks `n` against the column types of `chunk` and evaluates it
+    inferType(chunk, n);
+    return evaluateTypedNode(chunk, n);
+}
+
+// Tiered execution
+//
+// `TieredExecutor` starts every expression of a catalogue in the interpreted tier, i.e.
+// walking the AST. Each expression counts its evaluations; once it reaches the
+// promotion threshold it is queued for a background thread, which folds constants,
+// compiles and binds it. The compiled tier is published with a single atomic pointer
+// store, evaluating threads pick it up on their next call without ever waiting.
+// The source must stay valid (and its ids stable) for the lifetime of the executor.
+
+enum ExecutionTier {
+    etInterpreted, etCompiled
+};
+
+static inline string toString(ExecutionTier tier){
+    switch(tier){
+	case etInterpreted: return "interpreted";
+	case etCompiled: return "compiled";
+	default: return "";
+    }
+}
+
+struct TierStats {
+    ExecutionTier tier;
+    uint64_t evaluations;
+    // evaluations done in the interpreted tier
+    uint64_t interpreted;
+};
+
+template <class Source>
+class TieredExecutor {
+public:
+    TieredExecutor(const Source& src, const vector<Expression>& exprs, uint64_t promoteAfter = 1000):
+	src(src), promoteAfter(promoteAfter), stop(false), pending(0) {
+	for(auto& e : exprs){
+	    entries.push_back(unique_ptr<Entry>(new Entry()));
+	    entries.back()->ast = e;
+	}
+	worker = thread([this](){ Promote(); });
+    };
+    ~TieredExecutor(){
+	{
+	    lock_guard<mutex> lock(queueMutex);
+	    stop = true;
+	}
+	wake.notify_all();
+	worker.join();
+    };
+    Either<double, bool> Evaluate(size_t i){
+	auto& e = *entries[i];
+	auto count = e.evaluations.fetch_add(1, memory_order_relaxed) + 1;
+	auto compiled = e.compiled.load(memory_order_acquire);
+	if(compiled != nullptr) return evaluate(src, compiled->code, compiled->binding);
+	e.interpreted.fetch_add(1, memory_order_relaxed);
+	if(count == promoteAfter) Enqueue(i);
+	return evaluate(src, e.ast);
+    };
+    ExecutionTier Tier(size_t i) const {
+	return entries[i]->compiled.load(memory_order_acquire) != nullptr ? etCompiled : etInterpreted;
+    };
+    vector<TierStats> Stats() const {
+	vector<TierStats> stats;
+	for(size_t i = 0; i < entries.size(); i++){
+	    stats.push_back(TierStats{Tier(i), entries[i]->evaluations.load(memory_order_relaxed),
+				      entries[i]->interpreted.load(memory_order_relaxed)});
+	}
+	return stats;
+    };
+    void WaitForPromotions(){
+	// blocks until all queued expressions are compiled
+	unique_lock<mutex> lock(queueMutex);
+	idle.wait(lock, [this](){ return pending == 0; });
+    };
+    size_t Size() const { return entries.size(); };
+private:
+    struct CompiledTier {
+	CompiledExpression code;
+	VariableBinding binding;
+    };
+    struct Entry {
+	Expression ast;
+	// set once by the background thread, owned by `owned`
+	atomic<const CompiledTier*> compiled{nullptr};
+	unique_ptr<CompiledTier> owned;
+	atomic<uint64_t> evaluations{0};
+	atomic<uint64_t> interpreted{0};
+    };
+    void Enqueue(size_t i){
+	{
+	    lock_guard<mutex> lock(queueMutex);
+	    queue.push_back(i);
+	    pending++;
+	}
+	wake.notify_one();
+    };
+    void Promote(){
+	unique_lock<mutex> lock(queueMutex);
+	while(true){
+	    wake.wait(lock, [this](){ return stop || queue.size() > 0; });
+	    if(stop) return;
+	    auto i = queue.front();
+	    queue.pop_front();
+	    lock.unlock();
+	    auto& e = *entries[i];
+	    try{
+		unique_ptr<CompiledTier> tier(new CompiledTier());
+		tier->code = compileExpression(foldConstants(e.ast));
+		tier->binding = bindVariables(src, tier->code);
+		e.owned = move(tier);
+		e.compiled.store(e.owned.get(), memory_order_release);
+	    }
+	    catch(exception&){
+		// expressions failing to compile keep being interpreted, which reports the error
+	    }
+	    lock.lock();
+	    pending--;
+	    if(pending == 0) idle.notify_all();
+	}
+    };
+    const Source& src;
+    uint64_t promoteAfter;
+    vector<unique_ptr<Entry>> entries;
+    mutex queueMutex;
+    condition_variable wake;
+    condition_variable idle;
+    deque<size_t> queue;
+    bool stop;
+    size_t pending;
+    thread worker;
+};
+
+// Hot swappable expression registry
+//
+// `ExpressionRegistry` holds the current `ExpressionSet`, an immutable version of all
+// named expressions. Writers build a new version and publish it with one atomic pointer
+// swap. Readers pin the current version for a batch with `Read`, which only stores
+// their epoch into their own slot and loads the pointer; they never lock or wait.
+// Replaced versions are retired with the epoch of their replacement and freed once no
+// reader pinned before that epoch is still active (epoch based reclamation).
+
+class ExpressionSet {
+public:
+    int Find(const string& name) const {
+	// index of expression `name`, -1 if there is none
+	auto it = find(names.begin(), names.end(), name);
+	return it != names.end() ? (int)(it - names.begin()) : -1;
+    };
+    size_t Size() const { return names.size(); };
+    uint64_t version = 0;
+    vector<string> names;
+    vector<Expression> exprs;
+    vector<CompiledExpression> compiled;
+};
+
+class ExpressionRegistry {
+    struct ReaderSlot {
+	// epoch the reader pinned, 0 while it holds no version
+	atomic<uint64_t> epoch{0};
+	atomic<bool> used{false};
+	// keeps slots of different readers on different cache lines
+	char pad[64 - sizeof(atomic<uint64_t>) - sizeof(atomic<bool>)];
+    };
+public:
+    class ReadGuard {
+    public:
+	ReadGuard(ReaderSlot* slot, const ExpressionSet* set): slot(slot), set(set) {};
+	ReadGuard(ReadGuard&& other): slot(other.slot), set(other.set) { other.slot = nullptr; };
+	ReadGuard(const ReadGuard&) = delete;
+	~ReadGuard(){
+	    if(slot != nullptr) slot->epoch.store(0);
+	};
+	const ExpressionSet& operator*() const { return *set; };
+	const ExpressionSet* operator->() const { return set; };
+    private:
+	ReaderSlot* slot;
+	const ExpressionSet* set;
+    };
+
+    explicit ExpressionRegistry(size_t maxReaders = 64): slots(maxReaders), epoch(1), current(new ExpressionSet()) {};
+    ~ExpressionRegistry(){
+	delete current.load();
+    };
+    int RegisterReader(){
+	// claims a reader slot for the calling thread
+	for(size_t i = 0; i < slots.size(); i++){
+	    bool expected = false;
+	    if(slots[i].used.compare_exchange_strong(expected, true)) return (int)i;
+	}
+	throw runtime_error("All " + to_string(slots.size()) + " reader slots of the registry are taken!");
+    };
+    void UnregisterReader(int reader){
+	assert(reader >= 0 && (size_t)reader < slots.size());
+	slots[reader].epoch.store(0);
+	slots[reader].used.store(false);
+    };
+    ReadGuard Read(int reader){
+	// pins the current version until the guard is destroyed. Call once per batch,
+	// nested guards of the same reader are not supported.
+	assert(reader >= 0 && (size_t)reader < slots.size());
+	auto& slot = slots[reader];
+	slot.epoch.store(epoch.load());
+	return ReadGuard(&slot, current.load());
+    };
+    uint64_t Publish(const map<string, Expression>& exprs){
+	// builds a new version from `exprs` and makes it current. Readers pinning the old
+	// version keep using it until their next `Read`.
+	unique_ptr<ExpressionSet> set(new ExpressionSet());
+	for(auto& kv : exprs){
+	    set->names.push_back(kv.first);
+	    set->exprs.push_back(kv.second);
+	    set->compiled.push_back(compileExpression(kv.second));
+	}
+	lock_guard<mutex> lock(writeMutex);
+	set->version = current.load()->version + 1;
+	auto version = set->version;
+	auto old = current.exchange(set.release());
+	retired.push_back(Retired{unique_ptr<const ExpressionSet>(old), epoch.fetch_add(1)});
+	ReclaimLocked();
+	return version;
+    };
+    uint64_t Publish(const map<string, string>& sources){
+	map<string, Expression> exprs;
+	for(auto& kv : sources) exprs[kv.first] = parseExpression(kv.second);
+	return Publish(exprs);
+    };
+    size_t Reclaim(){
+	// frees retired versions no reader can hold anymore, returns how many remain
+	lock_guard<mutex> lock(writeMutex);
+	ReclaimLocked();
+	return retired.size();
+    };
+    uint64_t Version() const { return current.load()->version; };
+private:
+    struct Retired {
+	unique_ptr<const ExpressionSet> set;
+	// global epoch at the time it was replaced
+	uint64_t epoch;
+    };
+    void ReclaimLocked(){
+	uint64_t oldest = numeric_limits<uint64_t>::max();
+	for(auto& slot : slots){
+	    auto e = slot.epoch.load();
+	    if(e != 0) oldest = min(oldest, e);
+	}
+	// a reader that pinned epoch `e` may hold any version retired at an epoch >= e
+	retired.erase(remove_if(retired.begin(), retired.end(), [oldest](const Retired& r){ return r.epoch < oldest; }),
+		      retired.end());
+    };
+    vector<ReaderSlot> slots;
+    atomic<uint64_t> epoch;
+    atomic<const ExpressionSet*> current;
+    mutex writeMutex;
+    vector<Retired> retired;
+};
+
+// Persistent result cache
+//
+// `ResultCache` keeps selection bitmaps and observable columns of expressions evaluated
+// over immutable input files in a local directory. Entries are keyed by the structural
+// hash of the canonical expression and the identity of the input file (size, mtime and
+// a checksum of its content), so equal cuts spelled differently share an entry and a
+// modified file never hits a stale one. Hits are memory mapped instead of read.
+// Several processes may share a directory: entries are written to a temporary file and
+// renamed into place, so a reader sees either no entry or a complete one. Eviction of
+// the least recently used entries, once the directory exceeds its size limit, runs
+// under an exclusive `flock`. A mapping stays valid if its entry is evicted meanwhile.
+// Entries are stored in native byte order, the cache is meant to be local to a machine.
+// The cache needs POSIX and is only compiled with `EXPRESSION_RESULT_CACHE` defined.
+
+#ifdef EXPRESSION_RESULT_CACHE
+
+static inline int64_t modificationTime(const struct stat& st){
+    // in nanoseconds
+#ifdef __APPLE__
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+struct FileIdentity {
+    uint64_t size;
+    // modification time in nanoseconds
+    int64_t mtime;
+    uint64_t checksum;
+};
+
+inline FileIdentity fileIdentity(const string& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) throw runtime_error("Could not open " + path);
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+	close(fd);
+	throw runtime_error("Could not stat " + path);
+    }
+    FileIdentity id{(uint64_t)st.st_size, modificationTime(st), fnv1a(nullptr, 0)};
+    if(id.size > 0){
+	void* data = mmap(nullptr, id.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED){
+	    close(fd);
+	    throw runtime_error("Could not map " + path);
+	}
+	id.checksum = fnv1a((const uint8_t*)data, id.size);
+	munmap(data, id.size);
+    }
+    close(fd);
+    return id;
+}
+
+enum CachedKind {
+    ckBitmap,
+    ckColumn
+};
+
+static const uint32_t resultCacheVersion = 1;
+
+struct CacheEntryHeader {
+    char magic[4];
+    // 0x01020304 as written, rejects entries of a different byte order
+    uint32_t byteOrder;
+    uint32_t version;
+    uint32_t kind;
+    uint64_t exprHash;
+    FileIdentity file;
+    // number of events
+    uint64_t count;
+};
+static_assert(sizeof(CacheEntryHeader) % 8 == 0, "cache payloads must be 8 byte aligned");
+
+static inline size_t cachePayloadBytes(CachedKind kind, uint64_t count){
+    return kind == ckBitmap ? (count + 63) / 64 * sizeof(uint64_t) : count * sizeof(double);
+}
+
+class CachedResult {
+public:
+    CachedResult(): data(nullptr), length(0) {};
+    CachedResult(void* data, size_t length): data(data), length(length) {};
+    CachedResult(CachedResult&& other): data(other.data), length(other.length) {
+	other.data = nullptr;
+    };
+    CachedResult& operator=(CachedResult&& other){
+	swap(data, other.data);
+	swap(length, other.length);
+	return *this;
+    };
+    CachedResult(const CachedResult&) = delete;
+    ~CachedResult(){
+	if(data != nullptr) munmap(data, length);
+    };
+    bool Valid() const { return data != nullptr; };
+    CachedKind Kind() const { return (CachedKind)Header().kind; };
+    size_t Size() const { return Header().count; };
+    // packed selection of a `ckBitmap` entry, as in `SelectionBitmap::words`
+    const uint64_t* Words() const { return (const uint64_t*)((const char*)data + sizeof(CacheEntryHeader)); };
+    // values of a `ckColumn` entry
+    const double* Values() const { return (const double*)((const char*)data + sizeof(CacheEntryHeader)); };
+    SelectionBitmap ToBitmap() const {
+	SelectionBitmap b;
+	b.size = Size();
+	b.words.assign(Words(), Words() + (b.size + 63) / 64);
+	return b;
+    };
+private:
+    const CacheEntryHeader& Header() const { return *(const CacheEntryHeader*)data; };
+    void* data;
+    size_t length;
+};
+
+struct CacheStats {
+    size_t hits;
+    size_t misses;
+    size_t stores;
+    size_t evictions;
+};
+
+class ResultCache {
+public:
+    ResultCache(const string& dir, uint64_t maxBytes): dir(dir), maxBytes(maxBytes) {
+	if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST){
+	    throw runtime_error("Could not create cache directory " + dir);
+	}
+    };
+    CachedResult Load(CachedKind kind, uint64_t exprHash, const FileIdentity& file){
+	// the mapped entry, or an invalid result on a miss
+	TRACE_SPAN("cache load");
+	int fd = open(EntryPath(kind, exprHash, file).c_str(), O_RDONLY);
+	if(fd < 0){
+	    misses++;
+	    return CachedResult();
+	}
+	struct stat st;
+	void* data = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CacheEntryHeader)){
+	    data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	// a hit counts as a use for the LRU order, which is the mtime of the entry
+	if(data != MAP_FAILED) futimens(fd, nullptr);
+	close(fd);
+	if(data == MAP_FAILED){
+	    misses++;
+	    return CachedResult();
+	}
+	CachedResult res(data, st.st_size);
+	if(!Matches(*(const CacheEntryHeader*)data, kind, exprHash, file) ||
+	   (size_t)st.st_size != sizeof(CacheEntryHeader) + cachePayloadBytes(kind, res.Size())){
+	    // a hash collision or an entry of another version, treated as a miss
+	    misses++;
+	    return CachedResult();
+	}
+	hits++;
+	return res;
+    };
+    CachedResult Store(uint64_t exprHash, const FileIdentity& file, const SelectionBitmap& b){
+	return Store(ckBitmap, exprHash, file, b.words.data(), b.size);
+    };
+    CachedResult Store(uint64_t exprHash, const FileIdentity& file, const vector<double>& values){
+	return Store(ckColumn, exprHash, file, values.data(), values.size());
+    };
+    CachedResult Store(CachedKind kind, uint64_t exprHash, const FileIdentity& file, const void* payload, uint64_t count){
+	// writes the entry and returns it mapped, which stays valid even if the entry is
+	// evicted right away
+	TRACE_SPAN("cache store");
+	auto path = EntryPath(kind, exprHash, file);
+	auto tmp = path + ".tmp." + to_string(getpid()) + "." + to_string(tmpCounter++);
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(fd < 0) throw runtime_error("Could not create cache entry " + tmp);
+	CacheEntryHeader h;
+	memcpy(h.magic, "ERES", 4);
+	h.byteOrder = 0x01020304;
+	h.version = resultCacheVersion;
+	h.kind = kind;
+	h.exprHash = exprHash;
+	h.file = file;
+	h.count = count;
+	size_t bytes = cachePayloadBytes(kind, count);
+	size_t length = sizeof(h) + bytes;
+	void* data = MAP_FAILED;
+	if(WriteAll(fd, &h, sizeof(h)) && WriteAll(fd, payload, bytes)){
+	    data = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(data == MAP_FAILED || rename(tmp.c_str(), path.c_str()) != 0){
+	    if(data != MAP_FAILED) munmap(data, length);
+	    unlink(tmp.c_str());
+	    throw runtime_error("Could not write cache entry " + path);
+	}
+	stores++;
+	CachedResult res(data, length);
+	if(maxBytes > 0 && DiskUsage() > maxBytes) Evict();
+	return res;
+    };
+    size_t Evict(){
+	// removes the least recently used entries until the cache fits its size limit,
+	// returns how many were removed
+	int lock = open((dir + "/.lock").c_str(), O_RDWR | O_CREAT, 0644);
+	if(lock < 0) throw runtime_error("Could not lock cache directory " + dir);
+	flock(lock, LOCK_EX);
+	auto entries = Entries();
+	sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b){ return a.used < b.used; });
+	uint64_t total = 0;
+	for(auto& e : entries) total += e.bytes;
+	size_t removed = 0;
+	for(size_t i = 0; i < entries.size() && total > maxBytes; i++){
+	    // another process may have removed it already
+	    if(unlink((dir + "/" + entries[i].name).c_str()) == 0) removed++;
+	    total -= entries[i].bytes;
+	}
+	flock(lock, LOCK_UN);
+	close(lock);
+	evictions += removed;
+	return removed;
+    };
+    uint64_t DiskUsage() const {
+	uint64_t total = 0;
+	for(auto& e : Entries()) total += e.bytes;
+	return total;
+    };
+    CacheStats Stats() const { return CacheStats{hits.load(), misses.load(), stores.load(), evictions.load()}; };
+private:
+    struct Entry {
+	string name;
+	uint64_t bytes;
+	int64_t used;
+    };
+    vector<Entry> Entries() const {
+	vector<Entry> entries;
+	DIR* d = opendir(dir.c_str());
+	if(d == nullptr) return entries;
+	while(auto ent = readdir(d)){
+	    string name = ent->d_name;
+	    struct stat st;
+	    if(name.size() < 4 || name.compare(name.size() - 4, 4, ".res") != 0) continue;
+	    if(stat((dir + "/" + name).c_str(), &st) != 0) continue;
+	    entries.push_back(Entry{name, (uint64_t)st.st_size, modificationTime(st)});
+	}
+	closedir(d);
+	return entries;
+    };
+    string EntryPath(CachedKind kind, uint64_t exprHash, const FileIdentity& file) const {
+	uint64_t key = mixHash(mixHash(mixHash(mixHash(kind, exprHash), file.size), file.mtime), file.checksum);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.res", (unsigned long long)key);
+	return dir + "/" + name;
+    };
+    static bool Matches(const CacheEntryHeader& h, CachedKind kind, uint64_t exprHash, const FileIdentity& file){
+	return memcmp(h.magic, "ERES", 4) == 0 && h.byteOrder == 0x01020304 && h.version == resultCacheVersion &&
+	    h.kind == (uint32_t)kind && h.exprHash == exprHash && h.file.size == file.size &&
+	    h.file.mtime == file.mtime && h.file.checksum == file.checksum;
+    };
+    static bool WriteAll(int fd, const void* buf, size_t n){
+	auto p = (const char*)buf;
+	while(n > 0){
+	    auto w = write(fd, p, n);
+	    if(w < 0 && errno == EINTR) continue;
+	    if(w <= 0) return false;
+	    p += w;
+	    n -= w;
+	}
+	return true;
+    };
+    string dir;
+    uint64_t maxBytes;
+    atomic<size_t> hits{0}, misses{0}, stores{0}, evictions{0};
+    atomic<uint64_t> tmpCounter{0};
+};
+
+inline CachedResult cachedBitmap(ResultCache& cache, const FileIdentity& file, const vector<ColumnChunk>& chunks,
+				 shared_ptr<Node> cut){
+    // selection of `cut` over the chunks read from `file`, evaluated only on a miss
+    auto hash = structuralHash(canonicalize(cut));
+    auto res = cache.Load(ckBitmap, hash, file);
+    if(res.Valid()) return res;
+    return cache.Store(hash, file, evaluateBitmap(chunks, cut));
+}
+
+inline CachedResult cachedColumn(ResultCache& cache, const FileIdentity& file, const vector<ColumnChunk>& chunks,
+				 shared_ptr<Node> obs){
+    // values of the observable `obs` over the chunks read from `file`
+    auto hash = structuralHash(canonicalize(obs));
+    auto res = cache.Load(ckColumn, hash, file);
+    if(res.Valid()) return res;
+    vector<double> values;
+    for(auto& chunk : chunks){
+	auto batch = evaluateBatch(chunk, obs);
+	if(batch.isBool) throw domain_error("Observable " + astToStr(obs) + " is not a numerical expression!");
+	values.insert(values.end(), batch.values.begin(), batch.values.end());
+    }
+    return cache.Store(hash, file, values);
+}
+
+#endif // EXPRESSION_RESULT_CACHE
+
+// Sharded multi-process evaluation
+//
+// `evaluateSharded` splits a dataset into shards and evaluates each one in its own
+// forked worker process, at most `nWorkers` at a time, so memory and non thread safe
+// readers are confined to a process per shard. The job's `load` runs in the worker and
+// reads the chunks of one shard. Workers stream their results back over a Unix domain
+// socket: a selection bitmap per cut, per chunk partial aggregates per observable and
+// filled histograms. The coordinator merges them in shard order, which makes the result
+// identical to evaluating all chunks in one process, independent of the number of
+// workers. A worker that crashes, exits without a complete result or is still running
+// after the job's `timeout` is killed and only has its shard retried; an exception
+// thrown while evaluating is reported and fails the whole job.
+// Forking copies only the calling thread, so no other thread of the coordinator may
+// hold a lock the workers need (e.g. of the symbol table) while the job runs.
+// Sharding needs POSIX and is only compiled with `EXPRESSION_SHARDING` defined.
+
+#ifdef EXPRESSION_SHARDING
+
+struct HistogramSpec {
+    Expression obs;
+    Binning binning;
+};
+
+struct ShardedJob {
+    size_t shards;
+    // called in the worker process, returns the chunks of a shard
+    function<vector<ColumnChunk>(size_t)> load;
+    vector<Expression> cuts;
+    vector<Expression> observables;
+    vector<HistogramSpec> histograms;
+    // optional cut applied to the aggregates and histograms
+    Expression filter;
+    // seconds a worker may take for its shard, 0 for no limit
+    double timeout = 0;
+};
+
+struct ShardedResult {
+    // selections over all events in shard order
+    vector<SelectionBitmap> selections;
+    vector<AggregateResult> aggregates;
+    vector<Histogram1D> histograms;
+    // number of shards that had to be evaluated again after a worker failed
+    size_t retries;
+};
+
+struct ShardOutput {
+    vector<SelectionBitmap> selections;
+    // partial aggregates per observable and chunk
+    vector<vector<PartialAggregate>> partials;
+    vector<Histogram1D> histograms;
+};
+
+static inline vector<uint8_t> evaluateShard(const ShardedJob& job, size_t shard){
+    auto chunks = job.load(shard);
+    vector<uint8_t> buf;
+    writeUInt(buf, chunks.size(), 8);
+    for(auto& cut : job.cuts){
+	auto b = evaluateBitmap(chunks, cut);
+	writeUInt(buf, b.size, 8);
+	for(auto w : b.words) writeUInt(buf, w, 8);
+    }
+    vector<Histogram1D> hists;
+    for(auto& spec : job.histograms) hists.push_back(Histogram1D(spec.binning));
+    vector<vector<PartialAggregate>> parts(job.observables.size(), vector<PartialAggregate>(chunks.size(), emptyAggregate()));
+    for(size_t c = 0; c < chunks.size(); c++){
+	BatchResult cutRes;
+	bool skip;
+	auto mask = cutMask(chunks[c], job.filter, cutRes, skip);
+	if(skip) continue;
+	// the same per chunk work as `aggregate` and `fillHistogram`
+	aggregateChunk(chunks[c], c, job.observables, mask, parts);
+	for(size_t h = 0; h < hists.size(); h++) fillHistogramChunk(hists[h], chunks[c], job.histograms[h].obs, mask);
+    }
+    for(auto& p : parts){
+	for(auto& a : p){
+	    writeUInt(buf, a.count, 8);
+	    for(double x : {a.sum, a.comp, a.min, a.max, a.mean, a.m2}) writeDouble(buf, x);
+	}
+    }
+    for(auto& h : hists){
+	for(double x : h.counts) writeDouble(buf, x);
+    }
+    return buf;
+}
+
+static inline ShardOutput readShardOutput(const ShardedJob& job, const uint8_t* data, size_t len){
+    ExpressionReader r(data, len);
+    ShardOutput out;
+    size_t nChunks = r.ReadUInt(8);
+    for(size_t i = 0; i < job.cuts.size(); i++){
+	SelectionBitmap b;
+	b.size = r.ReadUInt(8);
+	r.Require((b.size + 63) / 64 * 8);
+	for(size_t w = 0; w < (b.size + 63) / 64; w++) b.words.push_back(r.ReadUInt(8));
+	out.selections.push_back(move(b));
+    }
+    r.Require(job.observables.size() * nChunks * 56);
+    for(size_t e = 0; e < job.observables.size(); e++){
+	vector<PartialAggregate> p;
+	for(size_t c = 0; c < nChunks; c++){
+	    PartialAggregate a;
+	    a.count = r.ReadUInt(8);
+	    a.sum = r.ReadDouble();
+	    a.comp = r.ReadDouble();
+	    a.min = r.ReadDouble();
+	    a.max = r.ReadDouble();
+	    a.mean = r.ReadDouble();
+	    a.m2 = r.ReadDouble();
+	    p.push_back(a);
+	}
+	out.partials.push_back(move(p));
+    }
+    for(auto& spec : job.histograms){
+	Histogram1D h(spec.binning);
+	for(auto& x : h.counts) x = r.ReadDouble();
+	out.histograms.push_back(move(h));
+    }
+    if(r.pos != len) throw runtime_error("Shard result has trailing bytes!");
+    return out;
+}
+
+class ShardCoordinator {
+public:
+    ShardCoordinator(const ShardedJob& job, int nWorkers, int maxAttempts):
+	job(job), nWorkers(max(1, nWorkers)), maxAttempts(max(1, maxAttempts)),
+	outputs(job.shards), attempts(job.shards, 0), retries(0) {};
+    ~ShardCoordinator(){
+	// only left with running workers when failing
+	for(auto& w : running){
+	    kill(w.pid, SIGKILL);
+	    close(w.fd);
+	    waitpid(w.pid, nullptr, 0);
+	}
+    };
+    ShardedResult Run(){
+	for(size_t s = 0; s < job.shards; s++) pending.push_back(s);
+	while(!pending.empty() || !running.empty()){
+	    while(!pending.empty() && running.size() < (size_t)nWorkers){
+		Spawn(pending.front());
+		pending.pop_front();
+	    }
+	    Poll();
+	}
+	return Merge();
+    };
+private:
+    struct Worker {
+	pid_t pid;
+	int fd;
+	size_t shard;
+	vector<uint8_t> buf;
+	chrono::steady_clock::time_point deadline;
+    };
+    void Spawn(size_t shard){
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) throw runtime_error("Could not create worker socket!");
+	pid_t pid = fork();
+	if(pid < 0){
+	    close(sv[0]);
+	    close(sv[1]);
+	    throw runtime_error("Could not fork worker process!");
+	}
+	if(pid == 0){
+	    close(sv[0]);
+	    RunWorker(sv[1], shard);
+	}
+	close(sv[1]);
+	attempts[shard]++;
+	auto deadline = chrono::steady_clock::time_point::max();
+	if(job.timeout > 0){
+	    deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(job.timeout));
+	}
+	running.push_back(Worker{pid, sv[0], shard, {}, deadline});
+    };
+    [[noreturn]] void RunWorker(int fd, size_t shard){
+	// the child must never unwind into the coordinator's frames it was forked from.
+	// Failing to even report an error exits like a crash, so the shard is retried.
+	try{
+	    SendResult(fd, shard);
+	}
+	catch (...) {
+	    _exit(1);
+	}
+	// skips destructors and atexit handlers of the coordinator's state
+	_exit(0);
+    };
+    void SendResult(int fd, size_t shard){
+	// a result is framed as u8 status (0 ok, 1 error) | u64 length | payload, where
+	// the payload of an error is its message
+	vector<uint8_t> frame;
+	vector<uint8_t> payload;
+	uint8_t status = 0;
+	string msg;
+	try{
+	    payload = evaluateShard(job, shard);
+	}
+	catch (exception& e) {
+	    status = 1;
+	    msg = "Shard " + to_string(shard) + ": " + e.what();
+	}
+	catch (...) {
+	    status = 1;
+	    msg = "Shard " + to_string(shard) + ": unknown exception";
+	}
+	if(status == 1) payload.assign(msg.begin(), msg.end());
+	frame.push_back(status);
+	writeUInt(frame, payload.size(), 8);
+	frame.insert(frame.end(), payload.begin(), payload.end());
+	size_t pos = 0;
+	while(pos < frame.size()){
+	    auto w = write(fd, frame.data() + pos, frame.size() - pos);
+	    if(w < 0 && errno == EINTR) continue;
+	    if(w <= 0) _exit(1);
+	    pos += w;
+	}
+    };
+    void Poll(){
+	vector<pollfd> fds;
+	auto next = chrono::steady_clock::time_point::max();
+	for(auto& w : running){
+	    fds.push_back(pollfd{w.fd, POLLIN, 0});
+	    next = min(next, w.deadline);
+	}
+	// waits until the first deadline at most, rounded up to whole milliseconds
+	int wait = -1;
+	if(next != chrono::steady_clock::time_point::max()){
+	    auto left = chrono::duration_cast<chrono::microseconds>(next - chrono::steady_clock::now()).count();
+	    wait = (int)max((decltype(left))0, (left + 999) / 1000);
+	}
+	if(poll(fds.data(), fds.size(), wait) < 0){
+	    if(errno == EINTR) return;
+	    throw runtime_error("Could not poll worker sockets!");
+	}
+	auto now = chrono::steady_clock::now();
+	for(size_t i = running.size(); i-- > 0;){
+	    auto& w = running[i];
+	    if(fds[i].revents == 0){
+		if(now < w.deadline) continue;
+		// out of time, the shard is retried like after a crash
+		kill(w.pid, SIGKILL);
+	    } else {
+		uint8_t buf[65536];
+		auto n = read(w.fd, buf, sizeof(buf));
+		if(n < 0 && errno == EINTR) continue;
+		if(n > 0){
+		    w.buf.insert(w.buf.end(), buf, buf + n);
+		    continue;
+		}
+	    }
+	    // end of stream, the worker is done, died or was killed
+	    Worker done = move(w);
+	    running.erase(running.begin() + i);
+	    close(done.fd);
+	    int status = 0;
+	    waitpid(done.pid, &status, 0);
+	    Finish(done, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+    };
+    void Finish(const Worker& w, bool exited){
+	bool complete = w.buf.size() >= 9;
+	uint64_t len = 0;
+	if(complete){
+	    ExpressionReader r(w.buf.data() + 1, 8);
+	    len = r.ReadUInt(8);
+	    complete = len == w.buf.size() - 9;
+	}
+	if(exited && complete && w.buf[0] == 1){
+	    throw runtime_error(string((const char*)w.buf.data() + 9, len));
+	}
+	if(exited && complete){
+	    try{
+		outputs[w.shard] = readShardOutput(job, w.buf.data() + 9, len);
+		return;
+	    }
+	    catch (runtime_error&) {
+		// a malformed result is retried like a crash
+	    }
+	}
+	if(attempts[w.shard] >= maxAttempts){
+	    throw runtime_error("Shard " + to_string(w.shard) + " failed after " + to_string(attempts[w.shard]) + " attempts!");
+	}
+	retries++;
+	pending.push_front(w.shard);
+    };
+    ShardedResult Merge(){
+	ShardedResult res;
+	res.retries = retries;
+	res.selections.assign(job.cuts.size(), SelectionBitmap());
+	for(auto& spec : job.histograms) res.histograms.push_back(Histogram1D(spec.binning));
+	vector<vector<PartialAggregate>> parts(job.observables.size());
+	for(auto& out : outputs){
+	    for(size_t i = 0; i < out.selections.size(); i++) res.selections[i].Append(out.selections[i]);
+	    for(size_t e = 0; e < out.partials.size(); e++){
+		parts[e].insert(parts[e].end(), out.partials[e].begin(), out.partials[e].end());
+	    }
+	    for(size_t h = 0; h < out.histograms.size(); h++) res.histograms[h].Merge(out.histograms[h]);
+	}
+	// the same reduction tree over all chunks as `aggregate`
+	for(auto& p : parts) res.aggregates.push_back(toAggregateResult(reduceAggregates(p, 0, p.size())));
+	return res;
+    };
+    const ShardedJob& job;
+    int nWorkers;
+    int maxAttempts;
+    vector<ShardOutput> outputs;
+    vector<int> attempts;
+    size_t retries;
+    deque<size_t> pending;
+    vector<Worker> running;
+};
+
+inline ShardedResult evaluateSharded(const ShardedJob& job, int nWorkers, int maxAttempts = 3){
+    // evaluates `job` with up to `nWorkers` worker processes, trying each shard at most
+    // `maxAttempts` times
+    TRACE_SPAN("sharded evaluation");
+    ShardCoordinator coordinator(job, nWorkers, maxAttempts);
+    return coordinator.Run();
+}
+
+#endif // EXPRESSION_SHARDING
+
+// Pipelined evaluation
+//
+// A `Pipeline` overlaps reading, evaluating and consuming column batches. A reader
+// thread fills batches, `nEvaluators` threads run the compiled expressions on them and
+// the calling thread hands the results to the consumer. The stages are connected by
+// bounded lock-free ring buffers: `MpmcQueue` from the reader to the evaluators and
+// from the evaluators to the consumer, `SpscQueue` to return consumed batches to the
+// reader. Batches come from a fixed pool, so a full pipeline makes the reader wait
+// (backpressure) and, once the pool and the evaluators' programs are set up, moving
+// batches through the pipeline does not allocate. Whether reading allocates is up to
+// the reader, which gets back previously used chunks to refill in place. A stage
+// waiting on a queue spins briefly and then sleeps until another stage moves a batch,
+// so idle stages do not burn CPU; the whole wait counts as starved or blocked time.
+// `Metrics` can be called at any time, also while the pipeline runs.
+
+static const size_t queuePadding = 64;
+
+static inline size_t ceilPowerOfTwo(size_t n){
+    size_t p = 1;
+    while(p < n) p <<= 1;
+    return p;
+}
+
+template <class T>
+class SpscQueue {
+public:
+    // single producer, single consumer ring of at least `capacity` slots
+    explicit SpscQueue(size_t capacity): slots(ceilPowerOfTwo(max(capacity, (size_t)2))), mask(slots.size() - 1) {};
+    bool TryPush(const T& x){
+	auto t = tail.load(memory_order_relaxed);
+	if(t - head.load(memory_order_acquire) == slots.size()) return false;
+	slots[t & mask] = x;
+	tail.store(t + 1, memory_order_release);
+	return true;
+    };
+    bool TryPop(T& x){
+	auto h = head.load(memory_order_relaxed);
+	if(h == tail.load(memory_order_acquire)) return false;
+	x = slots[h & mask];
+	head.store(h + 1, memory_order_release);
+	return true;
+    };
+    size_t Size() const { return tail.load(memory_order_acquire) - head.load(memory_order_acquire); };
+    size_t Capacity() const { return slots.size(); };
+private:
+    vector<T> slots;
+    size_t mask;
+    // producer and consumer indices on separate cache lines
+    char pad0[queuePadding];
+    atomic<size_t> head{0};
+    char pad1[queuePadding - sizeof(atomic<size_t>)];
+    atomic<size_t> tail{0};
+    char pad2[queuePadding - sizeof(atomic<size_t>)];
+};
+
+template <class T>
+class MpmcQueue {
+public:
+    // multi producer, multi consumer ring (Vyukov). Each cell carries a sequence number
+    // telling whether it is free for the push or filled for the pop at a position.
+    explicit MpmcQueue(size_t capacity):
+	size(ceilPowerOfTwo(max(capacity, (size_t)2))), mask(size - 1), cells(new Cell[size]) {
+	for(size_t i = 0; i < size; i++) cells[i].seq.store(i, memory_order_relaxed);
+    };
+    bool TryPush(const T& x){
+	auto pos = tail.load(memory_order_relaxed);
+	Cell* cell;
+	while(true){
+	    cell = &cells[pos & mask];
+	    auto seq = cell->seq.load(memory_order_acquire);
+	    auto diff = (intptr_t)seq - (intptr_t)pos;
+	    if(diff == 0){
+		if(tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+	    }
+	    else if(diff < 0) return false;
+	    else pos = tail.load(memory_order_relaxed);
+	}
+	cell->data = x;
+	cell->seq.store(pos + 1, memory_order_release);
+	return true;
+    };
+    bool TryPop(T& x){
+	auto pos = head.load(memory_order_relaxed);
+	Cell* cell;
+	while(true){
+	    cell = &cells[pos & mask];
+	    auto seq = cell->seq.load(memory_order_acquire);
+	    auto diff = (intptr_t)seq - (intptr_t)(pos + 1);
+	    if(diff == 0){
+		if(head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+	    }
+	    else if(diff < 0) return false;
+	    else pos = head.load(memory_order_relaxed);
+	}
+	x = cell->data;
+	cell->seq.store(pos + mask + 1, memory_order_release);
+	return true;
+    };
+    size_t Size() const {
+	// approximate while other threads push or pop
+	auto t = tail.load(memory_order_acquire);
+	auto h = head.load(memory_order_acquire);
+	return t > h ? t - h : 0;
+    };
+    size_t Capacity() const { return size; };
+private:
+    struct Cell {
+	atomic<size_t> seq;
+	T data;
+    };
+    size_t size;
+    size_t mask;
+    unique_ptr<Cell[]> cells;
+    char pad0[queuePadding];
+    atomic<size_t> head{0};
+    char pad1[queuePadding - sizeof(atomic<size_t>)];
+    atomic<size_t> tail{0};
+    char pad2[queuePadding - sizeof(atomic<size_t>)];
+};
+
+struct PipelineBatch {
+    // position of the batch in the input, the consumer may see batches out of order
+    uint64_t sequence;
+    ColumnChunk chunk;
+    // per expression `capacity` values of which the first `chunk.size` are valid,
+    // booleans as 0 and 1
+    vector<vector<double>> results;
+};
+
+struct StageMetrics {
+    string name;
+    size_t batches;
+    // time spent working, waiting for input and waiting for room in the next queue
+    double busySeconds;
+    double starvedSeconds;
+    double blockedSeconds;
+};
+
+struct QueueMetrics {
+    string name;
+    size_t capacity;
+    size_t depth;
+    size_t maxDepth;
+};
+
+struct PipelineMetrics {
+    vector<StageMetrics> stages;
+    vector<QueueMetrics> queues;
+};
+
+class Pipeline {
+public:
+    Pipeline(const vector<Expression>& exprs, size_t capacity, int nEvaluators = 2, size_t queueDepth = 8):
+	capacity(capacity), nEvaluators(max(1, nEvaluators)),
+	// enough batches to keep both queues and all evaluators busy
+	pool(2 * queueDepth + this->nEvaluators + 1),
+	recycled(pool.size()), input(queueDepth), output(queueDepth) {
+	for(auto& e : exprs){
+	    compiled.push_back(compileExpression(foldConstants(e)));
+	    isBool.push_back(compiled.back().isBool);
+	}
+	for(auto& b : pool) b.results.assign(exprs.size(), vector<double>(capacity));
+	stages[0].name = "read";
+	stages[1].name = "evaluate";
+	stages[2].name = "consume";
+    };
+    void Run(function<bool(ColumnChunk&)> read, function<void(const PipelineBatch&)> consume){
+	// `read` fills the chunk of a batch with at most `capacity` events and returns false
+	// once the input is exhausted. It runs on its own thread, `consume` on the calling one.
+	TRACE_SPAN("pipeline");
+	stop = false;
+	ready = 0;
+	error = nullptr;
+	for(auto& b : pool) recycled.TryPush(&b);
+	vector<thread> threads;
+	threads.push_back(thread([&](){ Guard([&](){ ReadStage(read); }); }));
+	for(int i = 0; i < nEvaluators; i++) threads.push_back(thread([&](){ Guard([&](){ EvaluateStage(); }); }));
+	Guard([&](){ ConsumeStage(consume); });
+	for(auto& t : threads) t.join();
+	// drain what is left after a failure
+	PipelineBatch* b;
+	while(input.TryPop(b)) {}
+	while(output.TryPop(b)) {}
+	while(recycled.TryPop(b)) {}
+	if(error) rethrow_exception(error);
+    };
+    PipelineMetrics Metrics() const {
+	PipelineMetrics m;
+	for(auto& s : stages){
+	    m.stages.push_back(StageMetrics{s.name, s.batches.load(), s.busy.load() * 1e-9, s.starved.load() * 1e-9,
+		                            s.blocked.load() * 1e-9});
+	}
+	m.queues.push_back(QueueMetrics{"input", input.Capacity(), input.Size(), maxDepth[0].load()});
+	m.queues.push_back(QueueMetrics{"output", output.Capacity(), output.Size(), maxDepth[1].load()});
+	m.queues.push_back(QueueMetrics{"recycled", recycled.Capacity(), recycled.Size(), maxDepth[2].load()});
+	return m;
+    };
+    size_t capacity;
+    int nEvaluators;
+    vector<CompiledExpression> compiled;
+    vector<bool> isBool;
+private:
+    struct StageCounters {
+	string name;
+	// times in nanoseconds
+	atomic<size_t> batches{0};
+	atomic<uint64_t> busy{0};
+	atomic<uint64_t> starved{0};
+	atomic<uint64_t> blocked{0};
+    };
+    static uint64_t Now(){
+	return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    };
+    template <class F>
+    void Guard(F f){
+	try{
+	    f();
+	}
+	catch (...) {
+	    {
+		lock_guard<mutex> lock(errorMutex);
+		if(!error) error = current_exception();
+		stop = true;
+	    }
+	    Wake();
+	}
+    };
+    template <class F>
+    bool Wait(F tryOnce, atomic<uint64_t>& stalled){
+	// retries `tryOnce` until it succeeds, spinning first, then yielding and finally
+	// parked until another stage makes progress. Returns false if the pipeline is
+	// stopped meanwhile.
+	if(tryOnce()){
+	    Wake();
+	    return true;
+	}
+	auto start = Now();
+	bool done = false;
+	for(int spins = 0; !done && !stop; spins++){
+	    if(spins < 128){
+		if(spins >= 64) this_thread::yield();
+		done = tryOnce();
+		continue;
+	    }
+	    unique_lock<mutex> lock(parkMutex);
+	    waiters++;
+	    done = tryOnce();
+	    // the timeout only bounds the cost of a missed wake up
+	    if(!done && !stop) parked.wait_for(lock, chrono::milliseconds(1));
+	    waiters--;
+	}
+	stalled += Now() - start;
+	if(done) Wake();
+	return done;
+    };
+    void Wake(){
+	// called after every successful push or pop, the lock is only taken while another
+	// stage is parked. The read-modify-write orders the check after the queue update.
+	if(waiters.fetch_add(0) > 0){
+	    lock_guard<mutex> lock(parkMutex);
+	    parked.notify_all();
+	}
+    };
+    template <class Q>
+    void Push(Q& q, PipelineBatch* b, atomic<size_t>& depth, atomic<uint64_t>& blocked){
+	if(!Wait([&](){ return q.TryPush(b); }, blocked)) return;
+	auto d = q.Size();
+	auto m = depth.load(memory_order_relaxed);
+	while(d > m && !depth.compare_exchange_weak(m, d)) {}
+    };
+    void ReadStage(const function<bool(ColumnChunk&)>& read){
+	auto& s = stages[0];
+	uint64_t sequence = 0;
+	// all allocations of the evaluators happen before the first batch
+	Wait([&](){ return ready.load() == nEvaluators; }, s.starved);
+	while(!stop){
+	    PipelineBatch* b;
+	    if(!Wait([&](){ return recycled.TryPop(b); }, s.starved)) break;
+	    auto start = Now();
+	    bool more;
+	    {
+		TRACE_SPAN("read batch");
+		more = read(b->chunk);
+	    }
+	    s.busy += Now() - start;
+	    // the unused batch is returned to the pool by the next `Run`
+	    if(!more) break;
+	    if(b->chunk.size > capacity){
+		throw length_error("Batch of " + to_string(b->chunk.size) + " events exceeds the capacity of " + to_string(capacity));
+	    }
+	    b->sequence = sequence++;
+	    s.batches++;
+	    Push(input, b, maxDepth[0], s.blocked);
+	}
+	// one end marker per evaluator
+	for(int i = 0; i < nEvaluators; i++) Push(input, nullptr, maxDepth[0], s.blocked);
+    };
+    void EvaluateStage(){
+	auto& s = stages[1];
+	vector<BatchProgram> programs;
+	{
+	    // also registers the thread's trace buffer before the first batch
+	    TRACE_SPAN("evaluator setup");
+	    for(auto& ce : compiled) programs.push_back(BatchProgram(ce, capacity));
+	}
+	ready++;
+	Wake();
+	while(!stop){
+	    PipelineBatch* b;
+	    if(!Wait([&](){ return input.TryPop(b); }, s.starved)) break;
+	    if(b == nullptr) break;
+	    auto start = Now();
+	    {
+		TRACE_SPAN("evaluate batch");
+		for(size_t e = 0; e < programs.size(); e++){
+		    auto res = programs[e].Run(b->chunk);
+		    copy(res, res + b->chunk.size, b->results[e].data());
+		}
+	    }
+	    s.busy += Now() - start;
+	    s.batches++;
+	    Push(output, b, maxDepth[1], s.blocked);
+	}
+	Push(output, nullptr, maxDepth[1], s.blocked);
+    };
+    void ConsumeStage(const function<void(const PipelineBatch&)>& consume){
+	auto& s = stages[2];
+	int finished = 0;
+	while(finished < nEvaluators && !stop){
+	    PipelineBatch* b;
+	    if(!Wait([&](){ return output.TryPop(b); }, s.starved)) break;
+	    if(b == nullptr){
+		finished++;
+		continue;
+	    }
+	    auto start = Now();
+	    {
+		TRACE_SPAN("consume batch");
+		consume(*b);
+	    }
+	    s.busy += Now() - start;
+	    s.batches++;
+	    Push(recycled, b, maxDepth[2], s.blocked);
+	}
+    };
+    vector<PipelineBatch> pool;
+    SpscQueue<PipelineBatch*> recycled;
+    MpmcQueue<PipelineBatch*> input;
+    MpmcQueue<PipelineBatch*> output;
+    StageCounters stages[3];
+    atomic<size_t> maxDepth[3] = {{0}, {0}, {0}};
+    atomic<bool> stop{false};
+    // number of evaluators done with their setup
+    atomic<int> ready{0};
+    exception_ptr error;
+    mutex errorMutex;
+    // stages with nothing to do sleep here
+    mutex parkMutex;
+    condition_variable parked;
+    atomic<int> waiters{0};
+};
+
+// NUMA aware evaluation
+//
+// `NumaTopology::Detect` reads the nodes, their CPUs and the distances between them from
+// sysfs, falling back to a single node with all CPUs. `placeChunks` loads every chunk
+// on a thread pinned to the node that will evaluate it, so its columns are first
+// touched, and thereby allocated, in that node's memory. `numaFor` then runs workers
+// pinned to each node. They take chunks from their own node's queue first and steal
+// from other nodes, nearest first, only once it is empty. Pinning is best effort: if
+// the affinity cannot be set the worker runs unpinned. With `localFirst` false the
+// topology is ignored and all chunks go through one shared queue, for comparison.
+// Outside of Linux there is no sysfs and no affinity: the topology is a single node and
+// workers are never pinned.
+
+struct NumaNode {
+    int id;
+    vector<int> cpus;
+    // distances to the nodes by node id as in sysfs, 10 being the node itself
+    vector<int> distances;
+};
+
+static inline vector<int> parseCpuList(const string& s){
+    // parses lists like "0-3,8,10-11"
+    vector<int> cpus;
+    size_t pos = 0;
+    while(pos < s.size()){
+	size_t end = s.find(',', pos);
+	if(end == string::npos) end = s.size();
+	string range = s.substr(pos, end - pos);
+	range.erase(remove_if(range.begin(), range.end(), ::isspace), range.end());
+	if(!range.empty()){
+	    auto dash = range.find('-');
+	    int lo = stoi(range.substr(0, dash));
+	    int hi = dash == string::npos ? lo : stoi(range.substr(dash + 1));
+	    for(int c = lo; c <= hi; c++) cpus.push_back(c);
+	}
+	pos = end + 1;
+    }
+    return cpus;
+}
+
+static inline string readSmallFile(const string& path){
+    ifstream f(path);
+    return string(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+}
+
+class NumaTopology {
+public:
+    static NumaTopology Detect(const string& root = "/sys/devices/system/node"){
+	NumaTopology t;
+	vector<int> ids;
+#ifdef __linux__
+	if(DIR* d = opendir(root.c_str())){
+	    while(auto ent = readdir(d)){
+		int id;
+		char rest;
+		if(sscanf(ent->d_name, "node%d%c", &id, &rest) == 1) ids.push_back(id);
+	    }
+	    closedir(d);
+	}
+#endif
+	sort(ids.begin(), ids.end());
+	for(int id : ids){
+	    string dir = root + "/node" + to_string(id);
+	    NumaNode node{id, parseCpuList(readSmallFile(dir + "/cpulist")), {}};
+	    // nodes with memory only get no workers
+	    if(node.cpus.empty()) continue;
+	    istringstream dist(readSmallFile(dir + "/distance"));
+	    for(int x; dist >> x;) node.distances.push_back(x);
+	    t.nodes.push_back(node);
+	}
+	if(t.nodes.empty()){
+	    NumaNode node{0, {}, {10}};
+	    for(int c = 0; c < (int)max(1u, thread::hardware_concurrency()); c++) node.cpus.push_back(c);
+	    t.nodes.push_back(node);
+	}
+	return t;
+    };
+    int Distance(size_t from, size_t to) const {
+	// distance between the nodes with index `from` and `to` in `nodes`
+	auto& d = nodes[from].distances;
+	size_t id = nodes[to].id;
+	if(id < d.size()) return d[id];
+	return from == to ? 10 : 20;
+    };
+    size_t CpuCount() const {
+	size_t n = 0;
+	for(auto& node : nodes) n += node.cpus.size();
+	return n;
+    };
+    vector<NumaNode> nodes;
+};
+
+inline bool pinThread(const vector<int>& cpus){
+    // restricts the calling thread to `cpus`, returns false if that is not possible
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int c : cpus){
+	if(c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+struct NumaOptions {
+    bool pin = true;
+    bool localFirst = true;
+    // workers per node, 0 for one per CPU of the node
+    int threadsPerNode = 0;
+};
+
+struct NumaRunStats {
+    // chunks evaluated on their own node and stolen by workers of another node, only
+    // counted with `localFirst`
+    size_t local;
+    size_t stolen;
+    // workers whose affinity could be set
+    size_t pinned;
+};
+
+struct NumaChunks {
+    vector<ColumnChunk> chunks;
+    // index into `NumaTopology::nodes` of the node holding each chunk
+    vector<int> nodes;
+};
+
+static inline vector<int> assignNodes(const NumaTopology& topo, size_t nChunks){
+    // contiguous blocks of chunks per node, sized by the node's number of CPUs
+    vector<int> nodes(nChunks);
+    size_t cpus = topo.CpuCount();
+    size_t begin = 0;
+    size_t cum = 0;
+    for(size_t i = 0; i < topo.nodes.size(); i++){
+	cum += topo.nodes[i].cpus.size();
+	size_t end = nChunks * cum / cpus;
+	for(size_t c = begin; c < end; c++) nodes[c] = (int)i;
+	begin = end;
+    }
+    return nodes;
+}
+
+static inline NumaRunStats runNodeQueues(const NumaTopology& topo, const vector<int>& nodes, const NumaOptions& opts,
+					 bool steal, const function<void(size_t)>& f){
+    // runs `f` for every chunk on workers of the chunk's node, the core of `numaFor`
+    // and `placeChunks`
+    const size_t nNodes = topo.nodes.size();
+    vector<vector<size_t>> queues(nNodes);
+    for(size_t c = 0; c < nodes.size(); c++) queues[nodes[c]].push_back(c);
+    unique_ptr<atomic<size_t>[]> next(new atomic<size_t>[nNodes]);
+    for(size_t i = 0; i < nNodes; i++) next[i] = 0;
+    atomic<size_t> local(0), stolen(0), pinned(0);
+    exception_ptr error;
+    mutex errorMutex;
+    vector<thread> threads;
+    for(size_t node = 0; node < nNodes; node++){
+	if(queues[node].empty() && !steal) continue;
+	// other nodes nearest first
+	vector<size_t> order;
+	for(size_t i = 0; i < nNodes; i++) order.push_back(i);
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+	    return (a != node) < (b != node) || ((a != node) == (b != node) && topo.Distance(node, a) < topo.Distance(node, b));
+	});
+	if(!steal) order.resize(1);
+	int nThreads = opts.threadsPerNode > 0 ? opts.threadsPerNode : (int)topo.nodes[node].cpus.size();
+	for(int t = 0; t < nThreads; t++){
+	    threads.push_back(thread([&, node, order](){
+		if(opts.pin && pinThread(topo.nodes[node].cpus)) pinned++;
+		try{
+		    for(size_t q : order){
+			for(size_t i = next[q]++; i < queues[q].size(); i = next[q]++){
+			    f(queues[q][i]);
+			    (q == node ? local : stolen)++;
+			}
+		    }
+		}
+		catch (...) {
+		    lock_guard<mutex> lock(errorMutex);
+		    if(!error) error = current_exception();
+		    for(size_t i = 0; i < nNodes; i++) next[i] = queues[i].size();
+		}
+	    }));
+	}
+    }
+    for(auto& th : threads) th.join();
+    if(error) rethrow_exception(error);
+    return NumaRunStats{local.load(), stolen.load(), pinned.load()};
+}
+
+inline NumaChunks placeChunks(const NumaTopology& topo, size_t nChunks, const function<ColumnChunk(size_t)>& load,
+			      const NumaOptions& opts = NumaOptions()){
+    // calls `load(c)` for every chunk on a worker of the node it is assigned to
+    NumaChunks res;
+    res.chunks.resize(nChunks);
+    res.nodes = assignNodes(topo, nChunks);
+    runNodeQueues(topo, res.nodes, opts, false, [&](size_t c){
+	TRACE_SPAN("place chunk");
+	res.chunks[c] = load(c);
+    });
+    return res;
+}
+
+inline NumaRunStats numaFor(const NumaTopology& topo, const NumaChunks& chunks, const NumaOptions& opts,
+			    const function<void(size_t)>& f){
+    // calls `f(c)` for every chunk, preferring workers on the chunk's node
+    if(!opts.localFirst){
+	parallelFor(chunks.chunks.size(), (int)topo.CpuCount(), f);
+	return NumaRunStats{0, 0, 0};
+    }
+    return runNodeQueues(topo, chunks.nodes, opts, true, f);
+}
+
+inline vector<BatchResult> evaluateChunks(const NumaTopology& topo, const NumaChunks& chunks, shared_ptr<Node> n,
+					  const NumaOptions& opts = NumaOptions(), NumaRunStats* stats = nullptr){
+    // like `evaluateChunks` over a vector, with the chunks evaluated on their nodes
+    vector<BatchResult> results(chunks.chunks.size());
+    auto st = numaFor(topo, chunks, opts, [&](size_t c){
+	ChunkDecision decision;
+	results[c] = evaluateZoned(chunks.chunks[c], n, decision);
+    });
+    if(stats != nullptr) *stats = st;
+    return results;
+}
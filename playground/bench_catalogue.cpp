@@ -0,0 +1,28 @@
+#include "../expression_eval.h"
+#include <chrono>
+
+// startup time of compiling a catalogue of cuts, serially and on all cores
+
+vector<string> makeCatalogue(size_t n){
+    vector<string> cuts;
+    for(size_t i = 0; i < n; i++){
+        cuts.push_back("var" + to_string(i % 300) + " > " + to_string(i % 97) + " * 2 + 1 && var" +
+                       to_string((i * 7) % 300) + " < 0.5 || peakTimes[" + to_string(i % 4) + "] >= 1.5");
+    }
+    return cuts;
+}
+
+double timeIt(const vector<string>& cuts, int nThreads){
+    auto start = chrono::steady_clock::now();
+    auto entries = compileCatalogue(cuts, nThreads);
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    int nThreads = max(1u, thread::hardware_concurrency());
+    cout << "size\tserial [ms]\t" << nThreads << " threads [ms]" << endl;
+    for(size_t n : {1000, 5000, 10000, 20000, 40000}){
+        auto cuts = makeCatalogue(n);
+        cout << n << "\t" << timeIt(cuts, 1) << "\t" << timeIt(cuts, nThreads) << endl;
+    }
+}
@@ -0,0 +1,47 @@
+#include "../expression_eval.h"
+#include <chrono>
+
+// evaluation time with NUMA aware placement and scheduling against chunks loaded on one
+// thread and evaluated by unpinned threads from a shared queue
+
+const size_t chunkSize = 1 << 16;
+
+ColumnChunk makeChunk(size_t c){
+    ColumnChunk chunk;
+    vector<float> energy(chunkSize), sigma(chunkSize);
+    for(size_t i = 0; i < chunkSize; i++){
+        energy[i] = (float)(((c * chunkSize + i) * 2654435761u) % 10000);
+        sigma[i] = (float)((c + i) % 100) / 100;
+    }
+    chunk.AddColumn("energy", move(energy));
+    chunk.AddColumn("sigma", move(sigma));
+    return chunk;
+}
+
+double timeIt(const NumaTopology& topo, const NumaChunks& chunks, shared_ptr<Node> cut, const NumaOptions& opts){
+    // best of five runs
+    double best = numeric_limits<double>::infinity();
+    for(int i = 0; i < 5; i++){
+        auto start = chrono::steady_clock::now();
+        evaluateChunks(topo, chunks, cut, opts);
+        best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main() {
+    auto topo = NumaTopology::Detect();
+    cout << topo.nodes.size() << " nodes, " << topo.CpuCount() << " cpus" << endl;
+    auto cut = parseExpression("energy > 5000 + 100 && sigma < 0.5 || energy * sigma > 4000");
+    cout << "chunks\toblivious [ms]\tnuma aware [ms]" << endl;
+    for(size_t n : {64, 256, 1024}){
+        NumaChunks oblivious;
+        for(size_t c = 0; c < n; c++) oblivious.chunks.push_back(makeChunk(c));
+        oblivious.nodes = assignNodes(topo, n);
+        NumaOptions off;
+        off.pin = false;
+        off.localFirst = false;
+        auto placed = placeChunks(topo, n, makeChunk);
+        cout << n << "\t" << timeIt(topo, oblivious, cut, off) << "\t" << timeIt(topo, placed, cut, NumaOptions()) << endl;
+    }
+}
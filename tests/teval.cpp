@@ -1,8 +1,39 @@
+// the tests run without span tracing, ttracing.cpp covers EXPRESSION_TRACING
+// the POSIX only parts, see `resultCache` and `sharded`
+#define EXPRESSION_RESULT_CACHE
+#define EXPRESSION_SHARDING
 #include "../expression_eval.h"
 #include <cassert>
+#include <cstdlib>
+#include <new>
 
 using namespace std;
 
+// every heap allocation of the test program is counted, see `allocationFree`
+atomic<size_t> allocations(0);
+
+// the replaced operators only call these out of line helpers. If the compiler could see
+// `malloc` / `free` inside them, it would warn about `free` on memory from `new`.
+__attribute__((noinline)) void* countedAlloc(size_t n){
+    allocations++;
+    if(void* p = malloc(n > 0 ? n : 1)) return p;
+    throw bad_alloc();
+}
+__attribute__((noinline)) void countedFree(void* p){
+    free(p);
+}
+
+void* operator new(size_t n){ return countedAlloc(n); }
+void* operator new[](size_t n){ return countedAlloc(n); }
+void* operator new(size_t n, const nothrow_t&) noexcept {
+    try{ return countedAlloc(n); } catch (bad_alloc&) { return nullptr; }
+}
+void* operator new[](size_t n, const nothrow_t& t) noexcept { return operator new(n, t); }
+void operator delete(void* p) noexcept { countedFree(p); }
+void operator delete[](void* p) noexcept { countedFree(p); }
+void operator delete(void* p, size_t) noexcept { countedFree(p); }
+void operator delete[](void* p, size_t) noexcept { countedFree(p); }
+
 std::map<std::string, float> m = { {"hitsAna_energy", 6000}, {"hitsAna_xy2Sigma", 0.2} };
 
 map<string, map<int, float>> maps = { {"peakTimes", { {0, 1.5}, {1, 2.5}, {2, 3.5} } } };
@@ -140,6 +171,1255 @@ void invalid(){
     // failToParse("7 < 5 < 3");
 }
 
+void intervals(){
+    auto bounds = deriveBounds(parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5"));
+    assert(bounds.size() == 2);
+    auto energy = bounds["hitsAna_energy"];
+    assert(energy.size() == 1);
+    assert(energy[0].lo == 5100.0 && energy[0].loOpen);
+    assert(std::isinf(energy[0].hi));
+    auto sigma = bounds["hitsAna_xy2Sigma"];
+    assert(sigma.size() == 1 && sigma[0].hi == 0.5 && sigma[0].hiOpen);
+
+    // union of intervals, mirrored comparisons and negation
+    auto x = deriveBounds(parseExpression("x < 1 or 5 <= x"))["x"];
+    assert(x.size() == 2 && x[0].hi == 1.0 && x[1].lo == 5.0 && !x[1].loOpen);
+    // NOTE: the parser does not handle unary `!` yet, so build the node by hand
+    auto y = deriveBounds(unaryNode(uoNot, parseExpression("y >= 3")))["y"];
+    assert(y.size() == 1 && y[0].hi == 3.0 && y[0].hiOpen);
+    // variable only constrained on one side of an `or` is unconstrained
+    assert(deriveBounds(parseExpression("a > 1 || b > 2")).size() == 0);
+    assert(deriveBounds(parseExpression("peakTimes[1] > 2"))["peakTimes[1]"].size() == 1);
+
+    auto cut = parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5");
+    assert(canBeTrue(cut, { {"hitsAna_energy", Interval{0, 6000, false, false}} }));
+    assert(!canBeTrue(cut, { {"hitsAna_energy", Interval{0, 5100, false, false}} }));
+    assert(!canBeTrue(cut, { {"hitsAna_xy2Sigma", Interval{0.5, 1, false, false}} }));
+    assert(mustBeTrue(cut, { {"hitsAna_energy", Interval{5200, 6000, false, false}},
+                             {"hitsAna_xy2Sigma", Interval{0, 0.4, false, false}} }));
+    assert(!mustBeTrue(cut, { {"hitsAna_energy", Interval{5200, 6000, false, false}} }));
+    // contradictions are found even without any ranges
+    assert(!canBeTrue(parseExpression("x > 5 && x < 3"), {}));
+    // arithmetic on variables uses interval arithmetic
+    assert(!canBeTrue(parseExpression("a * 2 + b > 10"), { {"a", Interval{0, 2, false, false}},
+                                                             {"b", Interval{0, 1, false, false}} }));
+}
+
+void batches(){
+    ColumnChunk chunk;
+    chunk.AddColumn("hitsAna_energy", {6000, 4000, 5200, 7000});
+    chunk.AddColumn("hitsAna_xy2Sigma", {0.2, 0.1, 0.7, 0.4});
+    chunk.AddColumn("peakTimes[0]", {1.5, 2.5, 1.5, 0.5});
+    auto res = evaluateBatch(chunk, parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5"));
+    assert(res.isBool);
+    assert((res.mask == vector<uint8_t>{1, 0, 0, 1}));
+    res = evaluateBatch(chunk, parseExpression("peakTimes[0] * 2"));
+    assert(!res.isBool);
+    assert((res.values == vector<double>{3.0, 5.0, 3.0, 1.0}));
+
+    // zone maps: chunks sorted by run number
+    vector<ColumnChunk> chunks(3);
+    chunks[0].AddColumn("run", {1, 2, 3});
+    chunks[1].AddColumn("run", {4, 5, 6});
+    chunks[2].AddColumn("run", {7, 8, 9});
+    ZoneMapStats st;
+    auto results = evaluateChunks(chunks, parseExpression("run >= 4 && run <= 9"), &st);
+    assert(st.skipped == 1 && st.accepted == 2 && st.evaluated == 0);
+    assert((results[0].mask == vector<uint8_t>{0, 0, 0}));
+    assert((results[1].mask == vector<uint8_t>{1, 1, 1}));
+    results = evaluateChunks(chunks, parseExpression("run > 5"), &st);
+    assert(st.skipped == 1 && st.accepted == 1 && st.evaluated == 1);
+    assert((results[1].mask == vector<uint8_t>{0, 0, 1}));
+    // nulls prevent skipping
+    chunks[0].AddColumn("run", {1, NAN, 3});
+    evaluateChunks(chunks, parseExpression("run > 5"), &st);
+    assert(st.skipped == 0 && st.evaluated == 2);
+}
+
+void serialization(){
+    map<string, Expression> cuts = {
+        {"energy", parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5")},
+        {"peaks", parseExpression("peakTimes[1] * 2 - 4")}
+    };
+    auto buf = serializeExpressions(cuts);
+    auto loaded = deserializeExpressions(buf.data(), buf.size());
+    assert(loaded.size() == 2);
+    for(auto& kv : cuts){
+        assert(astToStr(loaded[kv.first]) == astToStr(kv.second));
+    }
+    assert(evaluate(m, maps, loaded["energy"]).getRight());
+    assert(evaluate(m, maps, loaded["peaks"]).getLeft() == 1.0);
+
+    // corrupt payload and stale versions are rejected
+    auto corrupt = buf;
+    corrupt.back() ^= 1;
+    bool failed = false;
+    try{ deserializeExpressions(corrupt.data(), corrupt.size()); } catch (runtime_error&){ failed = true; }
+    assert(failed);
+    auto stale = buf;
+    stale[4] = 0;
+    failed = false;
+    try{ deserializeExpressions(stale.data(), stale.size()); } catch (runtime_error&){ failed = true; }
+    assert(failed);
+    failed = false;
+    try{ deserializeExpressions(buf.data(), buf.size() - 3); } catch (runtime_error&){ failed = true; }
+    assert(failed);
+}
+
+template <class E>
+void testStatic(E expr){
+    // compile time expressions have to agree with the runtime engine
+    auto vals = gatherVariables(expr.variables(), m, maps);
+    auto res = expr.evaluate(vals);
+    auto exp = runIt(expr.source());
+    assert(res.isLeft() == exp.isLeft());
+    if(res.isLeft()){
+        assert(res.unsafeGetLeft() == exp.unsafeGetLeft());
+    }
+    else{
+        assert(res.unsafeGetRight() == exp.unsafeGetRight());
+    }
+}
+
+void staticExpressions(){
+    testStatic(STATIC_EXPRESSION("5"));
+    testStatic(STATIC_EXPRESSION("5 + 2"));
+    testStatic(STATIC_EXPRESSION("5 < 10"));
+    testStatic(STATIC_EXPRESSION("5 > 10"));
+    testStatic(STATIC_EXPRESSION("5 <= 10"));
+    testStatic(STATIC_EXPRESSION("5 >= 10"));
+    testStatic(STATIC_EXPRESSION("5 == 5"));
+    testStatic(STATIC_EXPRESSION("5 != 10"));
+    testStatic(STATIC_EXPRESSION("5 == 10"));
+    testStatic(STATIC_EXPRESSION("10 != 10"));
+    testStatic(STATIC_EXPRESSION("5 * 2"));
+    testStatic(STATIC_EXPRESSION("10 / 2"));
+    testStatic(STATIC_EXPRESSION("10 - 5"));
+    testStatic(STATIC_EXPRESSION("5 + 10 / 2"));
+    testStatic(STATIC_EXPRESSION("5 + 5 * 2"));
+    testStatic(STATIC_EXPRESSION("2 * 2 + 4 * 4"));
+    testStatic(STATIC_EXPRESSION("(5 + 10) / 2"));
+    testStatic(STATIC_EXPRESSION("(10 - 3) / (1 * 7)"));
+    testStatic(STATIC_EXPRESSION("(5 * (5 / (10 - 5)) + 10) - 15"));
+    testStatic(STATIC_EXPRESSION("5 + 2 < 7"));
+    testStatic(STATIC_EXPRESSION("5 + 2 <= 7"));
+    testStatic(STATIC_EXPRESSION("5 + 2 > 7"));
+    testStatic(STATIC_EXPRESSION("5 + 2 >= 7"));
+    testStatic(STATIC_EXPRESSION("5 + 2 == 7"));
+    testStatic(STATIC_EXPRESSION("5 + 2 != 7"));
+    testStatic(STATIC_EXPRESSION("7 < 5 + 2"));
+    testStatic(STATIC_EXPRESSION("7 <= 5 + 2"));
+    testStatic(STATIC_EXPRESSION("7 > 5 + 2"));
+    testStatic(STATIC_EXPRESSION("7 >= 5 + 2"));
+    testStatic(STATIC_EXPRESSION("5 + 2 < 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 <= 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 > 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 >= 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 == 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 != 7 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 < 5 + 2 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 <= 5 + 2 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 > 5 + 2 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 >= 5 + 2 && 4 < 8"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 && 1000 == 1000 && 6.4 >= 1.1 && 1234 != 2345"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 && 1000 == 1000 && 6.4 >= 1.1 && 1234 != 2345 || 5 < 2"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 && 1000 == 1000 && 6.4 >= 1.1 && 1234 != 2345 || 2 < 5"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 && 1000 == 1000 && 6.4 >= 1.1 && 1234 == 2345 || 2 < 5"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 && 1000 == 1000 && 6.4 >= 1.1 && 1234 == 2345 || 5 < 2"));
+    testStatic(STATIC_EXPRESSION("5 + 2 < 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 <= 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 > 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 >= 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 == 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("5 + 2 != 7 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 < 5 + 2 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 <= 5 + 2 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 > 5 + 2 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("7 >= 5 + 2 and 4 < 8"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 and 1000 == 1000 and 6.4 >= 1.1 and 1234 != 2345"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 and 1000 == 1000 and 6.4 >= 1.1 and 1234 != 2345 or 5 < 2"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 and 1000 == 1000 and 6.4 >= 1.1 and 1234 != 2345 or 2 < 5"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 and 1000 == 1000 and 6.4 >= 1.1 and 1234 == 2345 or 2 < 5"));
+    testStatic(STATIC_EXPRESSION("2.1 < 2.2 and 1000 == 1000 and 6.4 >= 1.1 and 1234 == 2345 or 5 < 2"));
+    testStatic(STATIC_EXPRESSION("peakTimes[0]"));
+    testStatic(STATIC_EXPRESSION("peakTimes[0] == 1.5"));
+    testStatic(STATIC_EXPRESSION("peakTimes[1]"));
+    testStatic(STATIC_EXPRESSION("peakTimes[1] == 2.5"));
+    testStatic(STATIC_EXPRESSION("peakTimes[2]"));
+    testStatic(STATIC_EXPRESSION("peakTimes[2] == 3.5"));
+    testStatic(STATIC_EXPRESSION("hitsAna_energy == 6000 and peakTimes[0] == 1.5"));
+    testStatic(STATIC_EXPRESSION("hitsAna_energy == 6000 and peakTimes[1] == 2.5"));
+    testStatic(STATIC_EXPRESSION("hitsAna_energy == 6000 and peakTimes[2] == 3.5"));
+
+    auto cut = STATIC_EXPRESSION("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5");
+    static_assert(decltype(cut)::isBool, "cut must be boolean");
+    static_assert(decltype(cut)::numVariables == 2, "cut has two variables");
+    assert((cut.variables() == vector<string>{"hitsAna_energy", "hitsAna_xy2Sigma"}));
+    float event[2] = {6000, 0.2f};
+    assert(cut(event));
+    event[1] = 0.7f;
+    assert(!cut(event));
+    // unary operators are supported by the compile time parser
+    auto neg = STATIC_EXPRESSION("!(x < -2) and not x > 3");
+    assert(neg(vector<double>{0.0}));
+    assert(!neg(vector<double>{-3.0}));
+    assert(!neg(vector<double>{4.0}));
+}
+
+struct TestEvent {
+    float energy;
+    double sigma;
+    vector<float> peakTimes;
+};
+
+void sources(){
+    auto cut = parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5 && peakTimes[1] == 2.5");
+    auto compiled = compileExpression(cut);
+    assert(compiled.isBool);
+    assert((compiled.scalars == vector<string>{"hitsAna_energy", "hitsAna_xy2Sigma"}));
+
+    // maps taken by reference, values updated in place between events
+    map<string, float> event = m;
+    MapSource mapSrc(event, maps);
+    auto binding = bindVariables(mapSrc, compiled);
+    assert(evaluate(mapSrc, compiled, binding).getRight());
+    event["hitsAna_energy"] = 4000;
+    assert(!evaluate(mapSrc, compiled, binding).getRight());
+    assert(!evaluate(mapSrc, cut).getRight());
+
+    // flat arrays
+    FlatLayout layout({"hitsAna_xy2Sigma", "hitsAna_energy"}, {"peakTimes"});
+    float values[2] = {0.2f, 6000};
+    float peaks[3] = {1.5, 2.5, 3.5};
+    FloatSpan spans[1] = {FloatSpan{peaks, 3}};
+    FlatSource flat(layout, values, spans);
+    binding = bindVariables(flat, compiled);
+    assert(evaluate(flat, compiled, binding).getRight());
+    assert(evaluate(flat, cut).getRight());
+    values[0] = 0.7f;
+    assert(!evaluate(flat, compiled, binding).getRight());
+    // arrays of a layout need spans
+    FlatSource noSpans(layout, values);
+    bool failed = false;
+    try{ evaluate(noSpans, compiled, bindVariables(noSpans, compiled)); } catch (domain_error& e){ failed = string(e.what()).find("peakTimes") != string::npos; }
+    assert(failed);
+    auto scalarsOnly = compileExpression(parseExpression("hitsAna_energy > 5000"));
+    assert(evaluate(noSpans, scalarsOnly, bindVariables(noSpans, scalarsOnly)).getRight());
+
+    // structs via member pointers
+    StructLayout<TestEvent> structLayout;
+    structLayout.AddScalar("hitsAna_energy", &TestEvent::energy)
+                .AddScalar("hitsAna_xy2Sigma", &TestEvent::sigma)
+                .AddArray("peakTimes", &TestEvent::peakTimes);
+    TestEvent ev{6000, 0.2, {1.5, 2.5}};
+    StructSource<TestEvent> structSrc(structLayout, ev);
+    binding = bindVariables(structSrc, compiled);
+    assert(evaluate(structSrc, compiled, binding).getRight());
+    ev.peakTimes[1] = 3.0;
+    assert(!evaluate(structSrc, compiled, binding).getRight());
+    auto obs = compileExpression(parseExpression("peakTimes[0] * 2 - 1"));
+    assert(evaluate(structSrc, obs, bindVariables(structSrc, obs)).getLeft() == 2.0);
+}
+
+void histograms(){
+    vector<ColumnChunk> chunks(4);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> energy;
+        vector<float> sigma;
+        for(int i = 0; i < 100; i++){
+            energy.push_back(c * 100 + i);
+            sigma.push_back((i % 10) / 10.0);
+        }
+        chunks[c].AddColumn("energy", energy);
+        chunks[c].AddColumn("sigma", sigma);
+    }
+    // 40 bins of width 10 in [0, 400)
+    Histogram1D h(Binning{40, 0.0, 400.0});
+    fillHistogram(h, chunks, parseExpression("energy"));
+    assert(h.GetEntries() == 400);
+    for(size_t i = 0; i < 40; i++) assert(h.GetBinContent(i) == 10);
+
+    // shifted observable with a cut, in parallel. Must agree with a single thread
+    auto obs = parseExpression("energy * 2 - 100");
+    auto cut = parseExpression("sigma < 0.5 && energy >= 100");
+    Histogram1D serial(Binning{10, 0.0, 500.0});
+    Histogram1D parallel(Binning{10, 0.0, 500.0});
+    fillHistogram(serial, chunks, obs, cut, 1);
+    fillHistogram(parallel, chunks, obs, cut, 3);
+    assert(serial.counts == parallel.counts);
+    assert(serial.GetEntries() == 150);
+    assert(serial.GetUnderflow() == 0);
+    assert(serial.GetBinContent(2) == 15);
+    assert(serial.GetOverflow() == 50);
+
+    Histogram2D h2(Binning{4, 0.0, 400.0}, Binning{2, 0.0, 1.0});
+    fillHistogram(h2, chunks, parseExpression("energy"), parseExpression("sigma"), nullptr, 2);
+    assert(h2.GetBinContent(0, 0) == 50 && h2.GetBinContent(3, 1) == 50);
+
+    // NaN values are discarded, errors of the fill reach the caller for any thread count
+    ColumnChunk nan;
+    nan.AddColumn("x", {1, NAN, 3});
+    Histogram1D h3(Binning{4, 0.0, 4.0});
+    fillHistogram(h3, {nan}, parseExpression("x"));
+    assert(h3.GetEntries() == 2);
+    for(int nThreads : {1, 3}){
+        bool failed = false;
+        try{ fillHistogram(h3, chunks, parseExpression("energy > 1"), nullptr, nThreads); }
+        catch (domain_error&) { failed = true; }
+        assert(failed);
+    }
+}
+
+void aggregates(){
+    vector<ColumnChunk> chunks(7);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> x;
+        for(int i = 0; i < 1000; i++) x.push_back(c * 1000 + i);
+        chunks[c].AddColumn("x", x);
+    }
+    auto res = aggregate(chunks, parseExpression("x"));
+    assert(res.count == 7000);
+    assert(res.sum == 6999.0 * 7000.0 / 2.0);
+    assert(res.mean == 3499.5);
+    assert(res.min == 0 && res.max == 6999);
+    // variance of 0 .. n-1 is (n^2 - 1) / 12
+    assert(fabs(res.variance - (7000.0 * 7000.0 - 1.0) / 12.0) < 1e-6);
+
+    // filtered, and bit identical for any number of threads
+    auto exprs = vector<Expression>{parseExpression("x / 3"), parseExpression("x * 0.1 + 0.7")};
+    auto cut = parseExpression("x > 1234.5");
+    auto serial = aggregate(chunks, exprs, cut, 1);
+    for(int t = 2; t <= 8; t++){
+        auto parallel = aggregate(chunks, exprs, cut, t);
+        for(size_t e = 0; e < exprs.size(); e++){
+            assert(parallel[e].count == serial[e].count);
+            assert(parallel[e].sum == serial[e].sum);
+            assert(parallel[e].variance == serial[e].variance);
+        }
+    }
+    assert(serial[0].count == 7000 - 1235);
+    assert(serial[0].min == 1235.0 / 3.0);
+    assert(aggregate(chunks, parseExpression("x"), parseExpression("x < 0")).count == 0);
+
+    // NaN values are skipped like by histograms, not summed into the aggregate
+    chunks[2].GetColumn("x")[10] = numeric_limits<float>::quiet_NaN();
+    res = aggregate(chunks, parseExpression("x"));
+    assert(res.count == 6999 && res.sum == 6999.0 * 7000.0 / 2.0 - 2010.0);
+    assert(!std::isnan(res.mean) && !std::isnan(res.variance) && res.min == 0 && res.max == 6999);
+    Histogram1D h(Binning{10, 0, 7000});
+    fillHistogram(h, chunks, parseExpression("x"));
+    assert(h.GetEntries() == (double)res.count);
+}
+
+void bitmaps(){
+    vector<ColumnChunk> chunks(3);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> x;
+        for(int i = 0; i < 100; i++) x.push_back(c * 100 + i);
+        chunks[c].AddColumn("x", x);
+    }
+    auto a = evaluateBitmap(chunks, parseExpression("x >= 50"));
+    auto b = evaluateBitmap(chunks, parseExpression("x < 250"));
+    assert(a.size == 300 && a.Count() == 250);
+    assert(!a.Get(49) && a.Get(50) && a.Get(299));
+    assert((a & b).Count() == 200);
+    assert((a | b).Count() == 300);
+    assert(andNot(a, b).Count() == 50);
+    assert(cutFlowCounts({a, b}) == (vector<size_t>{250, 200}));
+
+    // run-length encoded form
+    auto sparse = evaluateBitmap(chunks, parseExpression("x > 10 && x < 20 || x > 270 && x <= 280"));
+    auto c = CompressedBitmap::Compress(sparse);
+    assert(c.runs.size() == 2 && c.Count() == sparse.Count() && c.Count() == 19);
+    assert(c.Decompress().words == sparse.words);
+    auto ca = CompressedBitmap::Compress(a);
+    assert((c & ca).Count() == (sparse & a).Count());
+    assert((c | ca).Decompress().words == (sparse | a).words);
+}
+
+void cutFlows(){
+    vector<ColumnChunk> chunks(5);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> run;
+        vector<float> energy;
+        for(int i = 0; i < 200; i++){
+            run.push_back(c);
+            energy.push_back(i * 10);
+        }
+        chunks[c].AddColumn("run", run);
+        chunks[c].AddColumn("energy", energy);
+    }
+    CutFlow flow({"energy >= 100", "run != 2", "energy < 1000 && energy * 2 > 500", "run > 3"});
+    for(int t = 1; t <= 3; t++){
+        auto stages = flow.Run(chunks, t);
+        assert(stages.size() == 4);
+        assert(stages[0].passed == 5 * 190);
+        assert(stages[1].passed == 4 * 190);
+        assert(stages[2].passed == 4 * 74);
+        assert(stages[3].passed == 74);
+        assert(stages[2].cut == "energy < 1000 && energy * 2 > 500");
+    }
+    // must agree with the cut-flow computed from bitmaps
+    vector<SelectionBitmap> bms;
+    for(auto& e : flow.exprs) bms.push_back(evaluateBitmap(chunks, e));
+    auto counts = cutFlowCounts(bms);
+    auto stages = flow.Run(chunks);
+    for(size_t s = 0; s < stages.size(); s++) assert(stages[s].passed == counts[s]);
+}
+
+void symbols(){
+    auto a = parseExpression("hitsAna_energy > 5000 && peakTimes[1] < 3");
+    auto b = parseExpression("hitsAna_energy * 2");
+    auto id = SymbolTable::Global().Find("hitsAna_energy");
+    assert(id != noSymbol);
+    assert(a->GetLeft()->GetLeft()->GetIdentId() == id);
+    assert(b->GetLeft()->GetIdentId() == id);
+    assert(symbolName(id) == "hitsAna_energy");
+    assert(&a->GetLeft()->GetLeft()->GetIdent() == &b->GetLeft()->GetIdent());
+    // bracket expressions carry the id of the element
+    auto bracket = a->GetRight()->GetLeft();
+    assert(bracket->kind == nkBracketExpr);
+    assert(bracket->GetIdentId() == SymbolTable::Global().Find("peakTimes[1]"));
+    assert(compileExpression(b).scalarIds == vector<uint32_t>{id});
+
+    // concurrent interning hands out one id per name
+    vector<thread> threads;
+    vector<vector<uint32_t>> ids(4);
+    for(int t = 0; t < 4; t++){
+        threads.push_back(thread([&ids, t](){
+            for(int i = 0; i < 100; i++) ids[t].push_back(internSymbol("sym" + to_string(i)));
+        }));
+    }
+    for(auto& th : threads) th.join();
+    for(int t = 1; t < 4; t++) assert(ids[t] == ids[0]);
+
+    // chunks only hold the columns they have, however many symbols exist
+    ColumnChunk chunk;
+    chunk.AddColumn("sym99", {1, 2});
+    chunk.AddColumn("sym3", {3, 4});
+    assert(chunk.columns.size() == 2 && chunk.GetColumn("sym99")[1] == 2 && chunk.GetColumn("sym3")[0] == 3);
+    bool missing = false;
+    try{ chunk.GetColumn("sym4"); } catch (domain_error&) { missing = true; }
+    assert(missing);
+}
+
+void catalogue(){
+    vector<string> sources;
+    for(int i = 0; i < 500; i++){
+        if(i % 100 == 7) sources.push_back("energy > (" + to_string(i));
+        else sources.push_back("energy > " + to_string(i) + " * 2 + 1 && sigma < 0." + to_string(i % 10));
+    }
+    auto entries = compileCatalogue(sources, 4);
+    assert(entries.size() == sources.size());
+    for(size_t i = 0; i < entries.size(); i++){
+        assert(entries[i].source == sources[i]);
+        assert(entries[i].ok == (i % 100 != 7));
+        assert(entries[i].ok || entries[i].error.length() > 0);
+    }
+    // constants are folded
+    assert(astToStr(entries[3].ast) == "(&& (> energy 7.000000) (< sigma 0.300000))");
+    map<string, float> event = { {"energy", 8}, {"sigma", 0.2} };
+    MapSource src(event, maps);
+    assert(evaluate(src, entries[3].compiled, bindVariables(src, entries[3].compiled)).getRight());
+    assert(astToStr(foldConstants(parseExpression("(5 + 10) / 2"))) == "7.500000");
+
+    // malformed entries are reported, not fatal
+    auto bad = compileCatalogue({"energy > 1", "", "()", "energy > > 1", "energy sigma", "a[]"}, 2);
+    assert(bad[0].ok);
+    for(size_t i = 1; i < bad.size(); i++) assert(!bad[i].ok && bad[i].error.length() > 0);
+}
+
+void encodedColumns(){
+    vector<float> detector;
+    vector<int64_t> trigger;
+    for(int i = 0; i < 1000; i++){
+        detector.push_back((i * 7) % 13 + 0.5f);
+        trigger.push_back(100 + (i * 3) % 37);
+    }
+    ColumnChunk plain;
+    plain.AddColumn("detector", detector);
+    plain.AddColumn("trigger", vector<float>(trigger.begin(), trigger.end()));
+    ColumnChunk encoded;
+    encoded.AddDictionaryColumn("detector", DictionaryColumn::Encode(detector));
+    encoded.AddBitPackedColumn("trigger", BitPackedColumn::Pack(trigger));
+    assert(encoded.dictionaries.begin()->second.dictionary.size() == 13);
+    assert(encoded.packed.begin()->second.bits == 6);
+    for(size_t i = 0; i < trigger.size(); i++) assert(encoded.packed.begin()->second.Get(i) == trigger[i]);
+
+    vector<string> exprs = {"detector == 3.5", "detector != 3.5", "detector < 4", "5.5 <= detector",
+                            "trigger > 110", "trigger >= 110.5", "trigger < 120.5", "trigger <= 99",
+                            "trigger == 117", "trigger != 117", "trigger == 117.5", "136 < trigger",
+                            "trigger > 110 && detector == 0.5 || trigger == 101", "trigger * 2 + detector"};
+    for(auto& e : exprs){
+        auto expr = parseExpression(e);
+        auto a = evaluateBatch(plain, expr);
+        auto b = evaluateBatch(encoded, expr);
+        assert(a.isBool == b.isBool && a.mask == b.mask && a.values == b.values);
+        // also on a subset of the events
+        vector<uint32_t> idx = {0, 5, 17, 999};
+        auto c = evaluateBatch(plain, expr, idx);
+        auto d = evaluateBatch(encoded, expr, idx);
+        assert(c.mask == d.mask && c.values == d.values);
+    }
+    // zone maps work on the encoded statistics
+    assert(checkChunk(parseExpression("trigger > 200"), encoded) == cdSkip);
+    assert(checkChunk(parseExpression("detector < 13"), encoded) == cdAccept);
+
+    // NaN gets its own dictionary entry
+    vector<float> withNan = {1, NAN, 2, NAN, 1, NAN};
+    auto dict = DictionaryColumn::Encode(withNan);
+    assert(dict.dictionary.size() == 3);
+    for(size_t i = 0; i < withNan.size(); i++) assert(dict.Get(i) == withNan[i] || (withNan[i] != withNan[i] && dict.Get(i) != dict.Get(i)));
+    ColumnChunk plainNan, encodedNan;
+    plainNan.AddColumn("x", withNan);
+    encodedNan.AddDictionaryColumn("x", dict);
+    for(string e : {"x == 1", "x != 1", "x < 3"}){
+        auto expr = parseExpression(e);
+        assert(evaluateBatch(plainNan, expr).mask == evaluateBatch(encodedNan, expr).mask);
+        assert(checkChunk(expr, encodedNan) == cdEvaluate);
+    }
+}
+
+void typedColumns(){
+    const int64_t big = 9007199254740992LL; // 2^53
+    ColumnChunk chunk;
+    chunk.AddTypedColumn("eventId", TypedColumn::From(vector<int64_t>{big, big + 1, big + 2, 5}));
+    chunk.AddTypedColumn("detector", TypedColumn::From(vector<int32_t>{1, 2, 3, 4}));
+    chunk.AddTypedColumn("isGood", TypedColumn::From(vector<uint8_t>{1, 0, 1, 1}));
+    chunk.AddTypedColumn("energy", TypedColumn::From(vector<double>{0.5, 1.5, 2.5, 3.5}));
+    chunk.AddColumn("sigma", {0.1f, 0.2f, 0.3f, 0.4f});
+
+    assert(inferType(chunk, parseExpression("detector * 2 + 1")) == ctInt64);
+    assert(inferType(chunk, parseExpression("detector / 2")) == ctFloat64);
+    assert(inferType(chunk, parseExpression("detector + energy")) == ctFloat64);
+    assert(inferType(chunk, parseExpression("sigma + 1")) == ctFloat64);
+    assert(inferType(chunk, parseExpression("isGood && detector > 1")) == ctBool);
+    bool failed = false;
+    try{ inferType(chunk, parseExpression("isGood + 1")); } catch (domain_error&){ failed = true; }
+    assert(failed);
+
+    // int64 arithmetic keeps precision beyond 2^53, which doubles cannot
+    auto res = evaluateTyped(chunk, parseExpression("eventId - 9007199254740992 == 1"));
+    assert(res.type == ctBool);
+    assert((res.mask == vector<uint8_t>{0, 1, 0, 0}));
+    assert((evaluateBatch(chunk, parseExpression("eventId - 9007199254740992 == 1")).mask != res.mask));
+    res = evaluateTyped(chunk, parseExpression("detector * 3 - 1"));
+    assert(res.type == ctInt64 && (res.ints == vector<int64_t>{2, 5, 8, 11}));
+    res = evaluateTyped(chunk, parseExpression("detector / 2"));
+    assert(res.type == ctFloat64 && res.floats[0] == 0.5);
+    // native comparisons and bool columns
+    res = evaluateTyped(chunk, parseExpression("isGood == (detector >= 2) || energy < 1"));
+    assert((res.mask == vector<uint8_t>{1, 0, 1, 1}));
+    res = evaluateTyped(chunk, parseExpression("isGood && detector != 3 && sigma > 0.2"));
+    assert((res.mask == vector<uint8_t>{0, 0, 0, 1}));
+    res = evaluateTyped(chunk, parseExpression("detector < 2.5"));
+    assert((res.mask == vector<uint8_t>{1, 1, 0, 0}));
+    // zone maps use the statistics of typed columns
+    assert(checkChunk(parseExpression("detector > 4"), chunk) == cdSkip);
+    // int64 overflow near the limits makes the batch float64 instead of wrapping
+    const int64_t top = numeric_limits<int64_t>::max();
+    ColumnChunk ids;
+    ids.AddTypedColumn("id", TypedColumn::From(vector<int64_t>{top - 1, top, 5, numeric_limits<int64_t>::min()}));
+    res = evaluateTyped(ids, parseExpression("id + 1"));
+    assert(res.type == ctFloat64 && res.ints.empty() && res.floats[1] == (double)top + 1 && res.floats[2] == 6);
+    res = evaluateTyped(ids, parseExpression("id * 2"));
+    assert(res.type == ctFloat64 && res.floats[0] == 2.0 * (double)top && res.floats[3] < 0);
+    res = evaluateTyped(ids, parseExpression("0 - id"));
+    assert(res.type == ctFloat64 && res.floats[3] == (double)top + 1);
+    // the parser does not accept a leading unary minus, hence the hand built node
+    res = evaluateTyped(ids, unaryNode(uoMinus, parseExpression("id")));
+    assert(res.type == ctFloat64 && res.floats[3] == (double)top + 1 && res.floats[2] == -5);
+    // wrapping would turn the smallest id into the largest
+    res = evaluateTyped(ids, parseExpression("id - 1 > 0"));
+    assert((res.mask == vector<uint8_t>{1, 1, 1, 0}));
+    // without overflow the batch stays exact
+    res = evaluateTyped(ids, parseExpression("select(id > 0, id, 0) - 1"));
+    assert(res.type == ctInt64 && res.ints[1] == top - 1);
+}
+
+void singlePrecision(){
+    vector<ColumnChunk> chunks(3);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> x, y;
+        for(int i = 0; i < 200; i++){
+            x.push_back(0.1f * (float)(i + 200 * c));
+            y.push_back(1.0f + 1e-4f * (float)i);
+        }
+        chunks[c].AddColumn("x", x);
+        chunks[c].AddColumn("y", y);
+    }
+    auto n = parseExpression("x * y + 3");
+    auto single = evaluateBatch<float>(chunks[0], n);
+    auto ref = evaluateBatch(chunks[0], n);
+    assert(!single.isBool && single.values.size() == 200);
+    assert(fabs(single.values[150] - ref.values[150]) < 1e-5);
+    auto mask = evaluateBatch<float>(chunks[1], parseExpression("x > 30 && y < 1.016"), vector<uint32_t>{0, 150, 199});
+    assert((mask.mask == vector<uint8_t>{0, 1, 0}));
+
+    // the product stays within float rounding, the cuts select the same events
+    auto rep = validatePrecision(chunks, n);
+    assert(rep.events == 600 && rep.boolMismatches == 0);
+    assert(rep.maxAbsDeviation > 0.0 && rep.maxRelDeviation < 1e-6);
+    assert(rep.Acceptable(1e-6));
+    assert(validatePrecision(chunks, parseExpression("x >= 10.05 && y < 1.01505")).Acceptable(0.0));
+    // the fractional part of x is lost next to 2^24 in single precision
+    assert(!validatePrecision(chunks, parseExpression("(x + 16777216) - 16777216")).Acceptable(1e-3));
+    // 0.3f lies above the double 0.3, but not above 0.3 rounded to float
+    vector<ColumnChunk> edge(1);
+    edge[0].AddColumn("z", {0.3f, 0.5f});
+    rep = validatePrecision(edge, parseExpression("z > 0.3"));
+    assert(rep.events == 2 && rep.boolMismatches == 1 && !rep.Acceptable(1.0));
+
+    // compiled programs can run on a float stack as well
+    auto compiled = compileExpression(parseExpression("hitsAna_energy / 3 > 1000"));
+    map<string, float> event = m;
+    MapSource src(event, maps);
+    auto binding = bindVariables(src, compiled);
+    assert(evaluate<float>(src, compiled, binding).getRight() == evaluate(src, compiled, binding).getRight());
+}
+
+void predicateFusion(){
+    shared_ptr<Node> operand;
+    RangeCheck range;
+    assert(matchRange(parseExpression("x > 1 && x < 5"), operand, range));
+    assert(operand->GetIdent() == "x" && range.lo == 1 && range.hi == 5 && !range.loInclusive && !range.hiInclusive);
+    assert(matchRange(parseExpression("(5 + 1 >= peakTimes[1]) && 2 < peakTimes[1]"), operand, range));
+    assert(range.lo == 2 && range.hi == 6 && !range.loInclusive && range.hiInclusive);
+    assert(!matchRange(parseExpression("x > 1 && y < 5"), operand, range));
+    assert(!matchRange(parseExpression("x > 1 && x > 2"), operand, range));
+    vector<double> values;
+    assert(matchSet(parseExpression("id == 3 || id == 7 || (12 == id) || id == 15 || id == 7"), operand, values));
+    assert(operand->GetIdent() == "id" && values.size() == 5);
+    assert(!matchSet(parseExpression("id == 3 || id == 7 || id == 12"), operand, values));
+    assert(!matchSet(parseExpression("id == 3 || id == 7 || id == 12 || x == 15"), operand, values));
+
+    // dense integers go into a bitset, anything else is searched
+    MembershipSet dense({12, 3, 7, 15, 7});
+    assert(dense.bits.size() == 1 && dense.values.size() == 4);
+    assert(dense.Contains(7) && !dense.Contains(8) && !dense.Contains(7.5) && !dense.Contains(-1));
+    assert(!dense.Contains(numeric_limits<double>::quiet_NaN()));
+    MembershipSet sparse({0.5, 1e9, 3});
+    assert(sparse.bits.empty() && sparse.Contains(1e9) && !sparse.Contains(2));
+
+    // fused and unfused evaluation agree
+    ColumnChunk chunk;
+    vector<float> x, id;
+    for(int i = 0; i < 100; i++){
+        x.push_back(0.25f * (float)i);
+        id.push_back((float)(i % 20));
+    }
+    x[3] = numeric_limits<float>::quiet_NaN();
+    chunk.AddColumn("x", x);
+    chunk.AddColumn("id", id);
+    for(string src : {"x > 2 && x <= 10", "2 <= x && 10 > x", "id == 3 || id == 7 || id == 12 || id == 19",
+                      "(x * 2 >= 3 && x * 2 < 9) || id == 1 || id == 2 || id == 4 || id == 8"}){
+        auto n = parseExpression(src);
+        auto batch = evaluateBatch(chunk, n);
+        auto compiled = compileExpression(n);
+        assert(compiled.ranges.size() + compiled.sets.size() > 0);
+        for(int i = 0; i < 100; i++){
+            map<string, float> event{{"x", x[i]}, {"id", id[i]}};
+            bool expected = evaluate(event, n).getRight();
+            assert(batch.mask[i] == expected);
+            MapSource src(event, maps);
+            assert(evaluate(src, compiled, bindVariables(src, compiled)).getRight() == expected);
+        }
+    }
+    bool failed = false;
+    try{ compileExpression(parseExpression("(x > 1) > 0 && (x > 1) < 2")); } catch (domain_error&){ failed = true; }
+    assert(failed);
+
+    // nodes are matched on their first evaluation only, in single precision as well
+    auto n = parseExpression("id == 3 || id == 7 || id == 12 || id == 19");
+    assert(n->GetFused().load() == nullptr);
+    auto first = evaluateBatch(chunk, n);
+    auto fused = n->GetFused().load();
+    assert(fused != nullptr && fused->isSet && fused->operand->GetIdent() == "id");
+    assert(evaluateBatch(chunk, n).mask == first.mask && n->GetFused().load() == fused);
+    assert(evaluateBatch<float>(chunk, n).mask == first.mask && n->GetFused().load() == fused);
+    // nodes that do not fuse remember that too, and replacing a child matches again
+    auto plain = parseExpression("x > 2 && id < 3");
+    evaluateBatch(chunk, plain);
+    assert(plain->GetFused().load() != nullptr && plain->GetFused().load()->operand == nullptr);
+    plain->SetRight(parseExpression("x < 4"));
+    assert(plain->GetFused().load() == nullptr);
+    evaluateBatch(chunk, plain);
+    assert(!plain->GetFused().load()->isSet && plain->GetFused().load()->range.hi == 4);
+}
+
+void selects(){
+    auto n = parseExpression("select(x > 1, x * 2, 0 - x) + 1");
+    assert(astToStr(n) == "(+ (select (> x 1.000000) (* x 2.000000) (- 0.000000 x)) 1.000000)");
+    assert(evaluate(map<string, float>{{"x", 3}}, n).getLeft() == 7.0);
+    assert(evaluate(map<string, float>{{"x", -3}}, n).getLeft() == 4.0);
+    auto nested = parseExpression("select(x > 1 && y < 2, select(y < 0, 1, 2), y >= 3)");
+    assert(nested->kind == nkSelect && nested->GetTrueArm()->kind == nkSelect);
+    bool failed = false;
+    try{ parseExpression("select(x > 1, 2)"); } catch (domain_error&){ failed = true; }
+    assert(failed);
+    failed = false;
+    try{ compileExpression(parseExpression("select(x > 1, 2, y > 1)")); } catch (domain_error&){ failed = true; }
+    assert(failed);
+
+    // interval analysis takes the hull of the arms unless the condition is decided
+    auto range = evaluateRange({{"x", Interval{5, 6, false, false}}}, parseExpression("select(x > 1, 2, 3)"));
+    assert(range.getLeft().lo == 2 && range.getLeft().hi == 2);
+    range = evaluateRange({}, parseExpression("select(x > 1, 2, 3)"));
+    assert(range.getLeft().lo == 2 && range.getLeft().hi == 3);
+
+    // batch, compiled and tree evaluation agree, including a rarely taken expensive arm
+    ColumnChunk chunk;
+    vector<float> x, y;
+    for(int i = 0; i < 200; i++){
+        x.push_back((float)(i % 100));
+        y.push_back(0.5f * (float)i);
+    }
+    chunk.AddColumn("x", x);
+    chunk.AddColumn("y", y);
+    vector<uint32_t> indices = {0, 3, 98, 99, 150, 199};
+    for(string src : {"select(x > 1, x * 2, 0 - x) + 1", "select(x >= 97, x * y + y * 3 - 1, y)",
+                      "select(x < 2, (y + 1) * (y - 1), x)", "select(x > 50, y < 20, y > 90) || x == 3",
+                      "select(y > 1000, x, y)"}){
+        auto e = parseExpression(src);
+        auto compiled = compileExpression(e);
+        auto batch = evaluateBatch(chunk, e);
+        auto some = evaluateBatch(chunk, e, indices);
+        for(int i = 0; i < 200; i++){
+            map<string, float> event{{"x", x[i]}, {"y", y[i]}};
+            auto expected = evaluate(event, e);
+            MapSource src(event, maps);
+            auto res = evaluate(src, compiled, bindVariables(src, compiled));
+            if(batch.isBool){
+                assert(batch.mask[i] == expected.getRight() && res.getRight() == expected.getRight());
+            }
+            else{
+                assert(batch.values[i] == expected.getLeft() && res.getLeft() == expected.getLeft());
+            }
+        }
+        for(size_t k = 0; k < indices.size(); k++){
+            if(batch.isBool) assert(some.mask[k] == batch.mask[indices[k]]);
+            else assert(some.values[k] == batch.values[indices[k]]);
+        }
+    }
+
+    // typed evaluation and serialization
+    ColumnChunk typed;
+    typed.AddTypedColumn("n", TypedColumn::From(vector<int32_t>{1, 5, 9}));
+    auto res = evaluateTyped(typed, parseExpression("select(n > 4, n * 2, 0 - 1)"));
+    assert(res.type == ctInt64 && (res.ints == vector<int64_t>{-1, 10, 18}));
+    map<string, Expression> exprs = {{"piecewise", nested}};
+    auto buf = serializeExpressions(exprs);
+    assert(astToStr(deserializeExpressions(buf.data(), buf.size())["piecewise"]) == astToStr(nested));
+}
+
+void tieredExecution(){
+    map<string, float> event = m;
+    MapSource src(event, maps);
+    vector<Expression> exprs = {parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5"),
+                                parseExpression("hitsAna_energy * 2 + 1"),
+                                parseExpression("select(peakTimes[1] > 2, hitsAna_energy, 0 - 1)")};
+    TieredExecutor<MapSource> exec(src, exprs, 10);
+    auto expected = evaluate(src, exprs[0]).getRight();
+    for(int i = 0; i < 20; i++) assert(exec.Evaluate(0).getRight() == expected);
+    for(int i = 0; i < 5; i++) assert(exec.Evaluate(1).getLeft() == 12001.0);
+    exec.WaitForPromotions();
+    assert(exec.Tier(0) == etCompiled && exec.Tier(1) == etInterpreted && exec.Tier(2) == etInterpreted);
+    assert(exec.Evaluate(0).getRight() == expected);
+
+    // promotion while several threads evaluate, results do not change across the switch
+    vector<thread> threads;
+    atomic<int> mismatches(0);
+    for(int t = 0; t < 4; t++){
+        threads.push_back(thread([&](){
+            for(int i = 0; i < 2000; i++) mismatches += exec.Evaluate(2).getLeft() != 6000.0;
+        }));
+    }
+    for(auto& t : threads) t.join();
+    exec.WaitForPromotions();
+    assert(mismatches == 0);
+    auto stats = exec.Stats();
+    assert(stats[0].tier == etCompiled && stats[0].evaluations == 21 && stats[0].interpreted >= 10);
+    assert(stats[1].tier == etInterpreted && stats[1].evaluations == 5 && stats[1].interpreted == 5);
+    // how many calls ran interpreted depends on when the background promotion lands and
+    // on threads descheduled between counting a call and reading the tier. At least the
+    // call requesting the promotion did.
+    assert(stats[2].tier == etCompiled && stats[2].evaluations == 8000);
+    assert(stats[2].interpreted >= 1 && stats[2].interpreted <= stats[2].evaluations);
+    assert(toString(stats[2].tier) == "compiled");
+    // once promoted, calls run compiled
+    assert(exec.Evaluate(2).getLeft() == 6000.0);
+    assert(exec.Stats()[2].interpreted == stats[2].interpreted);
+}
+
+void registry(){
+    ExpressionRegistry reg(8);
+    assert(reg.Publish(map<string, string>{{"energy", "hitsAna_energy > 5000"}, {"sigma", "hitsAna_xy2Sigma * 2"}}) == 1);
+    // throws once all slots are taken, see below
+    int reader = reg.RegisterReader();
+    {
+        auto set = reg.Read(reader);
+        assert(set->version == 1 && set->Size() == 2 && set->Find("sigma") == 1 && set->Find("x") == -1);
+        // a version pinned by a reader survives being replaced
+        reg.Publish(map<string, string>{{"energy", "hitsAna_energy > 7000"}});
+        assert(reg.Version() == 2 && reg.Reclaim() == 1);
+        assert(set->version == 1 && astToStr(set->exprs[0]) == "(> hitsAna_energy 5000.000000)");
+    }
+    assert(reg.Reclaim() == 0);
+
+    // readers evaluate batches while a writer keeps publishing `x < version`
+    ColumnChunk chunk;
+    vector<float> x;
+    for(int i = 0; i < 1000; i++) x.push_back((float)i);
+    chunk.AddColumn("x", x);
+    atomic<bool> done(false);
+    atomic<int> errors(0);
+    vector<thread> readers;
+    for(int t = 0; t < 4; t++){
+        readers.push_back(thread([&](){
+            int slot = reg.RegisterReader();
+            uint64_t last = 0;
+            while(!done){
+                auto set = reg.Read(slot);
+                if(set->Find("cut") < 0) continue;
+                auto res = evaluateBatch(chunk, set->exprs[set->Find("cut")]);
+                size_t passed = count(res.mask.begin(), res.mask.end(), 1);
+                // versions never go backwards and each matches its own expression
+                errors += set->version < last || passed != min<size_t>(set->version, 1000);
+                last = set->version;
+            }
+            reg.UnregisterReader(slot);
+        }));
+    }
+    for(int v = 3; v < 300; v++) reg.Publish(map<string, string>{{"cut", "x < " + to_string(v)}});
+    done = true;
+    for(auto& t : readers) t.join();
+    assert(errors == 0);
+    assert(reg.Reclaim() == 0 && reg.Version() == 299);
+    reg.UnregisterReader(reader);
+
+    // running out of reader slots throws, unregistered slots are reused
+    ExpressionRegistry small(2);
+    int a = small.RegisterReader();
+    int b = small.RegisterReader();
+    assert(a != b);
+    bool full = false;
+    try{ small.RegisterReader(); } catch (runtime_error& e) { full = string(e.what()).find("reader slots") != string::npos; }
+    assert(full);
+    small.UnregisterReader(a);
+    assert(small.RegisterReader() == a);
+}
+
+void allocationFree(){
+    auto cut = compileExpression(parseExpression("hitsAna_energy > 5000 + 100 && hitsAna_xy2Sigma < 0.5 && peakTimes[1] == 2.5"));
+    auto obs = compileExpression(parseExpression("select(peakTimes[0] > 1, hitsAna_energy * 2, hitsAna_xy2Sigma) + 1"));
+    auto ids = compileExpression(parseExpression("x > 2 && x < 8 || x == 11 || x == 13 || x == 17 || x == 19"));
+    map<string, float> event = m;
+    MapSource src(event, maps);
+    BoundExpression<MapSource> boundCut(src, cut);
+    BoundExpression<MapSource> boundObs(src, obs);
+    auto binding = bindVariables(src, cut);
+
+    ColumnChunk chunk;
+    vector<float> x;
+    for(int i = 0; i < 256; i++) x.push_back((float)(i % 25));
+    chunk.AddColumn("x", x);
+    chunk.AddDictionaryColumn("hitsAna_energy", DictionaryColumn::Encode(vector<float>(256, 6000)));
+    chunk.AddColumn("hitsAna_xy2Sigma", vector<float>(256, 0.2f));
+    chunk.AddColumn("peakTimes[0]", vector<float>(256, 1.5f));
+    chunk.AddColumn("peakTimes[1]", vector<float>(256, 2.5f));
+    BatchProgram batchCut(cut, 256);
+    BatchProgram batchObs(obs, 256);
+    BatchProgram batchIds(ids, 256);
+    vector<uint8_t> mask(256);
+
+    // no allocation per event or per chunk once everything is set up
+    size_t before = allocations;
+    double sum = 0.0;
+    for(int i = 0; i < 1000; i++){
+        event["hitsAna_energy"] = (float)(4000 + i * 3);
+        sum += boundCut.Evaluate().getRight();
+        sum += boundObs.Evaluate().getLeft();
+        sum += evaluate(src, cut, binding).getRight();
+    }
+    for(int i = 0; i < 10; i++){
+        batchCut.Run(chunk, mask.data());
+        sum += batchObs.Run(chunk)[0];
+        batchIds.Run(chunk, mask.data());
+    }
+    assert(allocations == before);
+    assert(sum > 0.0);
+
+    // the batch program agrees with the batch evaluator
+    auto res = evaluateBatch(chunk, parseExpression("x > 2 && x < 8 || x == 11 || x == 13 || x == 17 || x == 19"));
+    assert(res.mask == mask);
+    batchCut.Run(chunk, mask.data());
+    assert(count(mask.begin(), mask.end(), 1) == 256);
+    assert(batchObs.Run(chunk)[7] == 12001.0);
+    bool failed = false;
+    ColumnChunk big;
+    big.AddColumn("x", vector<float>(300, 1.0f));
+    try{ batchIds.Run(big); } catch (length_error&){ failed = true; }
+    assert(failed);
+}
+
+void canonicalForms(){
+    auto a = canonicalize(parseExpression("a > 5 && b < 3"));
+    auto b = canonicalize(parseExpression("(b < 3) and 5 < a"));
+    assert(astToStr(a) == astToStr(b));
+    assert(structuralHash(a) == structuralHash(b));
+    assert(structuralHash(parseExpression("(x + 1)")) == structuralHash(parseExpression("x + 1")));
+    // the hash depends on names and constants only, never on symbol ids or addresses
+    assert(structuralHash(parseExpression("hitsAna_energy > 5000")) == 0xd32533bbe667339cULL);
+    assert(structuralHash(a) != structuralHash(canonicalize(parseExpression("a > 5 && b < 4"))));
+    assert(structuralHash(parseExpression("a - b")) != structuralHash(parseExpression("b - a")));
+    assert(astToStr(canonicalize(parseExpression("x * 2 >= y"))) == astToStr(canonicalize(parseExpression("y <= 2 * x"))));
+    auto chain = canonicalize(parseExpression("c == 1 || (a == 2 || b == 3)"));
+    assert(astToStr(chain) == astToStr(canonicalize(parseExpression("b == 3 || a == 2 || 1 == c"))));
+
+    // canonical forms evaluate like the original
+    map<string, float> event{{"a", 6}, {"b", 2}, {"c", 1}, {"x", 1.5}, {"y", 3}};
+    for(string src : {"a > 5 && b < 3", "x * 2 >= y", "select(a >= b, a - b, b - a) + 1", "c == 1 || (a == 2 || b == 3)"}){
+        auto e = parseExpression(src);
+        auto c = canonicalize(e);
+        auto x = evaluate(event, e);
+        auto y = evaluate(event, c);
+        assert(x.isLeft() == y.isLeft());
+        assert(x.isLeft() ? x.getLeft() == y.getLeft() : x.getRight() == y.getRight());
+    }
+
+    // hash consing shares equal subtrees between expressions
+    HashConsTable table;
+    auto e1 = canonicalize(parseExpression("x * 2 + 1 > 3"), &table);
+    auto e2 = canonicalize(parseExpression("y < (1 + 2 * x)"), &table);
+    assert(e1->GetRight() == e2->GetRight());
+    size_t size = table.Size();
+    auto e3 = canonicalize(parseExpression("3 < (1 + x * 2)"), &table);
+    assert(e3 == e1 && table.Size() == size);
+}
+
+void resultCache(){
+    char dir[] = "/tmp/teval_cache_XXXXXX";
+    if(mkdtemp(dir) == nullptr) throw runtime_error("Could not create " + string(dir));
+    string input = string(dir) + "/input.dat";
+    vector<ColumnChunk> chunks(3);
+    vector<float> data;
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> x;
+        for(int i = 0; i < 100; i++) x.push_back((float)(c * 100 + i));
+        chunks[c].AddColumn("x", x);
+        data.insert(data.end(), x.begin(), x.end());
+    }
+    {
+        ofstream f(input, ios::binary);
+        f.write((const char*)data.data(), data.size() * sizeof(float));
+    }
+    auto file = fileIdentity(input);
+    assert(file.size == data.size() * sizeof(float));
+
+    ResultCache cache(string(dir) + "/cache", 0);
+    auto cut = parseExpression("x > 50 && x < 250");
+    auto expected = evaluateBitmap(chunks, cut);
+    auto first = cachedBitmap(cache, file, chunks, cut);
+    assert(first.Kind() == ckBitmap && first.Size() == 300);
+    assert(cache.Stats().misses == 1 && cache.Stats().stores == 1);
+    // an equal cut spelled differently is served from the cache
+    auto second = cachedBitmap(cache, file, chunks, parseExpression("(x < 250) and 50 < x"));
+    assert(cache.Stats().hits == 1 && cache.Stats().stores == 1);
+    assert(second.ToBitmap().words == expected.words && second.ToBitmap().Count() == 199);
+
+    auto obs = parseExpression("x * 2");
+    cachedColumn(cache, file, chunks, obs);
+    auto column = cachedColumn(cache, file, chunks, parseExpression("2 * x"));
+    assert(column.Kind() == ckColumn && column.Size() == 300 && column.Values()[123] == 246);
+    assert(cache.Stats().hits == 2);
+
+    // a modified file has a different identity and misses
+    data[0] = -1;
+    {
+        ofstream f(input, ios::binary);
+        f.write((const char*)data.data(), data.size() * sizeof(float));
+    }
+    auto changed = fileIdentity(input);
+    assert(changed.checksum != file.checksum);
+    assert(!cache.Load(ckBitmap, structuralHash(canonicalize(cut)), changed).Valid());
+
+    // processes and threads share the directory, a complete entry is always seen
+    vector<thread> threads;
+    atomic<int> bad{0};
+    for(int t = 0; t < 4; t++){
+        threads.emplace_back([&, t](){
+            for(int i = 0; i < 20; i++){
+                auto e = parseExpression("x < " + to_string(10 * (i % 5)));
+                auto res = cachedBitmap(cache, changed, chunks, e);
+                if(res.ToBitmap().Count() != (size_t)(10 * (i % 5))) bad++;
+            }
+        });
+    }
+    for(auto& t : threads) t.join();
+    assert(bad == 0);
+
+    // least recently used entries are evicted first
+    ResultCache small(string(dir) + "/small", 400);
+    for(int i = 0; i < 10; i++){
+        SelectionBitmap b(300, i % 2 == 0);
+        small.Store(i, file, b);
+        if(i > 0) assert(small.Load(ckBitmap, 0, file).Valid());
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    assert(small.DiskUsage() <= 400 && small.Stats().evictions > 0);
+    assert(small.Load(ckBitmap, 0, file).Valid() && small.Load(ckBitmap, 9, file).Valid());
+    assert(!small.Load(ckBitmap, 1, file).Valid());
+
+    system((string("rm -rf ") + dir).c_str());
+}
+
+static vector<ColumnChunk> shardChunks(size_t shard){
+    // two chunks of 100 events per shard
+    vector<ColumnChunk> chunks(2);
+    for(size_t c = 0; c < chunks.size(); c++){
+        vector<float> x, y;
+        for(int i = 0; i < 100; i++){
+            size_t event = (shard * 2 + c) * 100 + i;
+            x.push_back((float)((event * 37) % 1000) / 10);
+            y.push_back((float)(event % 7));
+        }
+        chunks[c].AddColumn("x", x);
+        chunks[c].AddColumn("y", y);
+    }
+    return chunks;
+}
+
+void sharded(){
+    ShardedJob job;
+    job.shards = 5;
+    job.load = shardChunks;
+    job.cuts = {parseExpression("x > 50"), parseExpression("y == 3 || x < 10")};
+    job.observables = {parseExpression("x * 0.1 + y"), parseExpression("x")};
+    job.histograms = {HistogramSpec{parseExpression("x"), Binning{20, 0, 100}}};
+    job.filter = parseExpression("y < 5");
+
+    vector<ColumnChunk> all;
+    for(size_t s = 0; s < job.shards; s++){
+        for(auto& c : shardChunks(s)) all.push_back(c);
+    }
+    auto check = [&](const ShardedResult& res){
+        for(size_t i = 0; i < job.cuts.size(); i++){
+            auto expected = evaluateBitmap(all, job.cuts[i]);
+            assert(res.selections[i].size == 1000 && res.selections[i].words == expected.words);
+        }
+        auto expected = aggregate(all, job.observables, job.filter);
+        for(size_t e = 0; e < expected.size(); e++){
+            // merged in the same order, hence bit identical
+            assert(res.aggregates[e].count == expected[e].count && res.aggregates[e].sum == expected[e].sum);
+            assert(res.aggregates[e].mean == expected[e].mean && res.aggregates[e].variance == expected[e].variance);
+            assert(res.aggregates[e].min == expected[e].min && res.aggregates[e].max == expected[e].max);
+        }
+        Histogram1D h(job.histograms[0].binning);
+        fillHistogram(h, all, job.histograms[0].obs, job.filter);
+        assert(res.histograms[0].counts == h.counts);
+    };
+    for(int workers : {1, 3, 8}){
+        auto res = evaluateSharded(job, workers);
+        assert(res.retries == 0);
+        check(res);
+    }
+
+    // a crashing worker only has its shard retried
+    char marker[] = "/tmp/teval_shard_XXXXXX";
+    int fd = mkstemp(marker);
+    assert(fd >= 0);
+    close(fd);
+    unlink(marker);
+    string markerPath = marker;
+    auto crashing = job;
+    crashing.load = [markerPath](size_t shard){
+        if(shard == 2 && access(markerPath.c_str(), F_OK) != 0){
+            // crashes the first time only
+            close(open(markerPath.c_str(), O_CREAT | O_WRONLY, 0644));
+            raise(SIGKILL);
+        }
+        return shardChunks(shard);
+    };
+    auto res = evaluateSharded(crashing, 3);
+    assert(res.retries == 1);
+    check(res);
+    unlink(markerPath.c_str());
+
+    // a hanging worker is killed once its shard runs out of time and the shard retried
+    auto hanging = job;
+    hanging.timeout = 1;
+    hanging.load = [markerPath](size_t shard){
+        if(shard == 1 && access(markerPath.c_str(), F_OK) != 0){
+            close(open(markerPath.c_str(), O_CREAT | O_WRONLY, 0644));
+            while(true) pause();
+        }
+        return shardChunks(shard);
+    };
+    res = evaluateSharded(hanging, 2);
+    assert(res.retries == 1);
+    check(res);
+    unlink(markerPath.c_str());
+
+    // a shard that keeps failing fails the job
+    auto broken = job;
+    broken.load = [](size_t shard){
+        if(shard == 4) _exit(3);
+        return shardChunks(shard);
+    };
+    bool failed = false;
+    try{ evaluateSharded(broken, 2, 2); } catch (runtime_error& e) { failed = string(e.what()).find("Shard 4 failed after 2") != string::npos; }
+    assert(failed);
+
+    // evaluation errors are reported without retrying
+    auto invalid = job;
+    invalid.cuts = {parseExpression("x + 1")};
+    failed = false;
+    try{ evaluateSharded(invalid, 2); } catch (runtime_error& e) { failed = string(e.what()).find("not a boolean") != string::npos; }
+    assert(failed);
+
+    // as is anything else thrown in a worker, which never unwinds into the caller
+    auto throwing = job;
+    throwing.load = [](size_t shard){
+        if(shard == 3) throw 42;
+        return shardChunks(shard);
+    };
+    failed = false;
+    try{ evaluateSharded(throwing, 2); } catch (runtime_error& e) { failed = string(e.what()) == "Shard 3: unknown exception"; }
+    assert(failed);
+}
+
+void pipeline(){
+    const size_t batchSize = 1000;
+    const size_t nBatches = 80;
+    Pipeline p({parseExpression("x * 2 + 1"), parseExpression("x > 500 && y < 3")}, batchSize, 3, 4);
+    assert(!p.isBool[0] && p.isBool[1]);
+    size_t read = 0;
+    auto reader = [&](ColumnChunk& chunk){
+        if(read == nBatches) return false;
+        if(chunk.size == 0){
+            chunk.AddColumn("x", vector<float>(batchSize));
+            chunk.AddColumn("y", vector<float>(batchSize));
+        }
+        // refills the recycled columns in place
+        auto& x = chunk.GetColumn("x");
+        auto& y = chunk.GetColumn("y");
+        for(size_t i = 0; i < batchSize; i++){
+            x[i] = (float)((read * batchSize + i) % 1000);
+            y[i] = (float)(i % 5);
+        }
+        read++;
+        return true;
+    };
+    vector<uint8_t> seen(nBatches, 0);
+    size_t consumed = 0, selected = 0, before = 0, after = 0;
+    bool correct = true;
+    p.Run(reader, [&](const PipelineBatch& b){
+        seen[b.sequence]++;
+        for(size_t i = 0; i < b.chunk.size; i++){
+            double x = (double)((b.sequence * batchSize + i) % 1000);
+            correct = correct && b.results[0][i] == x * 2 + 1 && b.results[1][i] == (double)(x > 500 && i % 5 < 3);
+            selected += b.results[1][i] != 0.0;
+        }
+        // once all stages are running, batches move through without allocating
+        consumed++;
+        if(consumed == 30) before = allocations;
+        if(consumed == 70) after = allocations;
+    });
+    assert(correct && before == after);
+    assert(count(seen.begin(), seen.end(), 1) == (long)nBatches);
+    size_t perBatch = 0;
+    for(size_t i = 501; i < batchSize; i++) perBatch += i % 5 < 3;
+    assert(selected == nBatches * perBatch);
+
+    auto m = p.Metrics();
+    assert(m.stages.size() == 3 && m.queues.size() == 3);
+    for(auto& s : m.stages) assert(s.batches == nBatches && s.busySeconds >= 0);
+    for(auto& q : m.queues) assert(q.maxDepth <= q.capacity && q.depth <= q.capacity);
+    assert(m.queues[0].capacity == 4);
+
+    // a failing stage stops the pipeline and its error is rethrown
+    read = 0;
+    bool failed = false;
+    try{
+        p.Run(reader, [&](const PipelineBatch& b){
+            if(b.sequence == 10) throw runtime_error("consumer failed");
+        });
+    }
+    catch (runtime_error& e) { failed = string(e.what()) == "consumer failed"; }
+    assert(failed);
+    // and the pipeline can run again afterwards
+    read = 0;
+    consumed = 0;
+    p.Run(reader, [&](const PipelineBatch&){ consumed++; });
+    assert(consumed == nBatches);
+
+    // with a slow reader the evaluators sleep and their wait counts as starved
+    Pipeline slow({parseExpression("x > 1")}, 10, 4, 2);
+    read = 0;
+    consumed = 0;
+    slow.Run([&](ColumnChunk& chunk){
+        if(read == 5) return false;
+        this_thread::sleep_for(chrono::milliseconds(10));
+        if(chunk.size == 0) chunk.AddColumn("x", vector<float>(10, 2));
+        read++;
+        return true;
+    }, [&](const PipelineBatch& b){ consumed += b.results[0][0] == 1.0; });
+    assert(consumed == 5);
+    m = slow.Metrics();
+    assert(m.stages[1].batches == 5 && m.stages[1].starvedSeconds >= 0.01);
+}
+
+void numa(){
+    assert((parseCpuList("0-3,8,10-11\n") == vector<int>{0, 1, 2, 3, 8, 10, 11}));
+    char root[] = "/tmp/teval_numa_XXXXXX";
+    if(mkdtemp(root) == nullptr) throw runtime_error("Could not create " + string(root));
+    auto writeFile = [](const string& path, const string& content){ ofstream(path) << content; };
+    for(string node : {"node0", "node1", "node2"}) mkdir((string(root) + "/" + node).c_str(), 0755);
+    writeFile(string(root) + "/node0/cpulist", "1000-1001\n");
+    writeFile(string(root) + "/node0/distance", "10 21 17\n");
+    writeFile(string(root) + "/node1/cpulist", "1002,1003\n");
+    writeFile(string(root) + "/node1/distance", "21 10 28\n");
+    // a node with memory but no CPUs
+    writeFile(string(root) + "/node2/cpulist", "\n");
+    writeFile(string(root) + "/possible", "0-2\n");
+    auto fake = NumaTopology::Detect(root);
+    assert(fake.nodes.size() == 2 && fake.CpuCount() == 4);
+    assert(fake.nodes[1].id == 1 && (fake.nodes[1].cpus == vector<int>{1002, 1003}));
+    assert(fake.Distance(0, 1) == 21 && fake.Distance(1, 1) == 10);
+    system((string("rm -rf ") + root).c_str());
+
+    auto real = NumaTopology::Detect();
+    assert(real.nodes.size() >= 1 && real.CpuCount() >= 1);
+
+    auto load = [](size_t c){
+        ColumnChunk chunk;
+        vector<float> x;
+        for(int i = 0; i < 500; i++) x.push_back((float)(c * 500 + i));
+        chunk.AddColumn("x", x);
+        return chunk;
+    };
+    auto cut = parseExpression("x > 1200 && x < 3600");
+    vector<ColumnChunk> plain;
+    for(size_t c = 0; c < 10; c++) plain.push_back(load(c));
+    auto expected = evaluateChunks(plain, cut);
+
+    for(auto* topo : {&fake, &real}){
+        NumaOptions opts;
+        opts.threadsPerNode = 2;
+        auto placed = placeChunks(*topo, 10, load, opts);
+        if(topo->nodes.size() == 2) assert((placed.nodes == vector<int>{0, 0, 0, 0, 0, 1, 1, 1, 1, 1}));
+        NumaRunStats st;
+        auto res = evaluateChunks(*topo, placed, cut, opts, &st);
+        assert(st.local + st.stolen == 10);
+        // the CPUs of the fake topology do not exist, its workers run unpinned
+        if(topo == &fake) assert(st.pinned == 0);
+        for(size_t c = 0; c < 10; c++) assert(res[c].mask == expected[c].mask);
+        opts.localFirst = false;
+        res = evaluateChunks(*topo, placed, cut, opts);
+        for(size_t c = 0; c < 10; c++) assert(res[c].mask == expected[c].mask);
+    }
+}
+
 int main() {
     simple();
     simpleInfix();
@@ -150,4 +1430,28 @@ int main() {
     boolEnglish();
     invalid();
     mapsTest();
+    intervals();
+    batches();
+    serialization();
+    staticExpressions();
+    sources();
+    histograms();
+    aggregates();
+    bitmaps();
+    cutFlows();
+    symbols();
+    catalogue();
+    encodedColumns();
+    typedColumns();
+    singlePrecision();
+    predicateFusion();
+    selects();
+    tieredExecution();
+    registry();
+    allocationFree();
+    canonicalForms();
+    resultCache();
+    sharded();
+    pipeline();
+    numa();
 }
@@ -0,0 +1,80 @@
+// the span tracing build, teval.cpp covers the default one
+#define EXPRESSION_TRACING
+#include "../expression_eval.h"
+#include <cassert>
+
+using namespace std;
+
+void spans(){
+    auto& tracer = Tracer::Global();
+    tracer.Clear();
+    {
+        TRACE_SPAN("read");
+        auto n = parseExpression("x > 2");
+        compileExpression(n);
+        ColumnChunk chunk;
+        chunk.AddColumn("x", {1, 2, 3});
+        thread worker([&](){ evaluateBatch(chunk, n); });
+        worker.join();
+    }
+    // parse, compile, read and one chunk evaluated on another thread
+    assert(tracer.Count() == 4);
+    auto json = tracer.ToJson();
+    assert(json.find("\"traceEvents\"") != string::npos);
+    assert(json.find("\"name\": \"parse\", \"ph\": \"X\"") != string::npos);
+    assert(json.find("\"name\": \"evaluate chunk\"") != string::npos);
+    // rings keep the most recent spans only
+    for(size_t i = 0; i < TraceBuffer::capacity + 10; i++){
+        TRACE_SPAN("span");
+    }
+    assert(tracer.Count() == TraceBuffer::capacity + 1);
+    tracer.WriteJson("/tmp/ttracing_trace.json");
+    ifstream f("/tmp/ttracing_trace.json");
+    assert(f.good());
+    tracer.Clear();
+    assert(tracer.Count() == 0);
+}
+
+void recycledBuffers(){
+    auto& tracer = Tracer::Global();
+    tracer.Clear();
+    size_t before = tracer.BufferCount();
+    // threads started one after another all write into the same buffer
+    for(int i = 0; i < 100; i++){
+        thread worker([](){ TRACE_SPAN("short lived"); });
+        worker.join();
+    }
+    assert(tracer.BufferCount() <= before + 1);
+    assert(tracer.Count() == 100);
+    // running threads never share one
+    vector<thread> workers;
+    atomic<int> started(0);
+    for(int i = 0; i < 4; i++){
+        workers.emplace_back([&](){
+            { TRACE_SPAN("concurrent"); }
+            started++;
+            while(started < 4) this_thread::yield();
+        });
+    }
+    for(auto& w : workers) w.join();
+    assert(tracer.BufferCount() >= 4);
+    assert(tracer.Count() == 104);
+    tracer.Clear();
+}
+
+void escapedNames(){
+    auto& tracer = Tracer::Global();
+    tracer.Clear();
+    {
+        TRACE_SPAN("say \"hi\" to C:\\tmp\n");
+    }
+    auto json = tracer.ToJson();
+    assert(json.find("\"name\": \"say \\\"hi\\\" to C:\\\\tmp\\u000a\", \"ph\"") != string::npos);
+    tracer.Clear();
+}
+
+int main() {
+    spans();
+    recycledBuffers();
+    escapedNames();
+}